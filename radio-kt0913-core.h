@@ -0,0 +1,1122 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * radio-kt0913-core.h
+ *
+ * Hardware independent logic of the KT0913 driver: register layout, band
+ * lookup, frequency/register conversions, status decoding and the seek and
+ * scan decisions, which are pure functions of their arguments. Then the
+ * register sequences built on them (init, band switch, tune, seek, scan),
+ * which reach the chip through struct kt0913_core_ops. The only
+ * dependencies are the fixed width types and errno, so the same code the
+ * driver runs can be built in userspace, on an emulated chip, to test or
+ * profile it.
+ *
+ *  Copyright (c) 2020 Santiago Hormazabal <santiagohssl@gmail.com>
+ */
+
+#ifndef _RADIO_KT0913_CORE_H
+#define _RADIO_KT0913_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/compiler.h>
+#else
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef int8_t s8;
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef int32_t s32;
+
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+#endif
+
+/* ************************************************************************* */
+
+/* registers of the kt0913 */
+#define KT0913_REG_CHIP_ID      0x01
+#define KT0913_REG_SEEK         0x02
+#define KT0913_REG_TUNE         0x03
+#define KT0913_REG_VOLUME       0x04
+#define KT0913_REG_DSPCFGA      0x05
+#define KT0913_REG_LOCFGA       0x0A
+#define KT0913_REG_LOCFGC       0x0C
+#define KT0913_REG_RXCFG        0x0F
+#define KT0913_REG_STATUSA      0x12
+#define KT0913_REG_STATUSB      0x13
+#define KT0913_REG_STATUSC      0x14
+#define KT0913_REG_AMSYSCFG     0x16
+#define KT0913_REG_AMCHAN       0x17
+#define KT0913_REG_AMCALI       0x18
+#define KT0913_REG_GPIOCFG      0x1D
+#define KT0913_REG_AMDSP        0x22
+#define KT0913_REG_AMSTATUSA    0x24
+#define KT0913_REG_AMSTATUSB    0x25
+#define KT0913_REG_SOFTMUTE     0x2E
+#define KT0913_REG_AMCFG        0x33
+#define KT0913_REG_AMCFG2       0x34
+#define KT0913_REG_AFC          0x3C
+
+/*
+ * register fields. each one is described once on kt0913_fields[]. the
+ * driver accesses them through __kt0913_field_*(), which merges updates to
+ * several fields of the same register into a single read-modify-write.
+ */
+enum kt0913_field {
+	KT0913_F_FMTUNE,	/* FM tune enable */
+	KT0913_F_FMCHAN,	/* frequency in kHz / 50kHz */
+	KT0913_F_DMUTE,		/* 0 = muted */
+	KT0913_F_DE,		/* de-emphasis time constant */
+	KT0913_F_POP,		/* audio dac anti-pop config */
+	KT0913_F_MONO,		/* mono select (0=stereo, 1=mono) */
+	KT0913_F_CAMPUSBAND,	/* campus band fm enable */
+	KT0913_F_STDBY,		/* standby mode enable */
+	KT0913_F_VOLUME,	/* volume control */
+	KT0913_F_XTAL_OK,	/* crystal ready indicator */
+	KT0913_F_STC,		/* seek/tune complete */
+	KT0913_F_PLL_LOCK,	/* system pll ready indicator */
+	KT0913_F_LO_LOCK,	/* LO synthesizer ready indicator */
+	KT0913_F_ST,		/* stereo indicator (3=stereo, otherwise mono) */
+	KT0913_F_FMRSSI,	/* FM RSSI (-100dBm + FMRSSI*3dBm) */
+	KT0913_F_PWSTATUS,	/* power status indicator */
+	KT0913_F_CHIPRDY,	/* chip ready indicator */
+	KT0913_F_FMSNR,		/* FM SNR (unknown units) */
+	KT0913_F_AM_FM,		/* am/fm mode control */
+	KT0913_F_REFCLK,	/* reference clock selection */
+	KT0913_F_AU_GAIN,	/* audio gain selection */
+	KT0913_F_AMTUNE,	/* AM tune enable */
+	KT0913_F_AMCHAN,	/* am channel in kHz */
+	KT0913_F_AMRSSI,	/* AM RSSI (-90dBm + AMRSSI*3dBm) */
+	KT0913_F_CAP_INDEX,	/* AM antenna calibration capacitor */
+	KT0913_F_FMSPACE,	/* FM seek channel spacing */
+	KT0913_F_AMSPACE,	/* AM seek channel spacing */
+	KT0913_F_AFC,		/* AFC deviation (two's complement) */
+	KT0913_F_MAX,
+};
+
+struct kt0913_reg_field {
+	u8 reg;
+	u8 lsb;
+	u8 msb;
+};
+
+#define KT0913_REG_FIELD(_reg, _lsb, _msb) \
+	{ .reg = (_reg), .lsb = (_lsb), .msb = (_msb) }
+
+static const struct kt0913_reg_field kt0913_fields[KT0913_F_MAX] = {
+	[KT0913_F_FMTUNE]	= KT0913_REG_FIELD(KT0913_REG_TUNE, 15, 15),
+	[KT0913_F_FMCHAN]	= KT0913_REG_FIELD(KT0913_REG_TUNE, 0, 11),
+	[KT0913_F_DMUTE]	= KT0913_REG_FIELD(KT0913_REG_VOLUME, 13, 13),
+	[KT0913_F_DE]		= KT0913_REG_FIELD(KT0913_REG_VOLUME, 11, 11),
+	[KT0913_F_POP]		= KT0913_REG_FIELD(KT0913_REG_VOLUME, 4, 5),
+	[KT0913_F_MONO]		= KT0913_REG_FIELD(KT0913_REG_DSPCFGA, 15, 15),
+	[KT0913_F_CAMPUSBAND]	= KT0913_REG_FIELD(KT0913_REG_LOCFGC, 3, 3),
+	[KT0913_F_STDBY]	= KT0913_REG_FIELD(KT0913_REG_RXCFG, 12, 12),
+	[KT0913_F_VOLUME]	= KT0913_REG_FIELD(KT0913_REG_RXCFG, 0, 4),
+	[KT0913_F_XTAL_OK]	= KT0913_REG_FIELD(KT0913_REG_STATUSA, 15, 15),
+	[KT0913_F_STC]		= KT0913_REG_FIELD(KT0913_REG_STATUSA, 14, 14),
+	[KT0913_F_PLL_LOCK]	= KT0913_REG_FIELD(KT0913_REG_STATUSA, 11, 11),
+	[KT0913_F_LO_LOCK]	= KT0913_REG_FIELD(KT0913_REG_STATUSA, 10, 10),
+	[KT0913_F_ST]		= KT0913_REG_FIELD(KT0913_REG_STATUSA, 8, 9),
+	[KT0913_F_FMRSSI]	= KT0913_REG_FIELD(KT0913_REG_STATUSA, 3, 7),
+	[KT0913_F_PWSTATUS]	= KT0913_REG_FIELD(KT0913_REG_STATUSC, 15, 15),
+	[KT0913_F_CHIPRDY]	= KT0913_REG_FIELD(KT0913_REG_STATUSC, 13, 13),
+	[KT0913_F_FMSNR]	= KT0913_REG_FIELD(KT0913_REG_STATUSC, 6, 12),
+	[KT0913_F_AM_FM]	= KT0913_REG_FIELD(KT0913_REG_AMSYSCFG, 15, 15),
+	[KT0913_F_REFCLK]	= KT0913_REG_FIELD(KT0913_REG_AMSYSCFG, 8, 11),
+	[KT0913_F_AU_GAIN]	= KT0913_REG_FIELD(KT0913_REG_AMSYSCFG, 6, 7),
+	[KT0913_F_AMTUNE]	= KT0913_REG_FIELD(KT0913_REG_AMCHAN, 15, 15),
+	[KT0913_F_AMCHAN]	= KT0913_REG_FIELD(KT0913_REG_AMCHAN, 0, 10),
+	[KT0913_F_AMRSSI]	= KT0913_REG_FIELD(KT0913_REG_AMSTATUSA, 8, 12),
+	[KT0913_F_CAP_INDEX]	= KT0913_REG_FIELD(KT0913_REG_AMCALI, 0, 13),
+	[KT0913_F_FMSPACE]	= KT0913_REG_FIELD(KT0913_REG_SEEK, 2, 3),
+	[KT0913_F_AMSPACE]	= KT0913_REG_FIELD(KT0913_REG_AMCFG, 0, 1),
+	[KT0913_F_AFC]		= KT0913_REG_FIELD(KT0913_REG_AFC, 0, 7),
+};
+
+/* field values */
+#define KT0913_SEEK_FMSPACE_200KHZ 0 /* 200kHz */
+#define KT0913_SEEK_FMSPACE_100KHZ 1 /* 100kHz */
+#define KT0913_SEEK_FMSPACE_50KHZ 2 /* 50kHz */
+
+#define KT0913_TUNE_FMTUNE_ON 1 /* FM Tune enabled */
+#define KT0913_TUNE_FMTUNE_OFF 0 /* FM Tune disabled */
+
+#define KT0913_VOLUME_DMUTE_ON 0
+#define KT0913_VOLUME_DMUTE_OFF 1
+#define KT0913_VOLUME_DE_75US 0 /* 75us */
+#define KT0913_VOLUME_DE_50US 1 /* 50us */
+
+#define KT0913_DSPCFGA_MONO_ON 1 /* mono */
+#define KT0913_DSPCFGA_MONO_OFF 0 /* stereo */
+
+#define KT0913_LOCFG_CAMPUSBAND_EN_ON 1 /* FM range 32-110MHz */
+#define KT0913_LOCFG_CAMPUSBAND_EN_OFF 0 /* FM range 64-110MHz */
+
+#define KT0913_RXCFGA_STDBY_ON 1 /* standby mode enabled */
+#define KT0913_RXCFGA_STDBY_OFF 0 /* standby mode disabled */
+
+#define KT0913_STATUSA_PLL_LOCK_LOCKED 1 /* system pll ready */
+#define KT0913_STATUSA_PLL_LOCK_UNLOCKED 0 /* not ready */
+#define KT0913_STATUSA_ST_STEREO 3 /* stereo */
+#define KT0913_STATUSA_FMRSSI_MAX 31
+
+#define KT0913_AMCHAN_AMTUNE_ON 1 /* AM tune enabled */
+#define KT0913_AMCHAN_AMTUNE_OFF 0 /* AM tune disabled */
+
+#define KT0913_AMSYSCFG_AM_FM_AM 1 /* am mode */
+#define KT0913_AMSYSCFG_AM_FM_FM 0 /* fm mode (default) */
+#define KT0913_AMSYSCFG_AU_GAIN_6DB 1 /* 6dB audio gain */
+#define KT0913_AMSYSCFG_AU_GAIN_3DB 0 /* 3dB audio gain (default) */
+#define KT0913_AMSYSCFG_AU_GAIN_0DB 3 /* 0dB audio gain */
+#define KT0913_AMSYSCFG_AU_GAIN_MIN_3DB 2 /* -3dB audio gain */
+
+#define KT0913_AMSTATUSA_AMRSSI_MAX 31
+
+#define KT0913_AMCFG_AMSPACE_1KHZ 0 /* 1kHz */
+#define KT0913_AMCFG_AMSPACE_9KHZ 1 /* 9kHz */
+#define KT0913_AMCFG_AMSPACE_10KHZ 2 /* 10kHz */
+
+/* constants */
+#define KT0913_CHIP_ID  0x544B /* ASCII of 'KT' */
+
+#define V4L2_KHZ_FREQ_MUL 16U /* v4l2 uses 16x the kHz value as their freq */
+#define KT0913_FMCHAN_MUL 50U /* kt0913 uses freqs with a 50kHz multiplier */
+#define KT0913_AFC_KHZ_PER_LSB 1 /* resolution of the FM AFC deviation */
+#define KT0913_FM_RANGE_LOW_NO_CAMPUS 64000U /* 64MHz lower bound for FM */
+#define KT0913_FM_RANGE_LOW_CAMPUS 32000U /* 32MHz lower bound for campus FM */
+#define KT0913_FM_RANGE_HIGH 110000U /* 110MHz upper bound for FM */
+#define KT0913_AM_RANGE_LOW  500U /* 500kHz lower bound for AM */
+#define KT0913_AM_RANGE_HIGH 1710U /* 1710kHz upper bound for AM */
+#define KT0913_FM_DEFAULT 86000U /* tuned at boot unless the DT says so */
+#define KT0913_AM_DEFAULT 504U /* tuned when AM is the boot band */
+#define KT0913_AMCALI_BIN_KHZ 100U /* AM sub-range sharing a calibration */
+#define KT0913_AMCALI_BINS \
+	((KT0913_AM_RANGE_HIGH - KT0913_AM_RANGE_LOW) / KT0913_AMCALI_BIN_KHZ + 1)
+
+#define KT0913_DEFAULT_FM_STEP 100U /* FM survey/seek step, in kHz */
+#define KT0913_DEFAULT_AM_STEP 9U /* AM survey/seek step, in kHz */
+#define KT0913_SEEK_FM_RSSI_MIN 12U /* FMRSSI that stops a seek (-64dBm) */
+#define KT0913_SEEK_AM_RSSI_MIN 10U /* AMRSSI that stops a seek (-60dBm) */
+
+/* bands where the kt0913 operates */
+enum { BAND_FM, BAND_FM_CAMUS, BAND_AM };
+
+/* a register and its value */
+struct kt0913_reg_val {
+	u8 reg;
+	u16 val;
+};
+
+/*
+ * written by the init, all of them: the chip may hold its power-on values
+ * or the ones of a previous bind
+ */
+static const struct kt0913_reg_val kt0913_init_regs[] = {
+	/* Standby disabled, volume 0dB */
+	{ KT0913_REG_RXCFG, 0x881F },
+	/* Right & Left unmuted, the FM spacing is set by kt0913_core_init() */
+	{ KT0913_REG_SEEK, 0x000B },
+	/* Stereo, High Stereo/Mono blend level, blend disabled */
+	{ KT0913_REG_DSPCFGA, 0x1000 },
+	/* FM AFC Enabled */
+	{ KT0913_REG_LOCFGA, 0x0100 },
+	/* Campus band disabled by default */
+	{ KT0913_REG_LOCFGC, 0x0024 },
+	/*
+	 * FM mode, internal defined bands, clock from XT, 32.768kHz
+	 * 3dB audio gain, AM AFC Enabled
+	 */
+	{ KT0913_REG_AMSYSCFG, 0x0002 },
+	/* Default AM freq = 504kHz, tuned by kt0913_core_init() if it's AM */
+	{ KT0913_REG_AMCHAN, 0x01F8 },
+	/* VOL and CH GPIOs set to HiZ */
+	{ KT0913_REG_GPIOCFG, 0x0000 },
+	/* AM Channel bandwidth = 6kHz, non-differential output */
+	{ KT0913_REG_AMDSP, 0xAFC4 },
+	/*
+	 * softmute is disabled on AM and FM, but set the defaults:
+	 * strong softmute attn., slow softmute attack/recover,
+	 * lowest AM softumte start level, almost the minimum
+	 * softmute target volume, RSSI mode for softmute, lowest
+	 * FM softmute start level
+	 */
+	{ KT0913_REG_SOFTMUTE, 0x0010 },
+	/* working mode A for the keys, the AM spacing is set later */
+	{ KT0913_REG_AMCFG, 0x1400 },
+	/* TIME1 = shortest, TIME2 = fastest */
+	{ KT0913_REG_AMCFG2, 0x4050 },
+	/* the boot frequency is tuned once by kt0913_core_init() */
+	/*
+	 * FM&AM Softmute disabled, Mute disabled, 75us deemp.,
+	 * no bass boost, 100uF anti pop cap
+	 */
+	{ KT0913_REG_VOLUME, 0xE080 },
+};
+
+/* limits of each band, in kHz */
+struct kt0913_band_limits {
+	u32 low;
+	u32 high;
+};
+
+static const struct kt0913_band_limits kt0913_band_limits[] = {
+	[BAND_FM] = { KT0913_FM_RANGE_LOW_NO_CAMPUS, KT0913_FM_RANGE_HIGH },
+	[BAND_FM_CAMUS] = { KT0913_FM_RANGE_LOW_CAMPUS, KT0913_FM_RANGE_HIGH },
+	[BAND_AM] = { KT0913_AM_RANGE_LOW, KT0913_AM_RANGE_HIGH },
+};
+
+/* ************************************************************************* */
+
+static inline u32 kt0913_field_mask(enum kt0913_field field)
+{
+	const struct kt0913_reg_field *f = &kt0913_fields[field];
+
+	return ((1U << (f->msb - f->lsb + 1)) - 1) << f->lsb;
+}
+
+/* extract a field from a register value */
+static inline u32 kt0913_field_get(enum kt0913_field field, u32 reg)
+{
+	return (reg & kt0913_field_mask(field)) >> kt0913_fields[field].lsb;
+}
+
+/* place a field value on its position of the register */
+static inline u32 kt0913_field_prep(enum kt0913_field field, u32 val)
+{
+	return (val << kt0913_fields[field].lsb) & kt0913_field_mask(field);
+}
+
+/* ************************************************************************* */
+
+static inline u32 khz_to_v4l2_freq(unsigned int freq)
+{
+	return freq * V4L2_KHZ_FREQ_MUL;
+}
+
+static inline unsigned int v4l2_freq_to_khz(u32 v4l2_freq)
+{
+	return v4l2_freq / V4L2_KHZ_FREQ_MUL;
+}
+
+/*
+ * find the band that contains a v4l2 frequency. the campus band is only
+ * considered when it's enabled. returns false if no band contains it.
+ */
+static inline bool kt0913_find_band(u32 freq, bool campus,
+	unsigned int *band)
+{
+	if (freq <= khz_to_v4l2_freq(kt0913_band_limits[BAND_AM].high))
+		*band = BAND_AM;
+	else if (freq >= khz_to_v4l2_freq(kt0913_band_limits[BAND_FM].low))
+		*band = BAND_FM;
+	else if (campus &&
+		freq >= khz_to_v4l2_freq(kt0913_band_limits[BAND_FM_CAMUS].low))
+		*band = BAND_FM_CAMUS;
+	else
+		return false;
+
+	return true;
+}
+
+/*
+ * nearest channel to a v4l2 frequency, in kHz, on a grid of step kHz inside
+ * the band. 200kHz FM channels are on odd 100kHz (87.9MHz, 88.1MHz...),
+ * every other grid starts at 0.
+ */
+static inline unsigned int kt0913_freq_to_chan(unsigned int band,
+	u32 v4l2_freq, unsigned int step)
+{
+	unsigned int offset = step == 200 ? 100 : 0;
+	unsigned int khz = v4l2_freq_to_khz(v4l2_freq + V4L2_KHZ_FREQ_MUL / 2);
+
+	if (khz < offset + step / 2)
+		khz = offset + step / 2;
+
+	khz = offset + (khz - offset + step / 2) / step * step;
+	if (khz < kt0913_band_limits[band].low)
+		khz += step;
+	if (khz > kt0913_band_limits[band].high)
+		khz -= step;
+
+	return khz;
+}
+
+/*
+ * band and nearest channel in kHz of a VIDIOC_S_FREQUENCY value, clamped to
+ * the band limits, on the grid of the band's spacing (fm_step or am_step
+ * kHz). returns false if no band contains it.
+ */
+static inline bool kt0913_parse_freq(u32 freq, bool campus,
+	unsigned int fm_step, unsigned int am_step, unsigned int *band,
+	unsigned int *khz)
+{
+	u32 low, high;
+
+	if (!freq || !kt0913_find_band(freq, campus, band))
+		return false;
+
+	low = khz_to_v4l2_freq(kt0913_band_limits[*band].low);
+	high = khz_to_v4l2_freq(kt0913_band_limits[*band].high);
+	if (freq < low)
+		freq = low;
+	if (freq > high)
+		freq = high;
+
+	*khz = kt0913_freq_to_chan(*band, freq,
+		*band == BAND_AM ? am_step : fm_step);
+
+	return true;
+}
+
+/* SEEK FMSPACE value of an FM spacing in kHz (50, 100 or 200) */
+static inline u32 kt0913_fmspace_to_reg(unsigned int khz)
+{
+	if (khz >= 200)
+		return KT0913_SEEK_FMSPACE_200KHZ;
+	if (khz >= 100)
+		return KT0913_SEEK_FMSPACE_100KHZ;
+
+	return KT0913_SEEK_FMSPACE_50KHZ;
+}
+
+/* AMCFG AMSPACE value of an AM spacing in kHz (1, 9 or 10) */
+static inline u32 kt0913_amspace_to_reg(unsigned int khz)
+{
+	if (khz >= 10)
+		return KT0913_AMCFG_AMSPACE_10KHZ;
+	if (khz >= 9)
+		return KT0913_AMCFG_AMSPACE_9KHZ;
+
+	return KT0913_AMCFG_AMSPACE_1KHZ;
+}
+
+/* TUNE (FM) or AMCHAN (AM) value that tunes to a frequency in kHz */
+static inline u16 kt0913_chan_to_reg(unsigned int band, unsigned int khz)
+{
+	if (band == BAND_AM)
+		return kt0913_field_prep(KT0913_F_AMTUNE,
+				KT0913_AMCHAN_AMTUNE_ON) |
+			kt0913_field_prep(KT0913_F_AMCHAN, khz);
+
+	return kt0913_field_prep(KT0913_F_FMTUNE, KT0913_TUNE_FMTUNE_ON) |
+		kt0913_field_prep(KT0913_F_FMCHAN, khz / KT0913_FMCHAN_MUL);
+}
+
+/* frequency in kHz of a TUNE (FM) or AMCHAN (AM) value */
+static inline unsigned int kt0913_reg_to_chan(unsigned int band, u16 reg)
+{
+	if (band == BAND_AM)
+		return kt0913_field_get(KT0913_F_AMCHAN, reg);
+
+	return kt0913_field_get(KT0913_F_FMCHAN, reg) * KT0913_FMCHAN_MUL;
+}
+
+/* AM sub-range of a frequency in kHz, for the calibration cache */
+static inline unsigned int kt0913_amcali_bin(unsigned int khz)
+{
+	if (khz < KT0913_AM_RANGE_LOW)
+		return 0;
+	if (khz > KT0913_AM_RANGE_HIGH)
+		return KT0913_AMCALI_BINS - 1;
+
+	return (khz - KT0913_AM_RANGE_LOW) / KT0913_AMCALI_BIN_KHZ;
+}
+
+/* map [-60, 0] dB to [1, 31] which is what the kt0913 expects */
+static inline u32 kt0913_volume_to_reg(s32 volume)
+{
+	return (volume / 2) + 31;
+}
+
+/* ************************************************************************* */
+
+/* map a raw RSSI<4:0> into the 0-65535 range of v4l2_tuner.signal */
+static inline s32 kt0913_raw_rssi_to_signal(u8 rssi)
+{
+	return rssi * 65535 / KT0913_STATUSA_FMRSSI_MAX;
+}
+
+/* FM: -100dBm + RSSI * 3dBm, AM: -90dBm + RSSI * 3dBm */
+static inline int kt0913_raw_rssi_to_dbm(unsigned int band, u8 rssi)
+{
+	return (band == BAND_AM ? -90 : -100) + rssi * 3;
+}
+
+/* raw RSSI from the STATUSA (FM) or AMSTATUSA (AM) value */
+static inline u8 kt0913_status_to_raw_rssi(unsigned int band, u16 status)
+{
+	return kt0913_field_get(band == BAND_AM ?
+		KT0913_F_AMRSSI : KT0913_F_FMRSSI, status);
+}
+
+/* signed AFC deviation from the AFC register value */
+static inline int kt0913_reg_to_afc(u16 reg)
+{
+	return (s8)kt0913_field_get(KT0913_F_AFC, reg);
+}
+
+/*
+ * FM channel (on a grid of step kHz) closest to the station found by the
+ * AFC on the channel khz, the deviation being the station minus the tuned
+ * frequency. that's khz itself while the station is less than half a
+ * channel away, and always on AM, which has no AFC reading.
+ */
+static inline unsigned int kt0913_afc_chan(unsigned int band,
+	unsigned int khz, int afc, unsigned int step)
+{
+	int station = (int)khz + afc * KT0913_AFC_KHZ_PER_LSB;
+
+	if (band == BAND_AM || station <= 0)
+		return khz;
+
+	return kt0913_freq_to_chan(band, khz_to_v4l2_freq(station), step);
+}
+
+/* ************************************************************************* */
+
+/* seek/scan step in kHz, the requested spacing (in Hz) or the band's */
+static inline unsigned int kt0913_seek_step(unsigned int band, u32 spacing,
+	unsigned int low, unsigned int high)
+{
+	unsigned int step;
+
+	if (spacing)
+		step = spacing / 1000;
+	else if (band == BAND_AM)
+		step = KT0913_DEFAULT_AM_STEP;
+	else
+		step = KT0913_DEFAULT_FM_STEP;
+
+	if (step < 1)
+		step = 1;
+	if (step > high - low)
+		step = high - low;
+
+	return step;
+}
+
+/* raw RSSI that makes a seek stop on a channel */
+static inline u8 kt0913_seek_threshold(unsigned int band)
+{
+	return band == BAND_AM ?
+		KT0913_SEEK_AM_RSSI_MIN : KT0913_SEEK_FM_RSSI_MIN;
+}
+
+/*
+ * move a seek one step from freq, inside [low, high]. returns false when
+ * the seek is over: the band edge was reached without wrap around, or it
+ * went all the way around to origin without a station. origin doesn't
+ * have to be on the grid of low, so going around means reaching or
+ * stepping over it, not landing on it.
+ */
+static inline bool kt0913_seek_next(unsigned int *freq, unsigned int origin,
+	unsigned int low, unsigned int high, unsigned int step,
+	bool upward, bool wrap)
+{
+	unsigned int next;
+
+	if (upward)
+		next = *freq + step;
+	else
+		next = *freq >= low + step ? *freq - step : 0;
+
+	/* only after wrapping can freq be behind origin */
+	if (upward ? *freq < origin && next >= origin :
+		*freq > origin && next <= origin)
+		return false;
+
+	if (next < low || next > high) {
+		if (!wrap)
+			return false;
+		next = upward ? low : high;
+	}
+
+	if (next == origin)
+		return false;
+
+	*freq = next;
+
+	return true;
+}
+
+/*
+ * index of the best channel of a scan: the strongest one at or above the
+ * seek threshold, the lowest index on a tie. -1 if there's none.
+ */
+static inline int kt0913_scan_best(unsigned int band, const u8 *rssi,
+	unsigned int count)
+{
+	u8 best_rssi = kt0913_seek_threshold(band);
+	int best = -1;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (rssi[i] > best_rssi || (best < 0 && rssi[i] == best_rssi)) {
+			best_rssi = rssi[i];
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/* ************************************************************************* */
+
+/*
+ * operations whose cost the driver breaks down on its op_stats debugfs
+ * file. they nest (a band switch is part of a S_FREQUENCY, scans run
+ * tunes). the sequences below report the ones they run through op_begin()
+ * and op_end().
+ */
+enum kt0913_op {
+	KT0913_OP_INIT,
+	KT0913_OP_S_FREQUENCY,
+	KT0913_OP_G_TUNER,
+	KT0913_OP_BAND_SWITCH,
+	KT0913_OP_TUNE,
+	KT0913_OP_SEEK,
+	KT0913_OP_SCAN,
+	KT0913_OP_COUNT,
+};
+
+struct kt0913_core;
+
+/*
+ * how the sequences reach the chip: the driver backs them with its regmap,
+ * the tests with an emulated chip. they return 0 or a negative errno.
+ */
+struct kt0913_core_ops {
+	/* the registers the chip doesn't change may come from a cache */
+	int (*read)(struct kt0913_core *core, u8 reg, u16 *val);
+	int (*write)(struct kt0913_core *core, u8 reg, u16 val);
+	/* the bits of mask, only written if they change */
+	int (*update_bits)(struct kt0913_core *core, u8 reg, u16 mask,
+		u16 val);
+	/* count registers from reg on, in a single message if possible */
+	int (*bulk_write)(struct kt0913_core *core, u8 reg, const u16 *val,
+		unsigned int count);
+	/* poll until STC is set, -ETIMEDOUT if it takes too long */
+	int (*wait_stc)(struct kt0913_core *core);
+	/* optional: an error ends a seek, e.g. on a pending signal */
+	int (*interrupted)(struct kt0913_core *core);
+	/* optional: around each kt0913_op, ret is its result */
+	void (*op_begin)(struct kt0913_core *core, enum kt0913_op op);
+	void (*op_end)(struct kt0913_core *core, enum kt0913_op op, int ret);
+};
+
+/* state of the sequences, under the lock of whoever runs them */
+struct kt0913_core {
+	const struct kt0913_core_ops *ops;
+
+	unsigned int band;		/* current band (fm, fm_campus, am) */
+	unsigned int frequency;		/* last channel set (kHz) */
+
+	/*
+	 * AM antenna calibration (CAP_INDEX) found on the first completed
+	 * tune of each sub-range, and preloaded on the next tunes there
+	 * while *amcali_cache is set
+	 */
+	const bool *amcali_cache;
+	u16 amcali[KT0913_AMCALI_BINS];
+	u32 amcali_valid;		/* bitmap of amcali[] */
+	bool amcali_preloaded;		/* by the last AM channel change */
+	unsigned long amcali_hits;
+	unsigned long amcali_misses;
+};
+
+/* what kt0913_core_init() sets on top of kt0913_init_regs */
+struct kt0913_core_cfg {
+	unsigned int anti_pop;		/* POP */
+	unsigned int refclk;		/* REFCLK */
+	bool campus;
+	bool mute;
+	s32 volume;			/* dB, -60 to 0 */
+	unsigned int fm_spacing;	/* kHz */
+	unsigned int am_spacing;	/* kHz */
+	unsigned int band;		/* tuned at boot, with khz */
+	unsigned int khz;
+};
+
+struct kt0913_field_val {
+	enum kt0913_field field;
+	unsigned int val;
+};
+
+static inline void kt0913_core_op_begin(struct kt0913_core *core,
+	enum kt0913_op op)
+{
+	if (core->ops->op_begin)
+		core->ops->op_begin(core, op);
+}
+
+/* returns ret, to end an op on its result */
+static inline int kt0913_core_op_end(struct kt0913_core *core,
+	enum kt0913_op op, int ret)
+{
+	if (core->ops->op_end)
+		core->ops->op_end(core, op, ret);
+
+	return ret;
+}
+
+static inline int kt0913_core_field_read(struct kt0913_core *core,
+	enum kt0913_field field, unsigned int *val)
+{
+	u16 reg;
+	int ret = core->ops->read(core, kt0913_fields[field].reg, &reg);
+
+	if (ret)
+		return ret;
+
+	*val = kt0913_field_get(field, reg);
+
+	return 0;
+}
+
+static inline int kt0913_core_field_write(struct kt0913_core *core,
+	enum kt0913_field field, unsigned int val)
+{
+	return core->ops->update_bits(core, kt0913_fields[field].reg,
+		kt0913_field_mask(field), kt0913_field_prep(field, val));
+}
+
+/*
+ * write several fields, merging the ones that share a register into a
+ * single update. fields are applied in order, so a later value of the same
+ * field wins.
+ */
+static inline int kt0913_core_fields_write(struct kt0913_core *core,
+	const struct kt0913_field_val *vals, unsigned int count)
+{
+	u32 done = 0;
+	unsigned int i, j;
+	int ret;
+
+	if (count > 32)
+		return -EINVAL;
+
+	for (i = 0; i < count; i++) {
+		u8 reg = kt0913_fields[vals[i].field].reg;
+		u16 mask = 0, val = 0;
+
+		if (done & (1U << i))
+			continue;
+
+		for (j = i; j < count; j++) {
+			enum kt0913_field field = vals[j].field;
+
+			if (kt0913_fields[field].reg != reg)
+				continue;
+
+			mask |= kt0913_field_mask(field);
+			val &= ~kt0913_field_mask(field);
+			val |= kt0913_field_prep(field, vals[j].val);
+			done |= 1U << j;
+		}
+
+		ret = core->ops->update_bits(core, reg, mask, val);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static inline int kt0913_core_set_mute(struct kt0913_core *core, bool on)
+{
+	return kt0913_core_field_write(core, KT0913_F_DMUTE,
+		on ? KT0913_VOLUME_DMUTE_ON : KT0913_VOLUME_DMUTE_OFF);
+}
+
+/* channel the chip is set to, in kHz, on the current band */
+static inline int kt0913_core_get_frequency(struct kt0913_core *core,
+	unsigned int *khz)
+{
+	u16 reg;
+	int ret = core->ops->read(core, core->band == BAND_AM ?
+		KT0913_REG_AMCHAN : KT0913_REG_TUNE, &reg);
+
+	if (ret)
+		return ret;
+
+	*khz = kt0913_reg_to_chan(core->band, reg);
+
+	return 0;
+}
+
+/* raw RSSI<4:0> of the current channel, on the current band */
+static inline int kt0913_core_get_raw_rssi(struct kt0913_core *core, u8 *rssi)
+{
+	u16 status;
+	int ret = core->ops->read(core, core->band == BAND_AM ?
+		KT0913_REG_AMSTATUSA : KT0913_REG_STATUSA, &status);
+
+	if (ret)
+		return ret;
+
+	*rssi = kt0913_status_to_raw_rssi(core->band, status);
+
+	return 0;
+}
+
+/* ************************************************************************* */
+
+/* let the calibration of an AM tune start from the one of its sub-range */
+static inline int kt0913_core_amcali_preload(struct kt0913_core *core,
+	unsigned int khz)
+{
+	unsigned int bin = kt0913_amcali_bin(khz);
+	int ret;
+
+	core->amcali_preloaded = false;
+	if (!*core->amcali_cache)
+		return 0;
+
+	if (!(core->amcali_valid & (1U << bin))) {
+		core->amcali_misses++;
+		return 0;
+	}
+
+	ret = kt0913_core_field_write(core, KT0913_F_CAP_INDEX,
+		core->amcali[bin]);
+	if (ret)
+		return ret;
+
+	core->amcali_preloaded = true;
+	core->amcali_hits++;
+
+	return 0;
+}
+
+/*
+ * keep the calibration of the current AM channel, once per sub-range. only
+ * a completed tune (STC) has one worth keeping.
+ */
+static inline int kt0913_core_amcali_capture(struct kt0913_core *core)
+{
+	unsigned int khz, cap, bin;
+	int ret;
+
+	ret = kt0913_core_field_read(core, KT0913_F_AMCHAN, &khz);
+	if (ret)
+		return ret;
+
+	bin = kt0913_amcali_bin(khz);
+	if (core->amcali_valid & (1U << bin))
+		return 0;
+
+	ret = kt0913_core_field_read(core, KT0913_F_CAP_INDEX, &cap);
+	if (ret)
+		return ret;
+
+	core->amcali[bin] = cap;
+	core->amcali_valid |= 1U << bin;
+
+	return 0;
+}
+
+/* they belong to the antenna and the state the chip had */
+static inline void kt0913_core_amcali_drop(struct kt0913_core *core)
+{
+	core->amcali_valid = 0;
+}
+
+/*
+ * switch between AM and FM and start tuning, with every value computed from
+ * the cache. AMSYSCFG and AMCHAN are next to each other, so going to AM is
+ * a single burst (after the calibration preload). going to FM writes
+ * AMSYSCFG and TUNE back to back.
+ */
+static inline int kt0913_core_switch_band(struct kt0913_core *core,
+	unsigned int band, unsigned int khz)
+{
+	u16 amsyscfg, regs[2];
+	int ret;
+
+	kt0913_core_op_begin(core, KT0913_OP_BAND_SWITCH);
+
+	ret = core->ops->read(core, KT0913_REG_AMSYSCFG, &amsyscfg);
+	if (ret)
+		goto out;
+
+	amsyscfg &= ~kt0913_field_mask(KT0913_F_AM_FM);
+	amsyscfg |= kt0913_field_prep(KT0913_F_AM_FM, band == BAND_AM ?
+		KT0913_AMSYSCFG_AM_FM_AM : KT0913_AMSYSCFG_AM_FM_FM);
+
+	if (band == BAND_AM) {
+		regs[0] = amsyscfg;				/* AMSYSCFG */
+		regs[1] = kt0913_chan_to_reg(BAND_AM, khz);	/* AMCHAN */
+
+		ret = kt0913_core_amcali_preload(core, khz);
+		if (!ret)
+			ret = core->ops->bulk_write(core, KT0913_REG_AMSYSCFG,
+				regs, 2);
+	} else {
+		ret = core->ops->write(core, KT0913_REG_AMSYSCFG, amsyscfg);
+		if (!ret)
+			ret = core->ops->write(core, KT0913_REG_TUNE,
+				kt0913_chan_to_reg(band, khz));
+	}
+	if (!ret)
+		core->band = band;
+
+out:
+	return kt0913_core_op_end(core, KT0913_OP_BAND_SWITCH, ret);
+}
+
+/* switch band if needed and start tuning to a channel in kHz */
+static inline int kt0913_core_set_frequency(struct kt0913_core *core,
+	unsigned int band, unsigned int khz)
+{
+	int ret;
+
+	/* the FM bands only differ on their limits */
+	if ((core->band == BAND_AM) != (band == BAND_AM)) {
+		ret = kt0913_core_switch_band(core, band, khz);
+	} else {
+		core->band = band;
+		ret = band == BAND_AM ? kt0913_core_amcali_preload(core, khz) : 0;
+		if (!ret)
+			ret = core->ops->write(core, band == BAND_AM ?
+				KT0913_REG_AMCHAN : KT0913_REG_TUNE,
+				kt0913_chan_to_reg(band, khz));
+	}
+
+	if (!ret)
+		WRITE_ONCE(core->frequency, khz);
+
+	return ret;
+}
+
+/* tune to a channel in kHz and wait until the chip reports it's done */
+static inline int kt0913_core_tune(struct kt0913_core *core,
+	unsigned int band, unsigned int khz)
+{
+	int ret;
+
+	kt0913_core_op_begin(core, KT0913_OP_TUNE);
+	ret = kt0913_core_set_frequency(core, band, khz);
+	if (!ret)
+		ret = core->ops->wait_stc(core);
+	kt0913_core_op_end(core, KT0913_OP_TUNE, ret);
+	if (ret)
+		return ret;
+
+	if (band == BAND_AM && *core->amcali_cache)
+		return kt0913_core_amcali_capture(core);
+
+	return 0;
+}
+
+/*
+ * once the tune to the channel *khz is done, if the AFC found the station
+ * closer to another channel of the step kHz grid, tune that one. returns 1
+ * if *khz was changed.
+ */
+static inline int kt0913_core_fine_tune(struct kt0913_core *core,
+	unsigned int *khz, unsigned int step)
+{
+	unsigned int chan;
+	u16 afc;
+	int ret;
+
+	ret = core->ops->read(core, KT0913_REG_AFC, &afc);
+	if (ret)
+		return ret;
+
+	chan = kt0913_afc_chan(core->band, *khz, kt0913_reg_to_afc(afc), step);
+	if (chan == *khz)
+		return 0;
+
+	ret = kt0913_core_tune(core, core->band, chan);
+	if (ret)
+		return ret;
+
+	*khz = chan;
+
+	return 1;
+}
+
+/*
+ * the tune of a VIDIOC_S_FREQUENCY: start tuning the channel *khz and
+ * return right away. with an afc_step, on FM, tune it to the end instead
+ * and move to the channel of that grid the AFC found the station on,
+ * returning 1 if *khz was changed.
+ */
+static inline int kt0913_core_s_frequency(struct kt0913_core *core,
+	unsigned int band, unsigned int *khz, unsigned int afc_step)
+{
+	int ret;
+
+	if (!afc_step || band == BAND_AM)
+		return kt0913_core_set_frequency(core, band, *khz);
+
+	ret = kt0913_core_tune(core, band, *khz);
+	if (ret)
+		return ret;
+
+	return kt0913_core_fine_tune(core, khz, afc_step);
+}
+
+/*
+ * tune to count channels of step kHz starting at first kHz and store the
+ * raw RSSI of each one. audio is muted while scanning and the previous
+ * band, channel and mute state are restored afterwards.
+ */
+static inline int kt0913_core_scan(struct kt0913_core *core,
+	unsigned int band, unsigned int first, unsigned int step,
+	unsigned int count, u8 *rssi)
+{
+	unsigned int prev_band = core->band;
+	unsigned int prev_khz, dmute, i;
+	int ret, ret_restore;
+
+	kt0913_core_op_begin(core, KT0913_OP_SCAN);
+
+	ret = kt0913_core_get_frequency(core, &prev_khz);
+	if (!ret)
+		ret = kt0913_core_field_read(core, KT0913_F_DMUTE, &dmute);
+	if (!ret)
+		ret = kt0913_core_set_mute(core, true);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < count; i++) {
+		ret = kt0913_core_tune(core, band, first + i * step);
+		if (ret)
+			break;
+
+		ret = kt0913_core_get_raw_rssi(core, &rssi[i]);
+		if (ret)
+			break;
+	}
+
+	ret_restore = kt0913_core_set_frequency(core, prev_band, prev_khz);
+	if (!ret_restore)
+		ret_restore = kt0913_core_field_write(core, KT0913_F_DMUTE,
+			dmute);
+	if (!ret)
+		ret = ret_restore;
+
+out:
+	return kt0913_core_op_end(core, KT0913_OP_SCAN, ret);
+}
+
+/*
+ * seek the next channel whose RSSI reaches the band threshold, stepping
+ * step kHz from the current one inside [low, high] of the current band,
+ * wrapping around at the edges with wrap. audio stays muted while seeking.
+ * if nothing is found the original channel is restored and -ENODATA is
+ * returned, otherwise the station is on core->frequency.
+ */
+static inline int kt0913_core_seek(struct kt0913_core *core,
+	unsigned int low, unsigned int high, unsigned int step, bool upward,
+	bool wrap)
+{
+	unsigned int band = core->band;
+	u8 threshold = kt0913_seek_threshold(band);
+	unsigned int start, origin, khz, dmute;
+	int ret, ret_restore;
+	u8 rssi;
+
+	kt0913_core_op_begin(core, KT0913_OP_SEEK);
+
+	ret = kt0913_core_get_frequency(core, &start);
+	if (!ret)
+		ret = kt0913_core_field_read(core, KT0913_F_DMUTE, &dmute);
+	if (!ret)
+		ret = kt0913_core_set_mute(core, true);
+	if (ret)
+		goto out;
+
+	khz = start < low ? low : start > high ? high : start;
+	origin = khz;
+	ret = -ENODATA;
+	while (kt0913_seek_next(&khz, origin, low, high, step, upward, wrap)) {
+		if (core->ops->interrupted) {
+			ret = core->ops->interrupted(core);
+			if (ret)
+				break;
+		}
+
+		ret = kt0913_core_tune(core, band, khz);
+		if (ret)
+			break;
+
+		ret = kt0913_core_get_raw_rssi(core, &rssi);
+		if (ret)
+			break;
+
+		if (rssi >= threshold)
+			break;
+
+		ret = -ENODATA;
+	}
+
+	/* go back to where we were unless a station was found */
+	ret_restore = ret ? kt0913_core_set_frequency(core, band, start) : 0;
+	if (!ret_restore)
+		ret_restore = kt0913_core_field_write(core, KT0913_F_DMUTE,
+			dmute);
+	if (!ret)
+		ret = ret_restore;
+
+out:
+	return kt0913_core_op_end(core, KT0913_OP_SEEK, ret);
+}
+
+/*
+ * bring the chip to a known state: kt0913_init_regs, the configuration of
+ * cfg, and the boot channel, whose tune is started but not waited for
+ */
+static inline int kt0913_core_init(struct kt0913_core *core,
+	const struct kt0913_core_cfg *cfg)
+{
+	const struct kt0913_field_val fields[] = {
+		/* the audio dac anti-pop config */
+		{ KT0913_F_POP, cfg->anti_pop },
+		/* the reference clock config */
+		{ KT0913_F_REFCLK, cfg->refclk },
+		{ KT0913_F_CAMPUSBAND, cfg->campus ?
+			KT0913_LOCFG_CAMPUSBAND_EN_ON :
+			KT0913_LOCFG_CAMPUSBAND_EN_OFF },
+		{ KT0913_F_DMUTE, cfg->mute ?
+			KT0913_VOLUME_DMUTE_ON : KT0913_VOLUME_DMUTE_OFF },
+		{ KT0913_F_VOLUME, kt0913_volume_to_reg(cfg->volume) },
+		/* the spacing of the chip's own seek */
+		{ KT0913_F_FMSPACE, kt0913_fmspace_to_reg(cfg->fm_spacing) },
+		{ KT0913_F_AMSPACE, kt0913_amspace_to_reg(cfg->am_spacing) },
+	};
+	unsigned int i;
+	int ret = 0;
+
+	kt0913_core_op_begin(core, KT0913_OP_INIT);
+
+	for (i = 0; i < sizeof(kt0913_init_regs) /
+		sizeof(kt0913_init_regs[0]) && !ret; i++)
+		ret = core->ops->write(core, kt0913_init_regs[i].reg,
+			kt0913_init_regs[i].val);
+
+	/* anti-pop and mute share VOLUME and go out on a single write */
+	if (!ret)
+		ret = kt0913_core_fields_write(core, fields,
+			sizeof(fields) / sizeof(fields[0]));
+
+	/* the only tune of the boot, straight to the configured station */
+	if (!ret)
+		ret = kt0913_core_set_frequency(core, cfg->band,
+			kt0913_freq_to_chan(cfg->band,
+				khz_to_v4l2_freq(cfg->khz),
+				cfg->band == BAND_AM ?
+				cfg->am_spacing : cfg->fm_spacing));
+
+	return kt0913_core_op_end(core, KT0913_OP_INIT, ret);
+}
+
+#endif /* _RADIO_KT0913_CORE_H */
@@ -7,20 +7,39 @@
  * protocol to communicate with the chip.
  * It exposes two bands, one for AM and another for FM. If the "campus
  * band" feature needs to be enabled, set the corresponding module parameter
- * to 1.
+ * to 1 (applies to every instance) or add ktm,campus-band to the device
+ * tree node of a single instance.
  * Reference Clock and Audio DAC anti-pop configurations should be
  * set via a device tree node. Defaults will be used otherwise.
  *
+ * The chip has a fixed I2C address, so boards with several tuners place
+ * them behind I2C muxes or on separate adapters. Every bound instance is
+ * tracked so a band survey (see the "survey" sysfs attribute) can be split
+ * across all of them and scanned in parallel, one workqueue per chip.
+ * With the kt0913_single_node module parameter, the first instance owns a
+ * single radio node and the next ones are added to it as tuners 1..N-1,
+ * each one with its own controls and V4L2_EVENT_KT0913_TUNER events.
+ * With the kt0913_virtual_tuners module parameter, every open file handle
+ * of a standalone node gets its own virtual tuner instead: its frequency is
+ * set with VIDIOC_S_FREQUENCY, and a scheduler time-slices the chip between
+ * the virtual tuners, sampling the signal for each one of them.
+ *
  * Audio output should be routed to a speaker or an audio capture
- * device.
+ * device. Capture bridges that do so can drive the tuner through its
+ * v4l2_subdev (tuner ops, plus VIDIOC_S_HW_FREQ_SEEK through core.ioctl),
+ * which is registered alongside the standalone radio node.
+ * An ASoC component with DAPM widgets for the analog output is registered
+ * too. Once it's added to a sound card, the chip is only unmuted and out of
+ * standby while an audio path through it is powered.
  *
  * Based on radio-tea5764 by Fabio Belavenuto <belavenuto@gmail.com>
  *
  *  Copyright (c) 2020 Santiago Hormazabal <santiagohssl@gmail.com>
  *
  * TODO:
- *  use rd and wr support for the regmap instead of volatile regs.
- *  add support for the hardware-assisted frequency seek.
+ *  add wr support for the regmap.
+ *  seek with the chip's own seek engine, VIDIOC_S_HW_FREQ_SEEK is emulated
+ *  by tuning each channel from the driver.
  *  export FM SNR and AM/FM AFC deviation values as RO controls.
  */
 
@@ -31,128 +50,278 @@
 #include <linux/of.h>
 #include <linux/math64.h>
 #include <linux/regmap.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/list.h>
+#include <linux/slab.h>
+#include <linux/workqueue.h>
+#include <linux/kthread.h>
+#include <linux/hrtimer.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+#include <linux/sort.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-device.h>
 #include <media/v4l2-ioctl.h>
 #include <media/v4l2-event.h>
+#include <media/v4l2-subdev.h>
+#include <media/v4l2-common.h>
+#include <media/v4l2-async.h>
+#include <sound/soc.h>
+#include <sound/soc-dapm.h>
 
- /* ************************************************************************* */
+#include "radio-kt0913-core.h"
 
- /* registers of the kt0913 */
-#define KT0913_REG_CHIP_ID      0x01
-#define KT0913_REG_SEEK         0x02
-#define KT0913_REG_TUNE         0x03
-#define KT0913_REG_VOLUME       0x04
-#define KT0913_REG_DSPCFGA      0x05
-#define KT0913_REG_LOCFGA       0x0A
-#define KT0913_REG_LOCFGC       0x0C
-#define KT0913_REG_RXCFG        0x0F
-#define KT0913_REG_STATUSA      0x12
-#define KT0913_REG_STATUSB      0x13
-#define KT0913_REG_STATUSC      0x14
-#define KT0913_REG_AMSYSCFG     0x16
-#define KT0913_REG_AMCHAN       0x17
-#define KT0913_REG_AMCALI       0x18
-#define KT0913_REG_GPIOCFG      0x1D
-#define KT0913_REG_AMDSP        0x22
-#define KT0913_REG_AMSTATUSA    0x24
-#define KT0913_REG_AMSTATUSB    0x25
-#define KT0913_REG_SOFTMUTE     0x2E
-#define KT0913_REG_AMCFG        0x33
-#define KT0913_REG_AMCFG2       0x34
-#define KT0913_REG_AFC          0x3C
-
-/* register symbols masks, values and shift count */
-#define KT0913_TUNE_FMTUNE_MASK 0x8000 /* FM Tune enable */
-#define KT0913_TUNE_FMTUNE_ON 0x8000 /* FM Tune enabled */
-#define KT0913_TUNE_FMTUNE_OFF 0x0000 /* FM Tune disabled */
-#define KT0913_TUNE_FMCHAN_MASK 0x0FFF /* frequency in kHz / 50kHz */
-
-#define KT0913_VOLUME_DMUTE_MASK 0x2000
-#define KT0913_VOLUME_DMUTE_ON 0x0000
-#define KT0913_VOLUME_DMUTE_OFF 0x2000
-#define KT0913_VOLUME_DE_MASK 0x0800 /* de-emphasis time constant */
-#define KT0913_VOLUME_DE_75US 0x0000 /* 75us */
-#define KT0913_VOLUME_DE_50US 0x0800 /* 50us */
-#define KT0913_VOLUME_POP_MASK 0x30 /* audio dac anti-pop config */
-#define KT0913_VOLUME_POP_SHIFT 4
-
-#define KT0913_DSPCFGA_MONO_MASK 0x8000 /* mono select (0=stereo, 1=mono) */
-#define KT0913_DSPCFGA_MONO_ON 0x8000 /* mono */
-#define KT0913_DSPCFGA_MONO_OFF 0x0000 /* stereo */
-
-#define KT0913_LOCFG_CAMPUSBAND_EN_MASK 0x0008 /* campus band fm enable */
-#define KT0913_LOCFG_CAMPUSBAND_EN_ON 0x0008 /* FM range 64-110MHz */
-#define KT0913_LOCFG_CAMPUSBAND_EN_OFF 0x0000 /* FM range 32-110MHz */
-
-#define KT0913_RXCFGA_STDBY_MASK 0x1000 /* standby mode enable */
-#define KT0913_RXCFGA_STDBY_ON 0x1000 /* standby mode enabled */
-#define KT0913_RXCFGA_STDBY_OFF 0x0000 /* standby mode disabled */
-#define KT0913_RXCFGA_VOLUME_MASK 0x001F /* volume control */
-
-#define KT0913_STATUSA_XTAL_OK 0x8000 /* crystal ready indicator */
-#define KT0913_STATUSA_STC 0x4000 /* seek/tune complete */
-
-#define KT0913_STATUSA_PLL_LOCK_MASK 0x800 /* system pll ready indicator */
-#define KT0913_STATUSA_PLL_LOCK_LOCKED 0x800 /* system pll ready */
-#define KT0913_STATUSA_PLL_LOCK_UNLOCKED 0x000 /* not ready */
-#define KT0913_STATUSA_LO_LOCK 0x400 /* LO synthesizer ready indicator */
-#define KT0913_STATUSA_ST_MASK 0x300 /* stereo indicator (0x300=stereo, otherwise mono) */
-#define KT0913_STATUSA_ST_STEREO 0x300 /* stereo */
-#define KT0913_STATUSA_FMRSSI_MASK 0xF8 /* FM RSSI (-100dBm + FMRSSI*3dBm) */
-#define KT0913_STATUSA_FMRSSI_SHIFT 3
-
-#define KT0913_STATUSC_PWSTATUS 0x8000 /* power status indicator */
-#define KT0913_STATUSC_CHIPRDY 0x2000 /* chip ready indicator */
-#define KT0913_STATUSC_FMSNR 0x1FC0 /* FM SNR (unknown units) */
-
-#define KT0913_AMCHAN_AMTUNE_MASK 0x8000 /* AM tune enable */
-#define KT0913_AMCHAN_AMTUNE_ON 0x8000 /* AM tune enabled */
-#define KT0913_AMCHAN_AMTUNE_OFF 0x0000 /* AM tune disabled */
-#define KT0913_AMCHAN_AMCHAN_MASK 0x7FF /* am channel in kHz */
-
-#define KT0913_AMSYSCFG_AM_FM_MASK 0x8000 /* am/fm mode control */
-#define KT0913_AMSYSCFG_AM_FM_AM 0x8000 /* am mode */
-#define KT0913_AMSYSCFG_AM_FM_FM 0x0000 /* fm mode (default) */
-#define KT0913_AMSYSCFG_REFCLK_MASK 0x0F00 /* reference clock selection */
-#define KT0913_AMSYSCFG_REFCLK_SHIFT 8
-#define KT0913_AMSYSCFG_AU_GAIN_MASK 0x00C0 /* audio gain selection */
-#define KT0913_AMSYSCFG_AU_GAIN_6DB 0x0040 /* 6dB audio gain */
-#define KT0913_AMSYSCFG_AU_GAIN_3DB 0x0000 /* 3dB audio gain (default) */
-#define KT0913_AMSYSCFG_AU_GAIN_0DB 0x00C0 /* 0dB audio gain */
-#define KT0913_AMSYSCFG_AU_GAIN_MIN_3DB 0x0080 /* -3dB audio gain */
-
-#define KT0913_AMSTATUSA_AMRSSI_MASK 0x1F00 /* am channel rssi */
-#define KT0913_AMSTATUSA_AMRSSI_SHIFT 8
-
-/* constants */
-#define KT0913_CHIP_ID  0x544B /* ASCII of 'KT' */
-
-#define V4L2_KHZ_FREQ_MUL 16U /* v4l2 uses 16x the kHz value as their freq */
-#define KT0913_FMCHAN_MUL 50U /* kt0913 uses freqs with a 50kHz multiplier */
-#define KT0913_FM_RANGE_LOW_NO_CAMPUS 64000U /* 64MHz lower bound for FM */
-#define KT0913_FM_RANGE_LOW_CAMPUS 32000U /* 32MHz lower bound for campus FM */
-#define KT0913_FM_RANGE_HIGH 110000U /* 110MHz upper bound for FM */
-#define KT0913_AM_RANGE_LOW  500U /* 500kHz lower bound for AM */
-#define KT0913_AM_RANGE_HIGH 1710U /* 1710kHz upper bound for AM */
+ /* ************************************************************************* */
 
+#define KT0913_STC_POLL_US 2000U /* delay between seek/tune complete polls */
+#define KT0913_STC_TIMEOUT_MS 250U /* max time to wait for a seek/tune */
+#define KT0913_CALIB_POLL_US 100U /* polls while measuring the chip */
+#define KT0913_CALIB_TUNES 3 /* tunes measured on each band */
+#define KT0913_CALIB_BUS_READS 8
+#define KT0913_CALIB_MIN_POLL_US 250U
+#define KT0913_CALIB_MAX_POLL_US (KT0913_STC_POLL_US * 2)
+#define KT0913_CALIB_MIN_TIMEOUT_MS KT0913_STC_TIMEOUT_MS
+#define KT0913_CALIB_MAX_TIMEOUT_MS (KT0913_STC_TIMEOUT_MS * 4)
+#define KT0913_I2C_RETRIES 2U /* retries of a failed register access */
+#define KT0913_BUS_YIELD_US 200U /* bus let go on a yield, a few transfers */
+#define KT0913_PM_HIST_BUCKETS 10 /* resume latency, up to 256ms and more */
+#define KT0913_MONITOR_MIN_MS 100U /* signal monitor interval after a change */
+#define KT0913_MONITOR_MAX_MS 6400U /* and once the signal is stable */
+#define KT0913_MONITOR_RSSI_DELTA 2 /* raw RSSI change that resets it */
+#define KT0913_MONITOR_WINDOW_MS 10000U /* wakeup rate measuring window */
+#define KT0913_RT_HIST_BUCKETS 16 /* wakeup jitter, up to 16ms and more */
+#define KT0913_TUNE_HIST_LEN 128 /* tunes kept for the latency percentile */
+#define KT0913_BUDGET_SAMPLE_COST 3U /* transfers of a monitor sample */
+#define KT0913_BUDGET_CHANNEL_COST 6U /* guess for a surveyed channel */
+#define KT0913_SURVEY_CHUNK 4U /* most channels surveyed per mutex hold */
+#define KT0913_BEST_NEAR_CHANNELS 8U /* scanned each side on a band switch */
 #define KT0913_FM_AM_DRIVER_NAME "kt0913-fm-am"
 
+/* max tuners merged on a single radio node */
+#define KT0913_MAX_TUNERS 8
+
+/* driver specific controls */
+#define KT0913_CID_BASE (V4L2_CID_USER_BASE + 0x1f00)
+/* per tuner controls of a merged node, tuner N uses base + N * stride */
+#define KT0913_CID_TUNER_BASE (KT0913_CID_BASE + 0x100)
+#define KT0913_CID_TUNER_STRIDE 0x10
+
+/*
+ * private event queued when a tuner changes its frequency. the id is the
+ * tuner index, and u.data holds a struct kt0913_tuner_event
+ */
+#define V4L2_EVENT_KT0913_TUNER (V4L2_EVENT_PRIVATE_START + 0x0913)
+#define KT0913_TUNER_EVENT_CH_FREQUENCY 0x0001 /* frequency/band changed */
+#define KT0913_TUNER_EVENT_CH_SIGNAL 0x0002 /* signal changed/new sample */
+#define KT0913_TUNER_EVENT_CH_FINE_TUNE 0x0004 /* moved by the AFC */
+#define KT0913_TUNER_EVENT_QUEUE_LEN 8
+
+struct kt0913_tuner_event {
+	__u32 changes;		/* KT0913_TUNER_EVENT_CH_* */
+	__u32 frequency;	/* in v4l2 units (1/16 kHz) */
+	__u32 band_index;	/* index as returned by VIDIOC_ENUM_FREQ_BANDS */
+	__s32 signal;		/* same scale as v4l2_tuner.signal */
+	__u32 rxsubchans;	/* V4L2_TUNER_SUB_* */
+};
+
+struct kt0913_op_stat {
+	u64 count;
+	u64 xfers;		/* I2C transfers, retries included */
+	u64 total_ns;
+	u64 bus_ns;		/* inside the I2C transfers */
+	u64 chip_ns;		/* polling the chip for STC/PLL lock */
+};
+
+/* timings measured by __kt0913_calibrate(), in us */
+struct kt0913_calibration {
+	bool valid;
+	u32 bus_us;		/* fastest register read */
+	u32 xtal_us;		/* leaving standby until the crystal is ready */
+	u32 pll_us;		/* leaving standby until the PLL is locked */
+	u32 stc_us[2];		/* slowest FM and AM tune */
+	u32 stc_min_us;		/* fastest tune of both bands */
+};
+
+/* counters when an operation started */
+struct kt0913_op_mark {
+	u64 start;
+	unsigned long xfers;
+	u64 bus_ns;
+	u64 chip_ns;
+};
+
+/* timed operations, run by the kthread worker of each chip */
+enum kt0913_rt_op {
+	KT0913_RT_VTUNER,
+	KT0913_RT_OP_COUNT,
+};
+
+struct kt0913_rt_stat {
+	unsigned long wakeups;
+	u64 late_total_ns;	/* past the expiry of the timer */
+	u64 late_max_ns;
+	u32 hist[KT0913_RT_HIST_BUCKETS];	/* log2 us buckets */
+};
+
+/* per file handle controls of the virtual tuners */
+#define KT0913_CID_VTUNER_DWELL (KT0913_CID_BASE + 0x00)
+#define KT0913_CID_VTUNER_WEIGHT (KT0913_CID_BASE + 0x01)
+
+#define KT0913_VTUNER_DWELL_MIN_MS 20
+#define KT0913_VTUNER_DWELL_MAX_MS 10000
+#define KT0913_VTUNER_DWELL_DEF_MS 200
+#define KT0913_VTUNER_WEIGHT_MAX 16
+
+/* mute while the raw RSSI<4:0> is below this value, 0 disables it */
+#define KT0913_CID_SQUELCH (KT0913_CID_BASE + 0x02)
+/* move to the channel the AFC points to after VIDIOC_S_FREQUENCY (FM) */
+#define KT0913_CID_AUTO_FINE_TUNE (KT0913_CID_BASE + 0x03)
+/* tune the strongest station of the current band */
+#define KT0913_CID_TUNE_BEST (KT0913_CID_BASE + 0x04)
+/* do the same when VIDIOC_S_FREQUENCY switches the band */
+#define KT0913_CID_BEST_ON_BAND_SWITCH (KT0913_CID_BASE + 0x05)
+/* channel grids used by seeks, scans and VIDIOC_S_FREQUENCY, in Hz */
+#define KT0913_CID_FM_SPACING (KT0913_CID_BASE + 0x06)
+#define KT0913_CID_AM_SPACING (KT0913_CID_BASE + 0x07)
+
 /* ************************************************************************* */
 
 /* v4l2 device number to use. -1 will assign the next free one */
 static int kt0913_v4l2_radio_nr = -1;
-/* use the extended range of FM down to 32MHz. disabled by default */
+/*
+ * use the extended range of FM down to 32MHz. disabled by default.
+ * this is only the default for new instances, see ktm,campus-band
+ */
 static int kt0913_use_campus_band;
+/* present every instance as a tuner of a single radio node */
+static int kt0913_single_node;
+/* give each open file handle its own time-sliced virtual tuner */
+static int kt0913_virtual_tuners;
+/* report ioctls slower than this, in ms. 0 disables it */
+static unsigned int kt0913_slow_ioctl_ms = 100;
+/* compare the register cache against the chip after every setter ioctl */
+static bool kt0913_check_regs;
+/* preload the AM antenna calibration found before on the same sub-range */
+static bool kt0913_am_cali_cache = true;
+/* measure the chip at probe and derive the STC/PLL polling from it */
+static bool kt0913_calibrate;
+/* longest stretch a tune sequence keeps the I2C bus, 0 = don't keep it */
+static unsigned int kt0913_bus_hold_us = 5000;
+/* default I2C budget of the background work, transfers/s, 0 = no limit */
+static unsigned int kt0913_i2c_budget;
+/* default scheduling of the timed operations: normal, fifo or rr */
+static char *kt0913_rt_policy = "normal";
+/* and its priority, for fifo and rr */
+static unsigned int kt0913_rt_priority = 1;
+
+/* root debugfs directory, with one directory per instance */
+static struct dentry *kt0913_debugfs_root;
+
+/* every bound kt0913, used to split band surveys across all of them */
+static LIST_HEAD(kt0913_device_list);
+/*
+ * protects kt0913_device_list, kt0913_last_survey, kt0913_single_node_owner
+ * and the tuner layout of the merged node
+ */
+static DEFINE_MUTEX(kt0913_device_list_lock);
+/* one survey at a time, taken before kt0913_device_list_lock */
+static DEFINE_MUTEX(kt0913_survey_lock);
 
 /* ************************************************************************* */
 
+/* ioctls with their own latency stats */
+struct kt0913_ioctl_desc {
+	unsigned int cmd;
+	const char *name;
+	bool setter;	/* changes the chip state */
+	bool unbounded;	/* may legitimately take long (seek, blocking) */
+};
+
+#define KT0913_IOCTL(_cmd, _setter, _unbounded) \
+	{ .cmd = _cmd, .name = #_cmd, .setter = _setter, .unbounded = _unbounded }
+
+static const struct kt0913_ioctl_desc kt0913_ioctl_descs[] = {
+	KT0913_IOCTL(VIDIOC_QUERYCAP, false, false),
+	KT0913_IOCTL(VIDIOC_G_FREQUENCY, false, false),
+	KT0913_IOCTL(VIDIOC_S_FREQUENCY, true, false),
+	KT0913_IOCTL(VIDIOC_ENUM_FREQ_BANDS, false, false),
+	KT0913_IOCTL(VIDIOC_G_TUNER, false, false),
+	KT0913_IOCTL(VIDIOC_S_TUNER, true, false),
+	KT0913_IOCTL(VIDIOC_S_HW_FREQ_SEEK, true, true),
+	KT0913_IOCTL(VIDIOC_QUERYCTRL, false, false),
+	KT0913_IOCTL(VIDIOC_QUERY_EXT_CTRL, false, false),
+	KT0913_IOCTL(VIDIOC_QUERYMENU, false, false),
+	KT0913_IOCTL(VIDIOC_G_CTRL, false, false),
+	KT0913_IOCTL(VIDIOC_S_CTRL, true, false),
+	KT0913_IOCTL(VIDIOC_G_EXT_CTRLS, false, false),
+	KT0913_IOCTL(VIDIOC_S_EXT_CTRLS, true, false),
+	KT0913_IOCTL(VIDIOC_TRY_EXT_CTRLS, false, false),
+	KT0913_IOCTL(VIDIOC_SUBSCRIBE_EVENT, false, false),
+	KT0913_IOCTL(VIDIOC_UNSUBSCRIBE_EVENT, false, false),
+	KT0913_IOCTL(VIDIOC_DQEVENT, false, true),
+	KT0913_IOCTL(VIDIOC_LOG_STATUS, false, false),
+};
+
+/* one slot per described ioctl, plus one for the rest */
+#define KT0913_IOCTL_STAT_COUNT (ARRAY_SIZE(kt0913_ioctl_descs) + 1)
+
+struct kt0913_ioctl_stat {
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+	u64 slow;
+};
+
+/* per tuner controls of a merged node */
+enum {
+	KT0913_TUNER_CTRL_MUTE,
+	KT0913_TUNER_CTRL_VOLUME,
+	KT0913_TUNER_CTRL_GAIN,
+	KT0913_TUNER_CTRL_COUNT,
+};
+
+/*
+ * virtual tuner of a file handle. it's claimed (linked on the device list)
+ * by its first VIDIOC_S_FREQUENCY, and gets slices of dwell_ms in proportion
+ * to its weight.
+ */
+struct kt0913_vtuner {
+	struct list_head list;
+	unsigned int band;
+	unsigned int frequency;		/* kHz */
+
+	/* sampling requirements, set locklessly by the file handle controls */
+	unsigned int dwell_ms;
+	unsigned int weight;
+	int current_weight;		/* smooth weighted round robin state */
+
+	/* measurements of the last slice */
+	bool valid;
+	u8 rssi;			/* raw RSSI<4:0> */
+	bool stereo;
+	u32 samples;
+};
+
+struct kt0913_fh {
+	struct v4l2_fh fh;
+	struct v4l2_ctrl_handler ctrl_handler;
+	struct kt0913_vtuner vt;
+};
+
 /* kt0913 status struct */
 struct kt0913_device {
 	struct v4l2_device v4l2_dev;		/* main v4l2 struct */
 	struct i2c_client *client;			/* I2C client */
 	struct video_device vdev;			/* vide_device struct */
 	struct v4l2_ctrl_handler ctrl_handler; /* ctrl_handler struct */
+	struct v4l2_subdev sd;				/* subdev for bridge drivers */
+	bool sd_async;					/* sd registered with v4l2-async */
 
 	/* V4L2 Controls */
 	struct v4l2_ctrl *ctrl_pll_lock;    /* PLL lock */
@@ -161,8 +330,14 @@ struct kt0913_device {
 	struct v4l2_ctrl *ctrl_mute;        /* Master mute */
 	struct v4l2_ctrl *ctrl_deemphasis;  /* Deemphasis */
 
-	/* current operation band (fm, fm_campus, am) */
-	unsigned int band;
+	/*
+	 * band, channel and AM calibrations of the sequences shared with the
+	 * tests, see radio-kt0913-core.h. under the mutex.
+	 */
+	struct kt0913_core core;
+
+	/* FM range extended down to 32MHz on this instance */
+	bool use_campus_band;
 
 	/* audio dac anti-pop setting:
 	 *  0 -> 100uF (default)
@@ -187,13 +362,206 @@ struct kt0913_device {
 	 */
 	unsigned int refclock_val;
 
+	/* tuned and applied by __kt0913_init(), and the control defaults */
+	unsigned int default_band;
+	unsigned int default_khz;
+	s32 default_volume;
+	bool default_mute;
+
 	/* Regmap */
 	struct regmap *regmap;
 
+	/* audio output gated by DAPM (ASoC component bound to a card) */
+	bool dapm_managed;
+	bool audio_path_on;
+	/* the reference that keeps the chip active when there's no card */
+	bool pm_held;
+	bool component;			/* ASoC component registered */
+
 	/* For core assisted locking */
 	struct mutex mutex;
+
+	/* entry on kt0913_device_list */
+	struct list_head list;
+
+	/*
+	 * merged node: the owner keeps every chip by tuner index (itself on
+	 * index 0, NULL for removed ones). the others point to the owner and
+	 * keep their per tuner controls, which live on the owner's handler.
+	 */
+	struct kt0913_device *tuners[KT0913_MAX_TUNERS];
+	unsigned int n_tuners;
+	struct kt0913_device *primary;
+	unsigned int tuner_index;
+	struct v4l2_ctrl *tuner_ctrls[KT0913_TUNER_CTRL_COUNT];
+
+	/* virtual tuners claimed by the open file handles of the node */
+	bool vtuners_enabled;
+	struct list_head vtuners;
+	struct kt0913_vtuner *vtuner_current;	/* owns the current slice */
+	struct hrtimer vtuner_timer;
+	struct kthread_work vtuner_work;
+
+	/* ioctl latency, indexed like kt0913_ioctl_descs[] */
+	spinlock_t stats_lock;
+	struct kt0913_ioctl_stat ioctl_stats[KT0913_IOCTL_STAT_COUNT];
+	u32 reg_mismatches;	/* found by kt0913_check_state() */
+
+	/* plain I2C messages, so register runs go in a single transfer */
+	bool i2c_bulk;
+
+	/*
+	 * I2C sequences: the owner holds io_lock (the regmap lock) and the
+	 * adapter lock, and its transfers use the unlocked I2C calls
+	 */
+	struct mutex io_lock;
+	struct task_struct *bus_owner;
+	unsigned int bus_depth;
+	bool bus_held;
+	u64 bus_hold_start;
+	/* under stats_lock */
+	unsigned long bus_holds;
+	unsigned long bus_yields;
+	u64 bus_hold_total_ns;
+	u64 bus_hold_max_ns;
+
+	/*
+	 * token bucket of the background work (monitor, survey). every
+	 * transfer takes a token, but only the background work waits for
+	 * them. under stats_lock.
+	 */
+	unsigned int i2c_budget;	/* transfers per second, 0 = no limit */
+	s64 budget_tokens;		/* in 1/1000 of a transfer */
+	u64 budget_ns;			/* last refill */
+	unsigned int survey_cost;	/* transfers per channel, measured */
+	unsigned long i2c_background_ops;
+	unsigned long i2c_throttled;
+	struct task_struct *bg_owner;	/* running background work */
+
+	/* bus counters, updated with the regmap lock held */
+	unsigned long i2c_ops;
+	unsigned long i2c_retries;
+	unsigned long i2c_errors;
+	u64 bus_ns;
+	u32 bus_delay_us;	/* added to every transfer, from debugfs */
+	u64 chip_ns;		/* waiting for the chip, under the mutex */
+
+	/* STC/PLL lock polling, from the constants or the calibration */
+	unsigned int stc_poll_us;
+	unsigned int stc_timeout_ms;
+	struct kt0913_calibration calib;
+
+	/* cost of each kt0913_op, under stats_lock */
+	struct kt0913_op_stat op_stats[KT0913_OP_COUNT];
+	/* start of the ops run by the core, under the mutex */
+	struct kt0913_op_mark op_marks[KT0913_OP_COUNT];
+
+	/*
+	 * completed tunes (seek/tune complete reached), written with the
+	 * mutex and stats_lock held. tune_hist_us[] keeps the latency of
+	 * the last KT0913_TUNE_HIST_LEN ones, from the channel write to STC.
+	 */
+	unsigned long tune_count;
+	u64 tune_total_ns;
+	u64 tune_max_ns;
+	u32 tune_hist_us[KT0913_TUNE_HIST_LEN];
+	/*
+	 * start of the tune a VIDIOC_S_FREQUENCY left running, 0 if none,
+	 * under the mutex. tune_done_work follows it until STC.
+	 */
+	struct delayed_work tune_done_work;
+	u64 tune_pending_ns;
+
+	/* seeks, for the stats group */
+	unsigned long seek_count;
+
+	/*
+	 * AM tune latency without [0] and with [1] the antenna calibration
+	 * preloaded from core.amcali[]. under the mutex.
+	 */
+	unsigned long amtune_count[2];
+	u64 amtune_total_ns[2];
+
+	/* AM <-> FM switches, under the mutex */
+	unsigned long band_switch_count;
+	u64 band_switch_total_ns;
+	u64 band_switch_max_ns;
+
+	/* channel spacing in kHz, see kt0913_spacing() */
+	unsigned int fm_spacing;
+	unsigned int am_spacing;
+
+	/* AFC fine tuning of VIDIOC_S_FREQUENCY, under the mutex */
+	bool auto_fine_tune;
+	bool best_on_band_switch;
+	unsigned long afc_corrections;
+
+	/* time spent active and in standby, under stats_lock */
+	bool pm_standby;
+	u64 pm_changed_ns;	/* last standby change */
+	u64 pm_active_ns;
+	u64 pm_standby_ns;
+	unsigned long pm_suspends;
+	unsigned long pm_resumes;
+	/* time from leaving standby to PLL lock, log2 ms buckets */
+	u32 pm_resume_hist[KT0913_PM_HIST_BUCKETS];
+	u64 pm_resume_total_ns;
+	u64 pm_resume_max_ns;
+
+	/* signal monitor and squelch, under the mutex */
+	struct delayed_work monitor_work;
+	unsigned int monitor_interval_ms;	/* also set by kicks */
+	u8 monitor_rssi;		/* last sample */
+	u8 monitor_snr;			/* last sample, FM only */
+	u8 monitor_ref_rssi;		/* last one reported by an event */
+	u8 squelch;
+	bool squelched;
+	unsigned long monitor_samples;
+	unsigned long resets;		/* chip state lost and restored */
+	/* wakeups measured over KT0913_MONITOR_WINDOW_MS, in mHz */
+	u64 monitor_window_ns;
+	unsigned int monitor_window_samples;
+	unsigned int monitor_rate_mhz;
+
+	struct dentry *debugfs;
+
+	/* band survey: per-chip queue and the slice assigned to this chip */
+	struct workqueue_struct *wq;
+	struct work_struct survey_work;
+	struct kt0913_survey *survey;
+	unsigned int survey_first;	/* first channel index of the slice */
+	unsigned int survey_count;	/* channels on the slice */
+
+	/* timed operations: their hrtimers queue them on rt_worker */
+	struct kthread_worker *rt_worker;
+	bool rt_stopped;		/* the timers can't be armed anymore */
+	int rt_policy;			/* set by kt0913_rt_set_sched() */
+	unsigned int rt_priority;
+	/* wakeup jitter, under stats_lock */
+	struct kt0913_rt_stat rt_stats[KT0913_RT_OP_COUNT];
+};
+
+/* band survey shared by all instances, each one fills its own slice */
+struct kt0913_survey {
+	unsigned int band;
+	unsigned int first_khz;		/* frequency of channel 0 */
+	unsigned int step_khz;
+	unsigned int n_channels;
+	u8 *rssi;			/* raw RSSI<4:0> of each channel */
+
+	atomic_t pending;		/* slices still being scanned */
+	struct completion done;
+	int error;			/* first error reported by a slice */
+
+	char *text;			/* what reading "survey" returns */
+	size_t text_len;
 };
 
+/* last completed survey, shown through the "survey" sysfs attribute */
+static struct kt0913_survey *kt0913_last_survey;
+/* instance that owns the merged radio node, if kt0913_single_node is set */
+static struct kt0913_device *kt0913_single_node_owner;
+
 /* ************************************************************************* */
 
 /* Regmap settings */
@@ -218,70 +586,91 @@ static const struct regmap_access_table kt0913_all_registers_access_table = {
 	.n_yes_ranges = ARRAY_SIZE(kt0913_regmap_all_registers_range),
 };
 
-static const struct reg_sequence kt0913_init_regs_to_defaults[] = {
-	/* Standby disabled, volume 0dB */
-	{ KT0913_REG_RXCFG, 0x881F },
-	/* FM Channel spacing = 50kHz, Right & Left unmuted */
+/*
+ * registers updated by the chip itself. everything else is only changed by
+ * the driver, so it's served from the cache and unchanged field updates
+ * don't reach the bus.
+ */
+static const struct regmap_range kt0913_regmap_volatile_registers_range[] = {
+	regmap_reg_range(KT0913_REG_STATUSA, KT0913_REG_STATUSC),
+	regmap_reg_range(KT0913_REG_AMCALI, KT0913_REG_AMCALI),
+	regmap_reg_range(KT0913_REG_AMSTATUSA, KT0913_REG_AMSTATUSB),
+	regmap_reg_range(0x2F, 0x32),
+	regmap_reg_range(0x3A, 0x3A),
+	regmap_reg_range(KT0913_REG_AFC, KT0913_REG_AFC),
+};
+
+static const struct regmap_access_table kt0913_volatile_registers_access_table = {
+	.yes_ranges = kt0913_regmap_volatile_registers_range,
+	.n_yes_ranges = ARRAY_SIZE(kt0913_regmap_volatile_registers_range),
+};
+
+/*
+ * what the cache starts from, so creating the regmap doesn't read the chip:
+ * the values __kt0913_init() writes (kt0913_init_regs), plus
+ * the ID and TUNE, tuned by the init before it's ever read. the chip may
+ * hold its power-on values or the ones of a previous bind, the init writes
+ * all of them either way.
+ */
+static const struct reg_default kt0913_reg_defaults[] = {
+	{ KT0913_REG_CHIP_ID, 0x4B54 },
 	{ KT0913_REG_SEEK, 0x000B },
-	/* Stereo, High Stereo/Mono blend level, blend disabled */
+	{ KT0913_REG_TUNE, 0x0000 },
+	{ KT0913_REG_VOLUME, 0xE080 },
 	{ KT0913_REG_DSPCFGA, 0x1000 },
-	/* FM AFC Enabled */
 	{ KT0913_REG_LOCFGA, 0x0100 },
-	/* Campus band disabled by default */
 	{ KT0913_REG_LOCFGC, 0x0024 },
-	/*
-	 * FM mode, internal defined bands, clock from XT, 32.768kHz
-	 * 3dB audio gain, AM AFC Enabled
-	 */
+	{ KT0913_REG_RXCFG, 0x881F },
 	{ KT0913_REG_AMSYSCFG, 0x0002 },
-	/* Default AM freq = 504kHz */
-	{ KT0913_REG_AMCHAN, 0x01F8},
-	/* VOL and CH GPIOs set to HiZ */
+	{ KT0913_REG_AMCHAN, 0x01F8 },
 	{ KT0913_REG_GPIOCFG, 0x0000 },
-	/* AM Channel bandwidth = 6kHz, non-differential output */
 	{ KT0913_REG_AMDSP, 0xAFC4 },
-	/*
-	 * softmute is disabled on AM and FM, but set the defaults:
-	 * strong softmute attn., slow softmute attack/recover,
-	 * lowest AM softumte start level, almost the minimum
-	 * softmute target volume, RSSI mode for softmute, lowest
-	 * FM softmute start level
-	 */
 	{ KT0913_REG_SOFTMUTE, 0x0010 },
-	/* 1kHz for AM channel space, working mode A for the keys */
-	{ KT0913_REG_AMCFG, 0x1401 },
-	/* TIME1 = shortest, TIME2 = fastest */
-	{ KT0913_REG_AMCFG, 0x4050 },
-	/* set 86MHz as the default frequency, and tune it */
-	{ KT0913_REG_TUNE, 0x86B8 },
-	/*
-	 * FM&AM Softmute disabled, Mute disabled, 75us deemp.,
-	 * no bass boost, 100uF anti pop cap
-	 */
-	{ KT0913_REG_VOLUME, 0xE080 },
+	{ KT0913_REG_AMCFG, 0x1400 },
+	{ KT0913_REG_AMCFG2, 0x4050 },
 };
 
+static int kt0913_regmap_reg_read(void *context, unsigned int reg,
+	unsigned int *val);
+static int kt0913_regmap_reg_write(void *context, unsigned int reg,
+	unsigned int val);
+static void kt0913_regmap_lock(void *arg);
+static void kt0913_regmap_unlock(void *arg);
+
 static const struct regmap_config kt0913_regmap_config = {
 	.reg_bits = 8,
 	.val_bits = 16,
+	.reg_read = kt0913_regmap_reg_read,
+	.reg_write = kt0913_regmap_reg_write,
 	.max_register = KT0913_REG_AFC,
-	.volatile_table = &kt0913_all_registers_access_table,
-	.cache_type = REGCACHE_RBTREE,
-	.val_format_endian = REGMAP_ENDIAN_BIG,
+	.rd_table = &kt0913_all_registers_access_table,
+	.volatile_table = &kt0913_volatile_registers_access_table,
+	/* a handful of registers below 0x3C: a flat cache */
+	.cache_type = REGCACHE_FLAT,
+	.reg_defaults = kt0913_reg_defaults,
+	.num_reg_defaults = ARRAY_SIZE(kt0913_reg_defaults),
+	/* io_lock, so I2C sequences can hold it across several accesses */
+	.lock = kt0913_regmap_lock,
+	.unlock = kt0913_regmap_unlock,
 };
 
 /* ************************************************************************* */
 
-/* bands where the kt0913 operates */
-enum { BAND_FM, BAND_FM_CAMUS, BAND_AM };
-
+/*
+ * the HWSEEK caps describe the seek of kt0913_core_seek(), which doesn't use
+ * the chip's seek engine: it tunes the channels one by one and checks their
+ * RSSI, so it takes any limits, spacing and direction, and wraps around.
+ */
 static const struct v4l2_frequency_band kt0913_bands[] = {
 	{
 		/* BAND_FM */
 		.type = V4L2_TUNER_RADIO,
 		.index = 0, /* index provided to v4l2 */
 		.capability = V4L2_TUNER_CAP_LOW | V4L2_TUNER_CAP_STEREO |
-				  V4L2_TUNER_CAP_FREQ_BANDS,
+				  V4L2_TUNER_CAP_FREQ_BANDS |
+				  V4L2_TUNER_CAP_HWSEEK_BOUNDED |
+				  V4L2_TUNER_CAP_HWSEEK_WRAP |
+				  V4L2_TUNER_CAP_HWSEEK_PROG_LIM,
 		.rangelow = KT0913_FM_RANGE_LOW_NO_CAMPUS * V4L2_KHZ_FREQ_MUL,
 		.rangehigh = KT0913_FM_RANGE_HIGH * V4L2_KHZ_FREQ_MUL,
 		.modulation = V4L2_BAND_MODULATION_FM,
@@ -291,7 +680,10 @@ static const struct v4l2_frequency_band kt0913_bands[] = {
 		.type = V4L2_TUNER_RADIO,
 		.index = 0, /* index provided to v4l2 */
 		.capability = V4L2_TUNER_CAP_LOW | V4L2_TUNER_CAP_STEREO |
-				  V4L2_TUNER_CAP_FREQ_BANDS,
+				  V4L2_TUNER_CAP_FREQ_BANDS |
+				  V4L2_TUNER_CAP_HWSEEK_BOUNDED |
+				  V4L2_TUNER_CAP_HWSEEK_WRAP |
+				  V4L2_TUNER_CAP_HWSEEK_PROG_LIM,
 		.rangelow = KT0913_FM_RANGE_LOW_CAMPUS * V4L2_KHZ_FREQ_MUL,
 		.rangehigh = KT0913_FM_RANGE_HIGH * V4L2_KHZ_FREQ_MUL,
 		.modulation = V4L2_BAND_MODULATION_FM,
@@ -300,7 +692,10 @@ static const struct v4l2_frequency_band kt0913_bands[] = {
 		/* BAND_AM */
 		.type = V4L2_TUNER_RADIO,
 		.index = 1, /* index provided to v4l2 */
-		.capability = V4L2_TUNER_CAP_LOW | V4L2_TUNER_CAP_FREQ_BANDS,
+		.capability = V4L2_TUNER_CAP_LOW | V4L2_TUNER_CAP_FREQ_BANDS |
+				  V4L2_TUNER_CAP_HWSEEK_BOUNDED |
+				  V4L2_TUNER_CAP_HWSEEK_WRAP |
+				  V4L2_TUNER_CAP_HWSEEK_PROG_LIM,
 		.rangelow = KT0913_AM_RANGE_LOW * V4L2_KHZ_FREQ_MUL,
 		.rangehigh = KT0913_AM_RANGE_HIGH * V4L2_KHZ_FREQ_MUL,
 		.modulation = V4L2_BAND_MODULATION_AM,
@@ -316,6 +711,15 @@ static inline struct kt0913_device *v4l2_device_to_device(
 		struct kt0913_device, v4l2_dev);
 }
 
+static inline struct kt0913_device *i2c_client_to_device(
+	struct i2c_client *client)
+{
+	/* the client data is the subdev, as bridges expect */
+	struct v4l2_subdev *sd = i2c_get_clientdata(client);
+
+	return sd ? container_of(sd, struct kt0913_device, sd) : NULL;
+}
+
 static inline struct kt0913_device *v4l2_ctrl_to_device(
 	struct v4l2_ctrl *ctrl_handler)
 {
@@ -325,65 +729,455 @@ static inline struct kt0913_device *v4l2_ctrl_to_device(
 
 /* ************************************************************************* */
 
-static inline u32 khz_to_v4l2_freq(unsigned int freq)
+static void kt0913_bus_hold_account(struct kt0913_device *radio, u64 now)
+{
+	u64 ns = now - radio->bus_hold_start;
+
+	spin_lock(&radio->stats_lock);
+	radio->bus_holds++;
+	radio->bus_hold_total_ns += ns;
+	radio->bus_hold_max_ns = max(radio->bus_hold_max_ns, ns);
+	spin_unlock(&radio->stats_lock);
+}
+
+/*
+ * start a sequence of transfers that other devices on the bus can't get in
+ * between, e.g. a tune and its STC polls. sequences nest. called with the
+ * mutex held, never with the regmap lock.
+ */
+static void __kt0913_bus_take(struct kt0913_device *radio)
+{
+	mutex_lock(&radio->io_lock);
+	i2c_lock_bus(radio->client->adapter, I2C_LOCK_SEGMENT);
+	radio->bus_hold_start = ktime_get_ns();
+	radio->bus_held = true;
+	WRITE_ONCE(radio->bus_owner, current);
+}
+
+static void __kt0913_bus_release(struct kt0913_device *radio)
+{
+	WRITE_ONCE(radio->bus_owner, NULL);
+	radio->bus_held = false;
+	kt0913_bus_hold_account(radio, ktime_get_ns());
+	i2c_unlock_bus(radio->client->adapter, I2C_LOCK_SEGMENT);
+	mutex_unlock(&radio->io_lock);
+}
+
+static void __kt0913_bus_lock(struct kt0913_device *radio)
+{
+	if (radio->bus_depth++ || !READ_ONCE(kt0913_bus_hold_us))
+		return;
+
+	__kt0913_bus_take(radio);
+}
+
+static void __kt0913_bus_unlock(struct kt0913_device *radio)
+{
+	if (--radio->bus_depth || !radio->bus_held)
+		return;
+
+	__kt0913_bus_release(radio);
+}
+
+/*
+ * sleep in the middle of a sequence, e.g. between STC polls. the bus is
+ * only held for the transfers, the other devices get it meanwhile. the PM
+ * callbacks poll without the mutex, while the monitor may hold the bus, so
+ * only a hold of this task is let go.
+ */
+static void __kt0913_bus_sleep(struct kt0913_device *radio,
+	unsigned long min_us, unsigned long max_us)
+{
+	bool held = READ_ONCE(radio->bus_owner) == current;
+
+	if (held)
+		__kt0913_bus_release(radio);
+	usleep_range(min_us, max_us);
+	if (held)
+		__kt0913_bus_take(radio);
+}
+
+/* let the other devices in once a sequence held the bus for too long */
+static void kt0913_bus_yield(struct kt0913_device *radio, u64 now)
+{
+	u64 max_ns = (u64)READ_ONCE(kt0913_bus_hold_us) * NSEC_PER_USEC;
+
+	/* 0 only disables the sequences, not the holds that need the bus */
+	if (!max_ns || now - radio->bus_hold_start <= max_ns)
+		return;
+
+	kt0913_bus_hold_account(radio, now);
+	i2c_unlock_bus(radio->client->adapter, I2C_LOCK_SEGMENT);
+	/* relocking right away would most likely take it back first */
+	usleep_range(KT0913_BUS_YIELD_US, KT0913_BUS_YIELD_US * 2);
+	i2c_lock_bus(radio->client->adapter, I2C_LOCK_SEGMENT);
+	radio->bus_hold_start = ktime_get_ns();
+
+	spin_lock(&radio->stats_lock);
+	radio->bus_yields++;
+	spin_unlock(&radio->stats_lock);
+}
+
+/* the sequence owner has the regmap lock already, through io_lock */
+static void kt0913_regmap_lock(void *arg)
+{
+	struct kt0913_device *radio = arg;
+
+	if (READ_ONCE(radio->bus_owner) != current)
+		mutex_lock(&radio->io_lock);
+}
+
+static void kt0913_regmap_unlock(void *arg)
+{
+	struct kt0913_device *radio = arg;
+
+	if (READ_ONCE(radio->bus_owner) != current)
+		mutex_unlock(&radio->io_lock);
+}
+
+/*
+ * add the tokens earned since the last refill, up to a second worth. a
+ * debt is paid back in full first, however long it takes.
+ */
+static void kt0913_budget_refill(struct kt0913_device *radio, u64 now)
+{
+	s64 cap = (s64)radio->i2c_budget * 1000;
+	u64 fill_ns = div_u64((u64)(cap - radio->budget_tokens) * NSEC_PER_MSEC,
+		radio->i2c_budget);
+	u64 elapsed = min_t(u64, now - radio->budget_ns, fill_ns);
+
+	radio->budget_ns = now;
+	radio->budget_tokens = min_t(s64, cap, radio->budget_tokens +
+		div_u64(elapsed * radio->i2c_budget, NSEC_PER_MSEC));
+}
+
+/* take the token of a transfer, going into debt if there's none left */
+static void kt0913_budget_charge(struct kt0913_device *radio)
+{
+	bool background = READ_ONCE(radio->bg_owner) == current;
+
+	spin_lock(&radio->stats_lock);
+	if (background)
+		radio->i2c_background_ops++;
+	if (radio->i2c_budget) {
+		kt0913_budget_refill(radio, ktime_get_ns());
+		radio->budget_tokens -= 1000;
+	}
+	spin_unlock(&radio->stats_lock);
+}
+
+/*
+ * how many units of cost transfers the background work may do now, up to
+ * want. if none, it's throttled and wait_ms tells when one more fits. a
+ * full bucket always lets one unit through, even one costing more than a
+ * second worth of transfers: the debt makes the next one wait for it.
+ */
+static unsigned int kt0913_budget_fit(struct kt0913_device *radio,
+	unsigned int cost, unsigned int want, unsigned int *wait_ms)
+{
+	unsigned int n = want;
+	s64 tokens, need;
+
+	spin_lock(&radio->stats_lock);
+	if (radio->i2c_budget) {
+		kt0913_budget_refill(radio, ktime_get_ns());
+		tokens = radio->budget_tokens;
+		need = min_t(s64, cost * 1000, (s64)radio->i2c_budget * 1000);
+		n = tokens >= need ? clamp_t(u64,
+			div_u64(tokens, cost * 1000), 1, want) : 0;
+		if (!n) {
+			*wait_ms = DIV_ROUND_UP_ULL(need - tokens,
+				radio->i2c_budget);
+			radio->i2c_throttled++;
+		}
+	}
+	spin_unlock(&radio->stats_lock);
+
+	return n;
+}
+
+/* sleep until the background work may do at least one unit of cost */
+static unsigned int kt0913_budget_wait(struct kt0913_device *radio,
+	unsigned int cost, unsigned int want)
+{
+	unsigned int n, wait_ms;
+
+	/* never with the mutex held, so the ioctls go first */
+	for (;;) {
+		n = kt0913_budget_fit(radio, cost, want, &wait_ms);
+		if (n)
+			return n;
+		msleep(wait_ms);
+	}
+}
+
+/*
+ * count a transfer and return its start time. the injected delay emulates
+ * a slower bus, and it's accounted as bus time. returns whether the bus is
+ * held by this sequence.
+ */
+static bool kt0913_bus_start(struct kt0913_device *radio, u64 *start)
+{
+	bool held = READ_ONCE(radio->bus_owner) == current;
+	u32 delay = READ_ONCE(radio->bus_delay_us);
+
+	if (held)
+		kt0913_bus_yield(radio, ktime_get_ns());
+
+	*start = ktime_get_ns();
+	radio->i2c_ops++;
+	kt0913_budget_charge(radio);
+	if (delay)
+		usleep_range(delay, delay + delay / 8 + 1);
+
+	return held;
+}
+
+static void kt0913_op_begin(struct kt0913_device *radio,
+	struct kt0913_op_mark *mark)
+{
+	mark->start = ktime_get_ns();
+	mark->xfers = READ_ONCE(radio->i2c_ops);
+	mark->bus_ns = READ_ONCE(radio->bus_ns);
+	mark->chip_ns = radio->chip_ns;
+}
+
+static void kt0913_op_end(struct kt0913_device *radio, enum kt0913_op op,
+	const struct kt0913_op_mark *mark)
+{
+	struct kt0913_op_stat *stat = &radio->op_stats[op];
+	u64 now = ktime_get_ns();
+
+	spin_lock(&radio->stats_lock);
+	stat->count++;
+	stat->xfers += READ_ONCE(radio->i2c_ops) - mark->xfers;
+	stat->total_ns += now - mark->start;
+	stat->bus_ns += READ_ONCE(radio->bus_ns) - mark->bus_ns;
+	stat->chip_ns += radio->chip_ns - mark->chip_ns;
+	spin_unlock(&radio->stats_lock);
+}
+
+/* time spent waiting for the chip, without the polling transfers */
+static void __kt0913_chip_wait_end(struct kt0913_device *radio,
+	const struct kt0913_op_mark *mark)
+{
+	radio->chip_ns += ktime_get_ns() - mark->start -
+		(READ_ONCE(radio->bus_ns) - mark->bus_ns);
+}
+
+/*
+ * regmap accessors: SMBus word transfers (MSB first, hence swapped),
+ * retried a few times and counted
+ */
+static int kt0913_regmap_reg_read(void *context, unsigned int reg,
+	unsigned int *val)
+{
+	struct kt0913_device *radio = context;
+	struct i2c_client *client = radio->client;
+	union i2c_smbus_data data;
+	unsigned int tries = 0;
+	u64 start;
+	s32 ret;
+
+	do {
+		if (tries)
+			radio->i2c_retries++;
+		if (kt0913_bus_start(radio, &start)) {
+			ret = __i2c_smbus_xfer(client->adapter, client->addr,
+				client->flags, I2C_SMBUS_READ, reg,
+				I2C_SMBUS_WORD_DATA, &data);
+			if (!ret)
+				ret = swab16(data.word);
+		} else {
+			ret = i2c_smbus_read_word_swapped(client, reg);
+		}
+		radio->bus_ns += ktime_get_ns() - start;
+	} while (ret < 0 && ++tries <= KT0913_I2C_RETRIES);
+
+	if (ret < 0) {
+		radio->i2c_errors++;
+		return ret;
+	}
+
+	*val = ret;
+
+	return 0;
+}
+
+static int kt0913_regmap_reg_write(void *context, unsigned int reg,
+	unsigned int val)
+{
+	struct kt0913_device *radio = context;
+	struct i2c_client *client = radio->client;
+	union i2c_smbus_data data = { .word = swab16(val) };
+	unsigned int tries = 0;
+	u64 start;
+	s32 ret;
+
+	do {
+		if (tries)
+			radio->i2c_retries++;
+		if (kt0913_bus_start(radio, &start))
+			ret = __i2c_smbus_xfer(client->adapter, client->addr,
+				client->flags, I2C_SMBUS_WRITE, reg,
+				I2C_SMBUS_WORD_DATA, &data);
+		else
+			ret = i2c_smbus_write_word_swapped(client, reg, val);
+		radio->bus_ns += ktime_get_ns() - start;
+	} while (ret < 0 && ++tries <= KT0913_I2C_RETRIES);
+
+	if (ret < 0)
+		radio->i2c_errors++;
+
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * regmap bus for adapters that do plain I2C: register runs are read with a
+ * combined write/read message (repeated start) and written with a single
+ * message, values MSB first
+ */
+static int kt0913_i2c_transfer(struct kt0913_device *radio,
+	struct i2c_msg *msgs, int num)
+{
+	unsigned int tries = 0;
+	u64 start;
+	int ret;
+
+	do {
+		if (tries)
+			radio->i2c_retries++;
+		if (kt0913_bus_start(radio, &start))
+			ret = __i2c_transfer(radio->client->adapter, msgs, num);
+		else
+			ret = i2c_transfer(radio->client->adapter, msgs, num);
+		radio->bus_ns += ktime_get_ns() - start;
+	} while (ret != num && ++tries <= KT0913_I2C_RETRIES);
+
+	if (ret != num) {
+		radio->i2c_errors++;
+		return ret < 0 ? ret : -EIO;
+	}
+
+	return 0;
+}
+
+static int kt0913_regmap_bus_read(void *context, const void *reg_buf,
+	size_t reg_size, void *val_buf, size_t val_size)
 {
-	return freq * V4L2_KHZ_FREQ_MUL;
+	struct kt0913_device *radio = context;
+	struct i2c_msg msgs[] = {
+		{
+			.addr = radio->client->addr,
+			.len = reg_size,
+			.buf = (u8 *)reg_buf,
+		}, {
+			.addr = radio->client->addr,
+			.flags = I2C_M_RD,
+			.len = val_size,
+			.buf = val_buf,
+		},
+	};
+
+	return kt0913_i2c_transfer(radio, msgs, ARRAY_SIZE(msgs));
 }
 
-static inline unsigned int v4l2_freq_to_khz(u32 v4l2_freq)
+static int kt0913_regmap_bus_write(void *context, const void *data,
+	size_t count)
 {
-	return v4l2_freq / V4L2_KHZ_FREQ_MUL;
+	struct kt0913_device *radio = context;
+	struct i2c_msg msg = {
+		.addr = radio->client->addr,
+		.len = count,
+		.buf = (u8 *)data,
+	};
+
+	return kt0913_i2c_transfer(radio, &msg, 1);
 }
 
+static const struct regmap_bus kt0913_regmap_bus = {
+	.read = kt0913_regmap_bus_read,
+	.write = kt0913_regmap_bus_write,
+	.val_format_endian_default = REGMAP_ENDIAN_BIG,
+};
+
 /* ************************************************************************* */
 
-static int __kt0913_get_fm_frequency(struct kt0913_device *radio,
-	unsigned int *frequency)
+static int __kt0913_field_read(struct kt0913_device *radio,
+	enum kt0913_field field, unsigned int *val)
 {
-	unsigned int tune_reg;
-	int ret = regmap_read(radio->regmap, KT0913_REG_TUNE, &tune_reg);
+	unsigned int reg;
+	int ret = regmap_read(radio->regmap, kt0913_fields[field].reg, &reg);
 
 	if (ret)
 		return ret;
 
-	*frequency = (tune_reg & KT0913_TUNE_FMCHAN_MASK) * KT0913_FMCHAN_MUL;
+	*val = kt0913_field_get(field, reg);
 
 	return 0;
 }
 
-static int __kt0913_set_fm_frequency(struct kt0913_device *radio,
-	unsigned int frequency)
+/*
+ * read a register from the chip even if it's cached, e.g. to check the
+ * cache. the bus is held meanwhile, so no other regmap user can get in
+ * while the cache is bypassed. called with the mutex held.
+ */
+static int __kt0913_read_uncached(struct kt0913_device *radio,
+	unsigned int reg, unsigned int *val)
+{
+	bool take = READ_ONCE(radio->bus_owner) != current;
+	int ret;
+
+	if (take)
+		__kt0913_bus_take(radio);
+
+	regcache_cache_bypass(radio->regmap, true);
+	ret = regmap_read(radio->regmap, reg, val);
+	regcache_cache_bypass(radio->regmap, false);
+
+	if (take)
+		__kt0913_bus_release(radio);
+
+	return ret;
+}
+
+static int __kt0913_field_write(struct kt0913_device *radio,
+	enum kt0913_field field, unsigned int val)
 {
-	return regmap_write(radio->regmap, KT0913_REG_TUNE,
-		KT0913_TUNE_FMTUNE_ON | (frequency / KT0913_FMCHAN_MUL));
+	return regmap_update_bits(radio->regmap, kt0913_fields[field].reg,
+		kt0913_field_mask(field), kt0913_field_prep(field, val));
 }
 
 /* ************************************************************************* */
 
 static int __kt0913_set_mute(struct kt0913_device *radio, int on)
 {
-	return regmap_update_bits(radio->regmap,
-		KT0913_REG_VOLUME, KT0913_VOLUME_DMUTE_MASK,
+	return __kt0913_field_write(radio, KT0913_F_DMUTE,
 		on ? KT0913_VOLUME_DMUTE_ON : KT0913_VOLUME_DMUTE_OFF);
 }
 
 /* ************************************************************************* */
 
+/* mute if asked to, or if the squelch or the DAPM path says so */
+static int __kt0913_update_mute(struct kt0913_device *radio, bool mute)
+{
+	return __kt0913_set_mute(radio, mute || radio->squelched ||
+		(radio->dapm_managed && !radio->audio_path_on));
+}
+
 static int __kt0913_set_deemphasis(struct kt0913_device *radio, s32 deemp)
 {
 	switch (deemp) {
 	case V4L2_DEEMPHASIS_75_uS:
-		return regmap_update_bits(radio->regmap,
-			KT0913_REG_VOLUME, KT0913_VOLUME_DE_MASK,
-			KT0913_VOLUME_DE_50US);
+		return __kt0913_field_write(radio, KT0913_F_DE,
+			KT0913_VOLUME_DE_75US);
 
 		/* 50us is used for the disabled option (which is not supported
 		 * on the chip) and the 50uS value
 		 */
 	default:
-		return regmap_update_bits(radio->regmap,
-			KT0913_REG_VOLUME, KT0913_VOLUME_DE_MASK,
-			KT0913_VOLUME_DE_75US);
+		return __kt0913_field_write(radio, KT0913_F_DE,
+			KT0913_VOLUME_DE_50US);
 	}
 }
 
@@ -391,73 +1185,73 @@ static int __kt0913_set_deemphasis(struct kt0913_device *radio, s32 deemp)
 
 static int __kt0913_set_volume(struct kt0913_device *radio, s32 volume)
 {
-	/* map [-60, 0] to [1, 31] which is what the kt0913 expects */
-	volume = (volume / 2) + 31;
-	return regmap_update_bits(radio->regmap,
-		KT0913_REG_RXCFG, KT0913_RXCFGA_VOLUME_MASK,
-		volume);
+	return __kt0913_field_write(radio, KT0913_F_VOLUME,
+		kt0913_volume_to_reg(volume));
 }
 
 /* ************************************************************************* */
 
-static int __kt0913_set_standby(struct kt0913_device *radio, int standby)
+/* add the time since the last standby change to the current state */
+static void kt0913_pm_account(struct kt0913_device *radio, u64 now)
 {
-	return regmap_update_bits(radio->regmap,
-		KT0913_REG_RXCFG, KT0913_RXCFGA_STDBY_MASK,
-		standby ? KT0913_RXCFGA_STDBY_ON : KT0913_RXCFGA_STDBY_OFF);
-}
+	u64 elapsed = now - radio->pm_changed_ns;
 
-/* ************************************************************************* */
+	if (radio->pm_standby)
+		radio->pm_standby_ns += elapsed;
+	else
+		radio->pm_active_ns += elapsed;
+	radio->pm_changed_ns = now;
+}
 
-static int __kt0913_get_pll_status(struct kt0913_device *radio, int *locked)
+static int __kt0913_set_standby(struct kt0913_device *radio, int standby)
 {
-	unsigned int statusa_reg;
-	int ret = regmap_read(radio->regmap, KT0913_REG_STATUSA, &statusa_reg);
+	int ret = __kt0913_field_write(radio, KT0913_F_STDBY,
+		standby ? KT0913_RXCFGA_STDBY_ON : KT0913_RXCFGA_STDBY_OFF);
 
 	if (ret)
 		return ret;
 
-	*locked = (statusa_reg & KT0913_STATUSA_PLL_LOCK_MASK) ==
-		KT0913_STATUSA_PLL_LOCK_LOCKED ? 1 : 0;
+	spin_lock(&radio->stats_lock);
+	kt0913_pm_account(radio, ktime_get_ns());
+	if (radio->pm_standby != !!standby) {
+		if (standby)
+			radio->pm_suspends++;
+		else
+			radio->pm_resumes++;
+	}
+	radio->pm_standby = standby;
+	spin_unlock(&radio->stats_lock);
 
 	return 0;
 }
 
 /* ************************************************************************* */
 
-static int __kt0913_get_rx_stereo_or_mono(struct kt0913_device *radio,
-	int *stereo)
+static int __kt0913_get_pll_status(struct kt0913_device *radio, int *locked)
 {
-	unsigned int statusa_reg;
-	int ret = regmap_read(radio->regmap, KT0913_REG_STATUSA, &statusa_reg);
+	unsigned int pll_lock;
+	int ret = __kt0913_field_read(radio, KT0913_F_PLL_LOCK, &pll_lock);
 
 	if (ret)
 		return ret;
 
-	*stereo = (statusa_reg & KT0913_STATUSA_ST_MASK) ==
-		KT0913_STATUSA_ST_STEREO ? 1 : 0;
+	*locked = pll_lock == KT0913_STATUSA_PLL_LOCK_LOCKED ? 1 : 0;
 
 	return 0;
 }
 
 /* ************************************************************************* */
 
-static int __kt0913_get_fm_rssi(struct kt0913_device *radio, s32 *rssi)
+static int __kt0913_get_rx_stereo_or_mono(struct kt0913_device *radio,
+	int *stereo)
 {
-	unsigned int statusa_reg;
-	int ret = regmap_read(radio->regmap, KT0913_REG_STATUSA, &statusa_reg);
+	unsigned int st;
+	int ret = __kt0913_field_read(radio, KT0913_F_ST, &st);
 
 	if (ret)
 		return ret;
 
-	/* RSSI(dBm) = -100 + FMRSSI<4:0> * 3dBm
-	 * even tho we can get the value in dBm, we want a %
-	 */
-	*rssi = (statusa_reg & KT0913_STATUSA_FMRSSI_MASK) >>
-		KT0913_STATUSA_FMRSSI_SHIFT;
-	/* map range 0-31 to 0-65535 */
-	*rssi *= 65535;
-	*rssi /= KT0913_STATUSA_FMRSSI_MASK >> KT0913_STATUSA_FMRSSI_SHIFT;
+	*stereo = st == KT0913_STATUSA_ST_STEREO ? 1 : 0;
 
 	return 0;
 }
@@ -467,14 +1261,13 @@ static int __kt0913_get_fm_rssi(struct kt0913_device *radio, s32 *rssi)
 static int __kt0913_get_cfg_stereo_enabled(struct kt0913_device *radio,
 	int *stereo)
 {
-	unsigned int dspcfga_reg;
-	int ret = regmap_read(radio->regmap, KT0913_REG_DSPCFGA, &dspcfga_reg);
+	unsigned int mono;
+	int ret = __kt0913_field_read(radio, KT0913_F_MONO, &mono);
 
 	if (ret)
 		return ret;
 
-	*stereo = (dspcfga_reg & KT0913_DSPCFGA_MONO_MASK) ==
-		KT0913_DSPCFGA_MONO_OFF ? 1 : 0;
+	*stereo = mono == KT0913_DSPCFGA_MONO_OFF ? 1 : 0;
 
 	return ret;
 }
@@ -482,8 +1275,7 @@ static int __kt0913_get_cfg_stereo_enabled(struct kt0913_device *radio,
 static int __kt0913_set_cfg_stereo_enabled(struct kt0913_device *radio,
 	int stereo)
 {
-	return regmap_update_bits(radio->regmap,
-		KT0913_REG_DSPCFGA, KT0913_DSPCFGA_MONO_MASK,
+	return __kt0913_field_write(radio, KT0913_F_MONO,
 		stereo ? KT0913_DSPCFGA_MONO_OFF : KT0913_DSPCFGA_MONO_ON);
 }
 
@@ -493,20 +1285,16 @@ static int __kt0913_set_au_gain(struct kt0913_device *radio, s32 gain)
 {
 	switch (gain) {
 	case 6:
-		return regmap_update_bits(radio->regmap,
-			KT0913_REG_AMSYSCFG, KT0913_AMSYSCFG_AU_GAIN_MASK,
+		return __kt0913_field_write(radio, KT0913_F_AU_GAIN,
 			KT0913_AMSYSCFG_AU_GAIN_6DB);
 	case 3:
-		return regmap_update_bits(radio->regmap,
-			KT0913_REG_AMSYSCFG, KT0913_AMSYSCFG_AU_GAIN_MASK,
+		return __kt0913_field_write(radio, KT0913_F_AU_GAIN,
 			KT0913_AMSYSCFG_AU_GAIN_3DB);
 	case 0:
-		return regmap_update_bits(radio->regmap,
-			KT0913_REG_AMSYSCFG, KT0913_AMSYSCFG_AU_GAIN_MASK,
+		return __kt0913_field_write(radio, KT0913_F_AU_GAIN,
 			KT0913_AMSYSCFG_AU_GAIN_0DB);
 	case -3:
-		return regmap_update_bits(radio->regmap,
-			KT0913_REG_AMSYSCFG, KT0913_AMSYSCFG_AU_GAIN_MASK,
+		return __kt0913_field_write(radio, KT0913_F_AU_GAIN,
 			KT0913_AMSYSCFG_AU_GAIN_MIN_3DB);
 	default:
 		return -EINVAL;
@@ -515,387 +1303,3573 @@ static int __kt0913_set_au_gain(struct kt0913_device *radio, s32 gain)
 
 /* ************************************************************************* */
 
-static int __kt0913_set_am_fm_band(struct kt0913_device *radio,
-	unsigned int band)
-{
-	return regmap_update_bits(radio->regmap,
-		KT0913_REG_AMSYSCFG, KT0913_AMSYSCFG_AM_FM_MASK,
-		band == BAND_AM ?
-		KT0913_AMSYSCFG_AM_FM_AM : KT0913_AMSYSCFG_AM_FM_FM);
-}
-
-/* ************************************************************************* */
-
-static int __kt0913_get_am_frequency(struct kt0913_device *radio,
-	unsigned int *frequency)
+static int __kt0913_get_am_rssi(struct kt0913_device *radio, s32 *rssi)
 {
-	unsigned int amchan_reg;
-	int ret = regmap_read(radio->regmap, KT0913_REG_AMCHAN, &amchan_reg);
+	unsigned int amrssi;
+	int ret = __kt0913_field_read(radio, KT0913_F_AMRSSI, &amrssi);
 
 	if (ret)
 		return ret;
 
-	*frequency = (amchan_reg & KT0913_AMCHAN_AMCHAN_MASK);
+	/* AMRSSI(dBm) = -90 + AMRSSI<4:0> * 3dBm
+	 * even tho we can get the value in dBm, we want a %
+	 */
+	*rssi = kt0913_raw_rssi_to_signal(amrssi);
 
 	return 0;
 }
 
-static int __kt0913_set_am_frequency(struct kt0913_device *radio,
-	unsigned int frequency)
+/* ************************************************************************* */
+
+/* channel spacing of a band in kHz, the controls live on the owner */
+static unsigned int kt0913_spacing(struct kt0913_device *radio,
+	unsigned int band)
 {
-	return regmap_write(radio->regmap, KT0913_REG_AMCHAN,
-		KT0913_AMCHAN_AMTUNE_ON | frequency);
+	struct kt0913_device *owner = radio->primary ?: radio;
+
+	return band == BAND_AM ?
+		READ_ONCE(owner->am_spacing) : READ_ONCE(owner->fm_spacing);
 }
 
 /* ************************************************************************* */
 
-static int __kt0913_get_am_rssi(struct kt0913_device *radio, s32 *rssi)
+static int __kt0913_init(struct kt0913_device *radio)
+{
+	const struct kt0913_core_cfg cfg = {
+		.anti_pop = radio->audio_anti_pop,
+		.refclk = radio->refclock_val,
+		.campus = radio->use_campus_band,
+		.mute = radio->default_mute,
+		.volume = radio->default_volume,
+		.fm_spacing = radio->fm_spacing,
+		.am_spacing = radio->am_spacing,
+		/* the only tune of the boot, straight to the DT station */
+		.band = radio->default_band,
+		.khz = radio->default_khz,
+	};
+	int ret;
+
+	if (radio->use_campus_band)
+		v4l2_info(radio->client,
+			"campus band is enabled!");
+
+	/*
+	 * write the defaults, all of them: the cache holds them already (see
+	 * kt0913_reg_defaults), the chip may not
+	 */
+	ret = kt0913_core_init(&radio->core, &cfg);
+	if (ret)
+		v4l2_err(radio->client,
+			"kt0913_core_init() failed! %d", ret);
+
+	return ret;
+}
+
+/* ************************************************************************* */
+
+/* poll the seek/tune complete flag until it's set or the timeout expires */
+static int __kt0913_wait_stc(struct kt0913_device *radio)
+{
+	unsigned int poll = READ_ONCE(radio->stc_poll_us);
+	unsigned long timeout = jiffies +
+		msecs_to_jiffies(READ_ONCE(radio->stc_timeout_ms));
+	struct kt0913_op_mark mark;
+	unsigned int stc;
+	int ret;
+
+	kt0913_op_begin(radio, &mark);
+
+	do {
+		__kt0913_bus_sleep(radio, poll, poll * 2);
+
+		ret = __kt0913_field_read(radio, KT0913_F_STC, &stc);
+		if (ret || stc)
+			goto out;
+	} while (time_before(jiffies, timeout));
+
+	ret = -ETIMEDOUT;
+out:
+	__kt0913_chip_wait_end(radio, &mark);
+	return ret;
+}
+
+/* wait for the PLL to lock after leaving standby */
+static int __kt0913_wait_pll_lock(struct kt0913_device *radio)
+{
+	unsigned int poll = READ_ONCE(radio->stc_poll_us);
+	unsigned long timeout = jiffies +
+		msecs_to_jiffies(READ_ONCE(radio->stc_timeout_ms));
+	struct kt0913_op_mark mark;
+	int locked;
+	int ret;
+
+	kt0913_op_begin(radio, &mark);
+
+	do {
+		ret = __kt0913_get_pll_status(radio, &locked);
+		if (ret || locked)
+			goto out;
+
+		__kt0913_bus_sleep(radio, poll, poll * 2);
+	} while (time_before(jiffies, timeout));
+
+	ret = -ETIMEDOUT;
+out:
+	__kt0913_chip_wait_end(radio, &mark);
+	return ret;
+}
+
+/*
+ * leave standby and wait until the PLL is locked, accounting the time it
+ * takes on the resume latency histogram
+ */
+static int __kt0913_wake(struct kt0913_device *radio)
+{
+	u64 start = ktime_get_ns();
+	unsigned int bucket;
+	u64 ns;
+	int ret;
+
+	ret = __kt0913_set_standby(radio, false);
+	if (ret)
+		return ret;
+
+	ret = __kt0913_wait_pll_lock(radio);
+	if (ret)
+		v4l2_warn(radio->client, "PLL didn't lock on resume (%d)", ret);
+
+	/* bucket N holds [2^(N-1), 2^N) ms, the last one everything above */
+	ns = ktime_get_ns() - start;
+	bucket = min_t(unsigned int, fls64(div_u64(ns, NSEC_PER_MSEC)),
+		KT0913_PM_HIST_BUCKETS - 1);
+
+	spin_lock(&radio->stats_lock);
+	radio->pm_resume_hist[bucket]++;
+	radio->pm_resume_total_ns += ns;
+	radio->pm_resume_max_ns = max(radio->pm_resume_max_ns, ns);
+	spin_unlock(&radio->stats_lock);
+
+	return 0;
+}
+
+static inline struct kt0913_device *kt0913_core_to_device(
+	struct kt0913_core *core)
+{
+	return container_of(core, struct kt0913_device, core);
+}
+
+/* the I/O of the sequences of radio-kt0913-core.h, through the regmap */
+static int kt0913_io_read(struct kt0913_core *core, u8 reg, u16 *val)
+{
+	unsigned int tmp;
+	int ret = regmap_read(kt0913_core_to_device(core)->regmap, reg, &tmp);
+
+	if (!ret)
+		*val = tmp;
+
+	return ret;
+}
+
+static int kt0913_io_write(struct kt0913_core *core, u8 reg, u16 val)
+{
+	return regmap_write(kt0913_core_to_device(core)->regmap, reg, val);
+}
+
+static int kt0913_io_update_bits(struct kt0913_core *core, u8 reg, u16 mask,
+	u16 val)
+{
+	return regmap_update_bits(kt0913_core_to_device(core)->regmap, reg,
+		mask, val);
+}
+
+static int kt0913_io_bulk_write(struct kt0913_core *core, u8 reg,
+	const u16 *val, unsigned int count)
+{
+	return regmap_bulk_write(kt0913_core_to_device(core)->regmap, reg,
+		val, count);
+}
+
+static int kt0913_io_wait_stc(struct kt0913_core *core)
+{
+	return __kt0913_wait_stc(kt0913_core_to_device(core));
+}
+
+/* a signal ends a seek, it may go on for the whole band */
+static int kt0913_io_interrupted(struct kt0913_core *core)
+{
+	return signal_pending(current) ? -ERESTARTSYS : 0;
+}
+
+static void kt0913_io_op_begin(struct kt0913_core *core, enum kt0913_op op)
+{
+	struct kt0913_device *radio = kt0913_core_to_device(core);
+
+	/* a tune left by VIDIOC_S_FREQUENCY won't be the one finishing */
+	radio->tune_pending_ns = 0;
+	kt0913_op_begin(radio, &radio->op_marks[op]);
+
+	/* the channel write and the STC polls, without other devices between */
+	if (op == KT0913_OP_TUNE || op == KT0913_OP_BAND_SWITCH)
+		__kt0913_bus_lock(radio);
+}
+
+/* a tune that reached STC ns after its channel write, with the mutex held */
+static void __kt0913_tune_account(struct kt0913_device *radio, u64 ns)
+{
+	bool preloaded = radio->core.amcali_preloaded;
+
+	spin_lock(&radio->stats_lock);
+	radio->tune_hist_us[radio->tune_count % KT0913_TUNE_HIST_LEN] =
+		div_u64(ns, NSEC_PER_USEC);
+	radio->tune_count++;
+	radio->tune_total_ns += ns;
+	radio->tune_max_ns = max(radio->tune_max_ns, ns);
+	spin_unlock(&radio->stats_lock);
+
+	if (radio->core.band == BAND_AM && kt0913_am_cali_cache) {
+		radio->amtune_count[preloaded]++;
+		radio->amtune_total_ns[preloaded] += ns;
+	}
+}
+
+static void kt0913_io_op_end(struct kt0913_core *core, enum kt0913_op op,
+	int ret)
+{
+	struct kt0913_device *radio = kt0913_core_to_device(core);
+	const struct kt0913_op_mark *mark = &radio->op_marks[op];
+	u64 ns;
+
+	if (op == KT0913_OP_TUNE || op == KT0913_OP_BAND_SWITCH)
+		__kt0913_bus_unlock(radio);
+	kt0913_op_end(radio, op, mark);
+	if (ret)
+		return;
+
+	ns = ktime_get_ns() - mark->start;
+	switch (op) {
+	case KT0913_OP_TUNE:
+		__kt0913_tune_account(radio, ns);
+		break;
+	case KT0913_OP_BAND_SWITCH:
+		radio->band_switch_count++;
+		radio->band_switch_total_ns += ns;
+		radio->band_switch_max_ns = max(radio->band_switch_max_ns, ns);
+		break;
+	default:
+		break;
+	}
+}
+
+static const struct kt0913_core_ops kt0913_regmap_core_ops = {
+	.read = kt0913_io_read,
+	.write = kt0913_io_write,
+	.update_bits = kt0913_io_update_bits,
+	.bulk_write = kt0913_io_bulk_write,
+	.wait_stc = kt0913_io_wait_stc,
+	.interrupted = kt0913_io_interrupted,
+	.op_begin = kt0913_io_op_begin,
+	.op_end = kt0913_io_op_end,
+};
+
+/* ************************************************************************* */
+
+/*
+ * poll a field quickly until it reads val, returning the time it took since
+ * start in us
+ */
+static int __kt0913_calib_poll(struct kt0913_device *radio,
+	enum kt0913_field field, unsigned int val, u64 start, u32 *us)
+{
+	unsigned long timeout = jiffies +
+		msecs_to_jiffies(KT0913_CALIB_MAX_TIMEOUT_MS);
+	unsigned int cur;
+	int ret;
+
+	do {
+		ret = __kt0913_field_read(radio, field, &cur);
+		if (ret)
+			return ret;
+
+		if (cur == val) {
+			*us = div_u64(ktime_get_ns() - start, NSEC_PER_USEC);
+			return 0;
+		}
+
+		__kt0913_bus_sleep(radio, KT0913_CALIB_POLL_US,
+			KT0913_CALIB_POLL_US * 2);
+	} while (time_before(jiffies, timeout));
+
+	return -ETIMEDOUT;
+}
+
+static int __kt0913_calib_bus(struct kt0913_device *radio,
+	struct kt0913_calibration *calib)
+{
+	unsigned int i, val;
+	u64 start, ns;
+	int ret;
+
+	calib->bus_us = U32_MAX;
+	for (i = 0; i < KT0913_CALIB_BUS_READS; i++) {
+		/* volatile, so it's a real read every time */
+		start = ktime_get_ns();
+		ret = regmap_read(radio->regmap, KT0913_REG_STATUSA, &val);
+		if (ret)
+			return ret;
+		ns = ktime_get_ns() - start;
+
+		calib->bus_us = min_t(u32, calib->bus_us,
+			div_u64(ns, NSEC_PER_USEC));
+	}
+
+	return 0;
+}
+
+/* a standby cycle, straight on the field to keep it off the PM stats */
+static int __kt0913_calib_xtal(struct kt0913_device *radio,
+	struct kt0913_calibration *calib)
+{
+	u64 start;
+	int ret;
+
+	ret = __kt0913_field_write(radio, KT0913_F_STDBY,
+		KT0913_RXCFGA_STDBY_ON);
+	if (ret)
+		return ret;
+
+	__kt0913_bus_sleep(radio, KT0913_STC_POLL_US, KT0913_STC_POLL_US * 2);
+
+	start = ktime_get_ns();
+	ret = __kt0913_field_write(radio, KT0913_F_STDBY,
+		KT0913_RXCFGA_STDBY_OFF);
+	if (ret)
+		return ret;
+
+	ret = __kt0913_calib_poll(radio, KT0913_F_XTAL_OK, 1, start,
+		&calib->xtal_us);
+	if (ret)
+		return ret;
+
+	return __kt0913_calib_poll(radio, KT0913_F_PLL_LOCK,
+		KT0913_STATUSA_PLL_LOCK_LOCKED, start, &calib->pll_us);
+}
+
+/* a few tunes spread over the band */
+static int __kt0913_calib_tunes(struct kt0913_device *radio,
+	unsigned int band, struct kt0913_calibration *calib)
+{
+	unsigned int low = v4l2_freq_to_khz(kt0913_bands[band].rangelow);
+	unsigned int high = v4l2_freq_to_khz(kt0913_bands[band].rangehigh);
+	unsigned int step = kt0913_spacing(radio, band);
+	unsigned int i, khz;
+	u32 *max = &calib->stc_us[band == BAND_AM];
+	u64 start;
+	u32 us;
+	int ret;
+
+	for (i = 0; i < KT0913_CALIB_TUNES; i++) {
+		khz = low + (high - low) * (2 * i + 1) /
+			(2 * KT0913_CALIB_TUNES);
+		khz = rounddown(khz, step);
+
+		start = ktime_get_ns();
+		ret = kt0913_core_set_frequency(&radio->core, band, khz);
+		if (ret)
+			return ret;
+
+		ret = __kt0913_calib_poll(radio, KT0913_F_STC, 1, start, &us);
+		if (ret)
+			return ret;
+
+		*max = max(*max, us);
+		calib->stc_min_us = min(calib->stc_min_us, us);
+	}
+
+	return 0;
+}
+
+/*
+ * measure the bus round trip, the crystal and PLL startup and a few FM and
+ * AM tunes, then poll a quarter of the fastest tune (but not much faster
+ * than the bus) and time out at four times the slowest wait. the chip is
+ * left on the band and frequency it was on.
+ */
+static int __kt0913_calibrate(struct kt0913_device *radio)
+{
+	struct kt0913_calibration calib = { .stc_min_us = U32_MAX };
+	unsigned int band = radio->core.band;
+	unsigned int frequency;
+	unsigned int poll, timeout;
+	u32 slowest;
+	int ret;
+
+	ret = kt0913_core_get_frequency(&radio->core, &frequency);
+	if (ret)
+		return ret;
+
+	ret = __kt0913_calib_bus(radio, &calib);
+	if (!ret)
+		ret = __kt0913_calib_xtal(radio, &calib);
+	if (!ret)
+		ret = __kt0913_calib_tunes(radio, BAND_FM, &calib);
+	if (!ret)
+		ret = __kt0913_calib_tunes(radio, BAND_AM, &calib);
+
+	/* back where it was, even if the calibration failed */
+	if (kt0913_core_tune(&radio->core, band, frequency))
+		v4l2_warn(radio->client, "couldn't tune back to %u kHz",
+			frequency);
+
+	if (ret) {
+		v4l2_err(radio->client, "calibration failed! %d", ret);
+		return ret;
+	}
+
+	slowest = max3(calib.pll_us, calib.stc_us[0], calib.stc_us[1]);
+	poll = clamp(max(calib.stc_min_us / 4, 4 * calib.bus_us),
+		KT0913_CALIB_MIN_POLL_US, KT0913_CALIB_MAX_POLL_US);
+	timeout = clamp(DIV_ROUND_UP(4 * slowest, USEC_PER_MSEC),
+		KT0913_CALIB_MIN_TIMEOUT_MS, KT0913_CALIB_MAX_TIMEOUT_MS);
+
+	calib.valid = true;
+	radio->calib = calib;
+	WRITE_ONCE(radio->stc_poll_us, poll);
+	WRITE_ONCE(radio->stc_timeout_ms, timeout);
+
+	v4l2_info(radio->client,
+		"calibrated: bus %uus, xtal %uus, pll %uus, tune fm %uus am %uus, poll %uus, timeout %ums",
+		calib.bus_us, calib.xtal_us, calib.pll_us, calib.stc_us[0],
+		calib.stc_us[1], poll, timeout);
+
+	return 0;
+}
+
+/* ************************************************************************* */
+
+/*
+ * find the strongest station between the channels low and high kHz, step
+ * kHz apart, and tune it. they're scanned every other channel (the rest
+ * only if that finds nothing), then the channels next to the best one.
+ * returns -ENODATA, staying where it was, if nothing is above the seek
+ * threshold.
+ */
+static int __kt0913_tune_best_range(struct kt0913_device *radio,
+	unsigned int band, unsigned int low, unsigned int high,
+	unsigned int step, unsigned int *frequency)
+{
+	unsigned int first = low;
+	unsigned int count = (high - first) / (2 * step) + 1;
+	unsigned int khz, fine_first, fine_count;
+	u8 *rssi, fine[3];
+	int best, ret;
+
+	rssi = kcalloc(count, sizeof(*rssi), GFP_KERNEL);
+	if (!rssi)
+		return -ENOMEM;
+
+	ret = kt0913_core_scan(&radio->core, band, first, 2 * step, count, rssi);
+	if (ret)
+		goto out;
+
+	best = kt0913_scan_best(band, rssi, count);
+	if (best < 0 && first + step <= high) {
+		first += step;
+		count = (high - first) / (2 * step) + 1;
+		ret = kt0913_core_scan(&radio->core, band, first, 2 * step, count,
+			rssi);
+		if (ret)
+			goto out;
+		best = kt0913_scan_best(band, rssi, count);
+	}
+	if (best < 0) {
+		ret = -ENODATA;
+		goto out;
+	}
+
+	/* the station may be centered on a neighbour channel */
+	khz = first + best * 2 * step;
+	fine_first = khz >= low + step ? khz - step : khz;
+	fine_count = (min(khz + step, high) - fine_first) / step + 1;
+	ret = kt0913_core_scan(&radio->core, band, fine_first, step, fine_count,
+		fine);
+	if (ret)
+		goto out;
+
+	best = kt0913_scan_best(band, fine, fine_count);
+	if (best >= 0)
+		khz = fine_first + best * step;
+
+	ret = kt0913_core_tune(&radio->core, band, khz);
+	if (!ret)
+		*frequency = khz;
+
+out:
+	kfree(rssi);
+	return ret;
+}
+
+/* the strongest station of the whole band, see __kt0913_tune_best_range() */
+static int __kt0913_tune_best(struct kt0913_device *radio,
+	unsigned int band, unsigned int *frequency)
+{
+	unsigned int low = v4l2_freq_to_khz(kt0913_bands[band].rangelow);
+	unsigned int high = v4l2_freq_to_khz(kt0913_bands[band].rangehigh);
+	unsigned int step = kt0913_seek_step(band,
+		kt0913_spacing(radio, band) * 1000, low, high);
+
+	return __kt0913_tune_best_range(radio, band,
+		kt0913_freq_to_chan(band, kt0913_bands[band].rangelow, step),
+		high, step, frequency);
+}
+
+/*
+ * the strongest station within KT0913_BEST_NEAR_CHANNELS of the channel
+ * *frequency, on a band switch. a whole band is a couple hundred tunes.
+ */
+static int __kt0913_tune_best_near(struct kt0913_device *radio,
+	unsigned int band, unsigned int *frequency)
+{
+	unsigned int low = v4l2_freq_to_khz(kt0913_bands[band].rangelow);
+	unsigned int high = v4l2_freq_to_khz(kt0913_bands[band].rangehigh);
+	unsigned int step = kt0913_seek_step(band,
+		kt0913_spacing(radio, band) * 1000, low, high);
+	unsigned int khz = *frequency;
+	unsigned int below = min((khz - low) / step, KT0913_BEST_NEAR_CHANNELS);
+	unsigned int above = min((high - khz) / step, KT0913_BEST_NEAR_CHANNELS);
+
+	return __kt0913_tune_best_range(radio, band, khz - below * step,
+		khz + above * step, step, frequency);
+}
+
+static void kt0913_survey_work(struct work_struct *work)
+{
+	struct kt0913_device *radio = container_of(work,
+		struct kt0913_device, survey_work);
+	struct kt0913_survey *survey = radio->survey;
+	unsigned int done, first, n;
+	unsigned long ops;
+	int ret;
+
+	/* the chip may be in standby, left to a sound card */
+	ret = pm_runtime_resume_and_get(&radio->client->dev);
+	if (ret)
+		goto out;
+
+	/*
+	 * as many channels at a time as the I2C budget allows, at the cost
+	 * measured on the previous ones: the STC polls depend on the chip.
+	 * never more than a few, each one holds the mutex for its STC wait.
+	 */
+	for (done = 0; done < radio->survey_count && !ret; done += n) {
+		n = kt0913_budget_wait(radio, radio->survey_cost,
+			min(radio->survey_count - done, KT0913_SURVEY_CHUNK));
+		first = radio->survey_first + done;
+
+		mutex_lock(&radio->mutex);
+		WRITE_ONCE(radio->bg_owner, current);
+		ops = READ_ONCE(radio->i2c_ops);
+		ret = kt0913_core_scan(&radio->core, survey->band,
+			survey->first_khz + first * survey->step_khz,
+			survey->step_khz, n, &survey->rssi[first]);
+		if (!ret)
+			radio->survey_cost = max(1UL, DIV_ROUND_UP(
+				READ_ONCE(radio->i2c_ops) - ops, n));
+		WRITE_ONCE(radio->bg_owner, NULL);
+		mutex_unlock(&radio->mutex);
+
+		/* an ioctl or a control woken up by the unlock takes it first */
+		usleep_range(KT0913_BUS_YIELD_US, KT0913_BUS_YIELD_US * 2);
+	}
+
+	pm_runtime_put(&radio->client->dev);
+
+out:
+	if (ret) {
+		v4l2_err(radio->client, "survey slice failed! %d", ret);
+		cmpxchg(&survey->error, 0, ret);
+	}
+
+	if (atomic_dec_and_test(&survey->pending))
+		complete(&survey->done);
+}
+
+static void kt0913_survey_free(struct kt0913_survey *survey)
+{
+	if (!survey)
+		return;
+
+	kvfree(survey->text);
+	kfree(survey->rssi);
+	kfree(survey);
+}
+
+/*
+ * "<band> <first kHz> <step kHz>" line followed by the RSSI in dBm of each
+ * channel, formatted once so the readers only copy it
+ */
+static int kt0913_survey_format(struct kt0913_survey *survey)
+{
+	/* "-128 " is the longest a channel can take */
+	size_t size = 32 + survey->n_channels * 5;
+	size_t len;
+	unsigned int i;
+	int dbm;
+
+	survey->text = kvmalloc(size, GFP_KERNEL);
+	if (!survey->text)
+		return -ENOMEM;
+
+	len = scnprintf(survey->text, size, "%s %u %u\n",
+		survey->band == BAND_AM ? "am" : "fm",
+		survey->first_khz, survey->step_khz);
+
+	for (i = 0; i < survey->n_channels; i++) {
+		dbm = kt0913_raw_rssi_to_dbm(survey->band, survey->rssi[i]);
+		len += scnprintf(survey->text + len, size - len, "%d%c", dbm,
+			i + 1 < survey->n_channels ? ' ' : '\n');
+	}
+	survey->text_len = len;
+
+	return 0;
+}
+
+/*
+ * survey a whole band, splitting the channels across every bound kt0913.
+ * each chip scans its own contiguous slice on its own workqueue, so the
+ * survey time goes down with the number of tuners. the merged result
+ * replaces kt0913_last_survey.
+ *
+ * kt0913_device_list_lock is only held to hand out the slices and to store
+ * the result, so probe and remove don't wait for the scan. a chip removed
+ * meanwhile still finishes its slice, kt0913_remove() drains its queue.
+ */
+static int kt0913_survey_run(unsigned int band)
+{
+	struct kt0913_device *radio;
+	struct kt0913_survey *survey;
+	unsigned int n_devices = 0;
+	unsigned int last_khz;
+	unsigned int slice, extra, next;
+	bool campus = true;
+	int ret;
+
+	mutex_lock(&kt0913_survey_lock);
+	mutex_lock(&kt0913_device_list_lock);
+
+	list_for_each_entry(radio, &kt0913_device_list, list) {
+		n_devices++;
+		campus &= radio->use_campus_band;
+	}
+
+	if (!n_devices) {
+		ret = -ENODEV;
+		goto unlock;
+	}
+
+	survey = kzalloc(sizeof(*survey), GFP_KERNEL);
+	if (!survey) {
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	/* FM surveys cover the range that every instance can tune */
+	if (band != BAND_AM && campus)
+		band = BAND_FM_CAMUS;
+	else if (band != BAND_AM)
+		band = BAND_FM;
+
+	last_khz = v4l2_freq_to_khz(kt0913_bands[band].rangehigh);
+
+	/* every chip scans on the grid of the first one */
+	radio = list_first_entry(&kt0913_device_list, struct kt0913_device,
+		list);
+
+	survey->band = band;
+	survey->step_khz = kt0913_spacing(radio, band);
+	/* start on the first channel of the grid inside the band */
+	survey->first_khz = kt0913_freq_to_chan(band,
+		kt0913_bands[band].rangelow, survey->step_khz);
+	survey->n_channels = (last_khz - survey->first_khz) /
+		survey->step_khz + 1;
+	survey->rssi = kcalloc(survey->n_channels, sizeof(*survey->rssi),
+		GFP_KERNEL);
+	if (!survey->rssi) {
+		kfree(survey);
+		ret = -ENOMEM;
+		goto unlock;
+	}
+
+	atomic_set(&survey->pending, n_devices);
+	init_completion(&survey->done);
+
+	/* split the channels as evenly as possible */
+	slice = survey->n_channels / n_devices;
+	extra = survey->n_channels % n_devices;
+	next = 0;
+	list_for_each_entry(radio, &kt0913_device_list, list) {
+		radio->survey = survey;
+		radio->survey_first = next;
+		radio->survey_count = slice + (extra ? 1 : 0);
+		if (extra)
+			extra--;
+		next += radio->survey_count;
+		queue_work(radio->wq, &radio->survey_work);
+	}
+
+	mutex_unlock(&kt0913_device_list_lock);
+
+	wait_for_completion(&survey->done);
+
+	ret = survey->error;
+	if (!ret)
+		ret = kt0913_survey_format(survey);
+	if (ret) {
+		kt0913_survey_free(survey);
+		goto out;
+	}
+
+	mutex_lock(&kt0913_device_list_lock);
+	/* the last chip may have gone away while scanning */
+	if (list_empty(&kt0913_device_list)) {
+		kt0913_survey_free(survey);
+	} else {
+		kt0913_survey_free(kt0913_last_survey);
+		kt0913_last_survey = survey;
+	}
+	mutex_unlock(&kt0913_device_list_lock);
+
+	goto out;
+
+unlock:
+	mutex_unlock(&kt0913_device_list_lock);
+out:
+	mutex_unlock(&kt0913_survey_lock);
+	return ret;
+}
+
+/* ************************************************************************* */
+
+/* let the subscribers of this tuner know about a change */
+static void kt0913_queue_tuner_event(struct kt0913_device *radio,
+	u32 changes, unsigned int frequency)
+{
+	struct video_device *vdev = radio->primary ?
+		&radio->primary->vdev : &radio->vdev;
+	struct v4l2_event ev = {
+		.type = V4L2_EVENT_KT0913_TUNER,
+		.id = radio->tuner_index,
+	};
+	struct kt0913_tuner_event *data = (void *)ev.u.data;
+
+	/* merged tuners whose owner went away have no node */
+	if (!video_is_registered(vdev))
+		return;
+
+	data->changes = changes;
+	data->frequency = khz_to_v4l2_freq(frequency);
+	data->band_index = kt0913_bands[radio->core.band].index;
+	if (changes & KT0913_TUNER_EVENT_CH_SIGNAL)
+		data->signal = kt0913_raw_rssi_to_signal(radio->monitor_rssi);
+
+	v4l2_event_queue(vdev, &ev);
+}
+
+/* ************************************************************************* */
+
+/*
+ * timed operations: the virtual tuner slices. their hrtimer queues them on
+ * a kthread worker of each chip, which runs with the
+ * kt0913_rt_policy/kt0913_rt_priority scheduling (or the one set through
+ * the "rt_sched" attribute), so a loaded system doesn't stretch the dwell
+ * times like it did on the workqueue.
+ */
+
+static const struct {
+	const char *name;
+	int policy;
+} kt0913_rt_policies[] = {
+	{ "normal", SCHED_NORMAL },
+	{ "fifo", SCHED_FIFO },
+	{ "rr", SCHED_RR },
+};
+
+static int kt0913_rt_policy_parse(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(kt0913_rt_policies); i++)
+		if (sysfs_streq(name, kt0913_rt_policies[i].name))
+			return kt0913_rt_policies[i].policy;
+
+	return -EINVAL;
+}
+
+static const char *kt0913_rt_policy_name(int policy)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(kt0913_rt_policies); i++)
+		if (kt0913_rt_policies[i].policy == policy)
+			return kt0913_rt_policies[i].name;
+
+	return "unknown";
+}
+
+/*
+ * the normal policy takes no priority, the others 1 to MAX_RT_PRIO - 1.
+ * sched_setscheduler*() aren't exported to modules, sched_setattr_nocheck()
+ * is and takes any priority, unlike sched_set_fifo() and friends.
+ */
+static int kt0913_rt_set_sched(struct kt0913_device *radio, int policy,
+	unsigned int priority)
+{
+	struct sched_attr attr = {
+		.size = sizeof(attr),
+		.sched_policy = policy,
+		.sched_priority = policy == SCHED_NORMAL ? 0 : priority,
+	};
+	int ret;
+
+	ret = sched_setattr_nocheck(radio->rt_worker->task, &attr);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(radio->rt_policy, policy);
+	WRITE_ONCE(radio->rt_priority, attr.sched_priority);
+
+	return 0;
+}
+
+/* (re)arm the timer of a timed operation, unless the chip is going away */
+static void kt0913_rt_arm(struct kt0913_device *radio, struct hrtimer *timer,
+	ktime_t expires, u64 slack_ns)
+{
+	if (READ_ONCE(radio->rt_stopped))
+		return;
+
+	hrtimer_start_range_ns(timer, expires, slack_ns, HRTIMER_MODE_ABS_HARD);
+}
+
+/*
+ * account how late the worker picked up a timed operation, past the hard
+ * expiry of its timer. returns when the operation was due.
+ */
+static ktime_t kt0913_rt_account(struct kt0913_device *radio,
+	enum kt0913_rt_op op, struct hrtimer *timer)
+{
+	struct kt0913_rt_stat *stat = &radio->rt_stats[op];
+	ktime_t now = ktime_get();
+	ktime_t due = hrtimer_get_expires(timer);
+	unsigned int bucket;
+	u64 late;
+
+	/* re-armed since it fired, e.g. by a kick */
+	if (ktime_after(due, now))
+		due = now;
+	late = ktime_to_ns(ktime_sub(now, due));
+
+	/* bucket N holds [2^(N-1), 2^N) us, the last one everything above */
+	bucket = min_t(unsigned int, fls64(div_u64(late, NSEC_PER_USEC)),
+		KT0913_RT_HIST_BUCKETS - 1);
+
+	spin_lock(&radio->stats_lock);
+	stat->wakeups++;
+	stat->late_total_ns += late;
+	stat->late_max_ns = max(stat->late_max_ns, late);
+	stat->hist[bucket]++;
+	spin_unlock(&radio->stats_lock);
+
+	return due;
+}
+
+/* for good: the works re-arm their own timers until rt_stopped is seen */
+static void kt0913_rt_stop(struct hrtimer *timer, struct kthread_work *work)
+{
+	kthread_cancel_work_sync(work);
+	hrtimer_cancel(timer);
+	kthread_cancel_work_sync(work);
+}
+
+/* ************************************************************************* */
+
+/*
+ * signal monitor: samples the RSSI of the current channel for the squelch
+ * and the signal events, and checks that the chip didn't lose its state.
+ * it runs on a deferrable timer, so an idle CPU isn't woken up just for
+ * it, and its interval doubles from KT0913_MONITOR_MIN_MS up to
+ * KT0913_MONITOR_MAX_MS while the signal is stable. tunes and signal
+ * changes bring it back to the fastest rate.
+ */
+
+/* sample again soon, e.g. after a tune */
+static void kt0913_monitor_kick(struct kt0913_device *radio)
+{
+	/* the virtual tuners do their own sampling */
+	if (radio->vtuners_enabled)
+		return;
+
+	WRITE_ONCE(radio->monitor_interval_ms, KT0913_MONITOR_MIN_MS);
+	mod_delayed_work(radio->wq, &radio->monitor_work,
+		msecs_to_jiffies(KT0913_MONITOR_MIN_MS));
+}
+
+/* open/close the squelch on the last sample, with one step of hysteresis */
+static int __kt0913_update_squelch(struct kt0913_device *radio, bool mute)
+{
+	bool squelched;
+
+	/* there are no samples without the monitor */
+	if (radio->vtuners_enabled)
+		squelched = false;
+	else if (radio->squelched)
+		squelched = radio->monitor_rssi < radio->squelch;
+	else
+		squelched = radio->monitor_rssi + 1 < radio->squelch;
+
+	if (squelched == radio->squelched)
+		return 0;
+
+	radio->squelched = squelched;
+
+	return __kt0913_update_mute(radio, mute);
+}
+
+/*
+ * VOLUME never holds its power-on value once the chip is initialized (the
+ * softmutes are disabled), so reading anything but the cached value means
+ * the chip was reset, e.g. by a brownout. writing the cache back restores
+ * it and tunes the current channel again.
+ */
+static int __kt0913_check_reset(struct kt0913_device *radio)
+{
+	unsigned int cached, chip, reg = 0;
+	unsigned int i;
+	int ret;
+
+	ret = regmap_read(radio->regmap, KT0913_REG_VOLUME, &cached);
+	if (ret)
+		return ret;
+
+	ret = __kt0913_read_uncached(radio, KT0913_REG_VOLUME, &chip);
+	if (ret)
+		return ret;
+
+	if (chip == cached)
+		return 0;
+
+	radio->resets++;
+	v4l2_warn(radio->client,
+		"chip was reset (VOLUME 0x%04x, expected 0x%04x), restoring",
+		chip, cached);
+
+	/* the cached CAP_INDEX values may not suit the chip anymore */
+	kt0913_core_amcali_drop(&radio->core);
+
+	/*
+	 * every register, in order. regcache_sync() would skip the ones
+	 * matching kt0913_reg_defaults, which aren't the power-on values
+	 */
+	__kt0913_bus_lock(radio);
+	for (i = 0; i < ARRAY_SIZE(kt0913_reg_defaults) && !ret; i++) {
+		reg = kt0913_reg_defaults[i].reg;
+		if (reg == KT0913_REG_CHIP_ID)
+			continue;
+		ret = regmap_read(radio->regmap, reg, &cached);
+		if (!ret)
+			ret = regmap_write(radio->regmap, reg, cached);
+	}
+	__kt0913_bus_unlock(radio);
+	if (ret)
+		v4l2_err(radio->client, "restoring 0x%02x failed! %d", reg,
+			ret);
+
+	return ret;
+}
+
+static void kt0913_monitor_work(struct work_struct *work)
+{
+	struct kt0913_device *radio = container_of(to_delayed_work(work),
+		struct kt0913_device, monitor_work);
+	u64 now = ktime_get_ns();
+	unsigned int interval, frequency, wait_ms, stc, snr = 0;
+	u16 status[3];
+	bool standby;
+	u8 rssi;
+	int ret;
+
+	/* nothing to watch in standby, waking up kicks it again */
+	spin_lock(&radio->stats_lock);
+	standby = radio->pm_standby;
+	spin_unlock(&radio->stats_lock);
+	if (standby)
+		return;
+
+	/* over the I2C budget, sample less often */
+	if (!kt0913_budget_fit(radio, KT0913_BUDGET_SAMPLE_COST, 1,
+		&wait_ms)) {
+		interval = clamp(max(READ_ONCE(radio->monitor_interval_ms) * 2,
+			wait_ms), KT0913_MONITOR_MIN_MS, KT0913_MONITOR_MAX_MS);
+		WRITE_ONCE(radio->monitor_interval_ms, interval);
+		queue_delayed_work(radio->wq, &radio->monitor_work,
+			msecs_to_jiffies(interval));
+		return;
+	}
+
+	mutex_lock(&radio->mutex);
+	WRITE_ONCE(radio->bg_owner, current);
+
+	radio->monitor_samples++;
+	radio->monitor_window_samples++;
+	if (now - radio->monitor_window_ns >=
+		(u64)KT0913_MONITOR_WINDOW_MS * NSEC_PER_MSEC) {
+		radio->monitor_rate_mhz = div64_u64(
+			(u64)radio->monitor_window_samples * NSEC_PER_SEC *
+			1000, now - radio->monitor_window_ns);
+		radio->monitor_window_ns = now;
+		radio->monitor_window_samples = 0;
+	}
+
+	interval = READ_ONCE(radio->monitor_interval_ms);
+
+	ret = __kt0913_check_reset(radio);
+	__kt0913_bus_lock(radio);
+	if (!ret && radio->core.band != BAND_AM && radio->i2c_bulk) {
+		/* RSSI and SNR in one transfer of the status block */
+		ret = regmap_bulk_read(radio->regmap, KT0913_REG_STATUSA,
+			status, ARRAY_SIZE(status));
+		rssi = kt0913_status_to_raw_rssi(BAND_FM, status[0]);
+		snr = kt0913_field_get(KT0913_F_FMSNR, status[2]);
+	} else if (!ret) {
+		ret = kt0913_core_get_raw_rssi(&radio->core, &rssi);
+		if (!ret && radio->core.band != BAND_AM)
+			ret = __kt0913_field_read(radio, KT0913_F_FMSNR, &snr);
+	}
+	__kt0913_bus_unlock(radio);
+	if (ret) {
+		/* don't keep hammering a failing bus */
+		interval = KT0913_MONITOR_MAX_MS;
+	} else {
+		radio->monitor_rssi = rssi;
+		radio->monitor_snr = radio->core.band != BAND_AM ? snr : 0;
+		if (abs(rssi - radio->monitor_ref_rssi) >=
+			KT0913_MONITOR_RSSI_DELTA) {
+			radio->monitor_ref_rssi = rssi;
+			interval = KT0913_MONITOR_MIN_MS;
+			if (!kt0913_core_get_frequency(&radio->core, &frequency))
+				kt0913_queue_tuner_event(radio,
+					KT0913_TUNER_EVENT_CH_SIGNAL, frequency);
+		} else {
+			interval = min(interval * 2, KT0913_MONITOR_MAX_MS);
+		}
+
+		ret = __kt0913_update_squelch(radio,
+			radio->ctrl_mute->cur.val);
+		if (ret)
+			v4l2_warn(radio->client,
+				"Could not update the squelch (%d)", ret);
+
+		/*
+		 * VIDIOC_S_FREQUENCY doesn't wait for AM tunes to finish, the
+		 * calibration is only kept once the chip is done with it
+		 */
+		if (radio->core.band == BAND_AM && kt0913_am_cali_cache &&
+			!__kt0913_field_read(radio, KT0913_F_STC, &stc) && stc)
+			kt0913_core_amcali_capture(&radio->core);
+	}
+
+	WRITE_ONCE(radio->monitor_interval_ms, interval);
+
+	WRITE_ONCE(radio->bg_owner, NULL);
+	mutex_unlock(&radio->mutex);
+
+	queue_delayed_work(radio->wq, &radio->monitor_work,
+		msecs_to_jiffies(interval));
+}
+
+/*
+ * tuner operations on a single chip. the ioctls below pick the chip from
+ * the tuner index, the caller holds the chip's mutex.
+ */
+static int __kt0913_g_frequency(struct kt0913_device *radio,
+	struct v4l2_frequency *f)
+{
+	int ret;
+
+	f->type = V4L2_TUNER_RADIO;
+
+	ret = kt0913_core_get_frequency(&radio->core, &f->frequency);
+	if (ret)
+		return ret;
+
+	/* convert kHz freq into v4l2 freq */
+	f->frequency = khz_to_v4l2_freq(f->frequency);
+
+	return 0;
+}
+
+/* validate a VIDIOC_S_FREQUENCY request, and get its band and kHz value */
+static int kt0913_parse_frequency(struct kt0913_device *radio,
+	const struct v4l2_frequency *f, unsigned int *band, unsigned int *khz)
+{
+	unsigned int freq = f->frequency;
+
+	if (f->type != V4L2_TUNER_RADIO)
+		return -EINVAL;
+
+	if (freq == 0)
+		return -EINVAL;
+
+	/* clamped to the band, on the nearest channel */
+	if (!kt0913_parse_freq(freq, radio->use_campus_band,
+		kt0913_spacing(radio, BAND_FM), kt0913_spacing(radio, BAND_AM),
+		band, khz)) {
+		v4l2_warn(radio->client,
+			"frequency out of allowed RF bands (%u kHz)",
+			v4l2_freq_to_khz(freq));
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * VIDIOC_S_FREQUENCY returns without waiting for its tune, unless it fine
+ * tunes. poll STC here instead, as __kt0913_wait_stc() does, so the tune
+ * gets into the tune stats like the others, to within a poll. it's dropped
+ * if it times out, fails or another operation moves the chip first.
+ */
+static void kt0913_tune_done_work(struct work_struct *work)
+{
+	struct kt0913_device *radio = container_of(to_delayed_work(work),
+		struct kt0913_device, tune_done_work);
+	unsigned int stc = 0;
+	bool standby;
+	u64 ns;
+	int ret;
+
+	mutex_lock(&radio->mutex);
+	if (!radio->tune_pending_ns)
+		goto out;
+
+	spin_lock(&radio->stats_lock);
+	standby = radio->pm_standby;
+	spin_unlock(&radio->stats_lock);
+
+	ret = standby ? -EAGAIN :
+		__kt0913_field_read(radio, KT0913_F_STC, &stc);
+	ns = ktime_get_ns() - radio->tune_pending_ns;
+	if (!ret && !stc && ns < (u64)READ_ONCE(radio->stc_timeout_ms) *
+		NSEC_PER_MSEC) {
+		queue_delayed_work(radio->wq, &radio->tune_done_work,
+			usecs_to_jiffies(READ_ONCE(radio->stc_poll_us)));
+		goto out;
+	}
+
+	if (!ret && stc)
+		__kt0913_tune_account(radio, ns);
+	radio->tune_pending_ns = 0;
+out:
+	mutex_unlock(&radio->mutex);
+}
+
+static int __kt0913_do_s_frequency(struct kt0913_device *radio,
+	const struct v4l2_frequency *f)
+{
+	/* the control lives on the owner of a merged node */
+	struct kt0913_device *owner = radio->primary ?: radio;
+	u32 changes = KT0913_TUNER_EVENT_CH_FREQUENCY;
+	unsigned int freq, afc_step;
+	unsigned int new_band;
+	bool band_switch;
+	u64 start;
+	int ret;
+
+	ret = kt0913_parse_frequency(radio, f, &new_band, &freq);
+	if (ret)
+		return ret;
+
+	radio->tune_pending_ns = 0;
+	band_switch = new_band != radio->core.band;
+
+	if (band_switch && owner->best_on_band_switch) {
+		/*
+		 * the channels next to the requested one, each tune on its
+		 * own so the bus isn't held across the scan. keep the
+		 * requested frequency if there's nothing better.
+		 */
+		ret = kt0913_core_set_frequency(&radio->core, new_band, freq);
+		if (!ret)
+			ret = __kt0913_tune_best_near(radio, new_band, &freq);
+		if (ret == -ENODATA)
+			ret = 0;
+		if (ret)
+			return ret;
+	} else {
+		/* the core only fine tunes FM */
+		afc_step = owner->auto_fine_tune && new_band != BAND_AM ?
+			kt0913_spacing(radio, new_band) : 0;
+
+		start = ktime_get_ns();
+		__kt0913_bus_lock(radio);
+		ret = kt0913_core_s_frequency(&radio->core, new_band, &freq,
+			afc_step);
+		if (ret > 0) {
+			radio->afc_corrections++;
+			changes |= KT0913_TUNER_EVENT_CH_FINE_TUNE;
+			ret = 0;
+		}
+		__kt0913_bus_unlock(radio);
+		if (ret)
+			return ret;
+
+		/* a fine tune waited for it, and accounted it already */
+		if (!afc_step) {
+			radio->tune_pending_ns = start;
+			mod_delayed_work(radio->wq, &radio->tune_done_work,
+				usecs_to_jiffies(READ_ONCE(radio->stc_poll_us)));
+		}
+	}
+
+	kt0913_queue_tuner_event(radio, changes, freq);
+	kt0913_monitor_kick(radio);
+
+	return 0;
+}
+
+static int __kt0913_s_frequency(struct kt0913_device *radio,
+	const struct v4l2_frequency *f)
+{
+	struct kt0913_op_mark mark;
+	int ret;
+
+	kt0913_op_begin(radio, &mark);
+	ret = __kt0913_do_s_frequency(radio, f);
+	kt0913_op_end(radio, KT0913_OP_S_FREQUENCY, &mark);
+
+	return ret;
+}
+
+static int __kt0913_enum_freq_bands(struct kt0913_device *radio,
+	struct v4l2_frequency_band *band)
+{
+	u32 tuner = band->tuner;
+
+	switch (band->index) {
+	case 0:
+		if (radio->use_campus_band)
+			*band = kt0913_bands[BAND_FM_CAMUS];
+		else
+			*band = kt0913_bands[BAND_FM];
+		break;
+	case 1:
+		*band = kt0913_bands[BAND_AM];
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	band->tuner = tuner;
+
+	return 0;
+}
+
+static int __kt0913_do_g_tuner(struct kt0913_device *radio,
+	struct v4l2_tuner *v)
+{
+	unsigned int statusa;
+	int ret;
+	int stereo_enabled;
+
+	if (radio->primary || radio->n_tuners > 1)
+		snprintf(v->name, sizeof(v->name), "FM/AM #%u",
+			radio->tuner_index);
+	else
+		strscpy(v->name, "FM/AM", sizeof(v->name));
+	v->type = V4L2_TUNER_RADIO;
+
+	/* the seek is emulated, see kt0913_bands */
+	v->capability = V4L2_TUNER_CAP_LOW | V4L2_TUNER_CAP_STEREO |
+		V4L2_TUNER_CAP_FREQ_BANDS | V4L2_TUNER_CAP_HWSEEK_BOUNDED |
+		V4L2_TUNER_CAP_HWSEEK_WRAP | V4L2_TUNER_CAP_HWSEEK_PROG_LIM;
+
+	v->rangelow = kt0913_bands[BAND_AM].rangelow;
+	v->rangehigh = kt0913_bands[BAND_FM].rangehigh;
+
+	if (radio->core.band == BAND_AM) {
+		v->rxsubchans = V4L2_TUNER_SUB_MONO;
+		v->audmode = V4L2_TUNER_MODE_MONO;
+
+		ret = __kt0913_get_am_rssi(radio, &v->signal);
+		if (ret)
+			return ret;
+	} else {
+		ret = __kt0913_get_cfg_stereo_enabled(radio, &stereo_enabled);
+		if (ret)
+			return ret;
+
+		v->rxsubchans = stereo_enabled ?
+			V4L2_TUNER_SUB_STEREO : V4L2_TUNER_SUB_MONO;
+
+		/* stereo and RSSI share STATUSA, a single read */
+		ret = regmap_read(radio->regmap, KT0913_REG_STATUSA, &statusa);
+		if (ret)
+			return ret;
+
+		v->audmode = kt0913_field_get(KT0913_F_ST, statusa) ==
+			KT0913_STATUSA_ST_STEREO ?
+			V4L2_TUNER_MODE_STEREO : V4L2_TUNER_MODE_MONO;
+		/* RSSI(dBm) = -100 + FMRSSI<4:0> * 3dBm, but v4l2 wants a % */
+		v->signal = kt0913_raw_rssi_to_signal(
+			kt0913_field_get(KT0913_F_FMRSSI, statusa));
+	}
+
+	/* AFC is enabled and active by default */
+	v->afc = 1;
+
+	return 0;
+}
+
+static int __kt0913_g_tuner(struct kt0913_device *radio,
+	struct v4l2_tuner *v)
+{
+	struct kt0913_op_mark mark;
+	int ret;
+
+	kt0913_op_begin(radio, &mark);
+	ret = __kt0913_do_g_tuner(radio, v);
+	kt0913_op_end(radio, KT0913_OP_G_TUNER, &mark);
+
+	return ret;
+}
+
+static int __kt0913_s_tuner(struct kt0913_device *radio,
+	const struct v4l2_tuner *v)
+{
+	/* only mono and stereo are supported */
+	if (v->audmode != V4L2_TUNER_MODE_MONO &&
+		v->audmode != V4L2_TUNER_MODE_STEREO)
+		return 0;
+
+	/* AM is mono only, so don't try to set it to stereo */
+	if (radio->core.band == BAND_AM && v->audmode != V4L2_TUNER_MODE_MONO)
+		return 0;
+
+	/* set to stereo if specified, otherwise set to mono */
+	return __kt0913_set_cfg_stereo_enabled(radio,
+		v->audmode == V4L2_TUNER_MODE_STEREO);
+}
+
+/*
+ * seek the next station from the current channel, stepping spacing Hz
+ * (default step if 0), see kt0913_core_seek()
+ */
+static int __kt0913_seek(struct kt0913_device *radio,
+	const struct v4l2_hw_freq_seek *seek)
+{
+	unsigned int band = radio->core.band;
+	unsigned int low = v4l2_freq_to_khz(kt0913_bands[band].rangelow);
+	unsigned int high = v4l2_freq_to_khz(kt0913_bands[band].rangehigh);
+	unsigned int step;
+	int ret;
+
+	if (seek->type != V4L2_TUNER_RADIO)
+		return -EINVAL;
+
+	/* the seek limits must be inside the current band */
+	if (seek->rangelow || seek->rangehigh) {
+		if (seek->rangelow >= seek->rangehigh ||
+			seek->rangelow < kt0913_bands[band].rangelow ||
+			seek->rangehigh > kt0913_bands[band].rangehigh)
+			return -EINVAL;
+		low = v4l2_freq_to_khz(seek->rangelow);
+		high = v4l2_freq_to_khz(seek->rangehigh);
+	}
+
+	radio->seek_count++;
+	step = kt0913_seek_step(band,
+		seek->spacing ?: kt0913_spacing(radio, band) * 1000, low, high);
+
+	ret = kt0913_core_seek(&radio->core, low, high, step,
+		seek->seek_upward, seek->wrap_around);
+	if (ret)
+		return ret;
+
+	kt0913_queue_tuner_event(radio, KT0913_TUNER_EVENT_CH_FREQUENCY,
+		radio->core.frequency);
+	kt0913_monitor_kick(radio);
+
+	return 0;
+}
+
+/* ************************************************************************* */
+
+static inline struct kt0913_fh *kt0913_vtuner_to_fh(struct kt0913_vtuner *vt)
+{
+	return container_of(vt, struct kt0913_fh, vt);
+}
+
+/*
+ * pick the virtual tuner that owns the next slice using a smooth weighted
+ * round robin: a tuner with weight N gets N slices out of every round of
+ * sum(weights), spread evenly over the round. called with the mutex held.
+ */
+static struct kt0913_vtuner *kt0913_vtuner_pick(struct kt0913_device *radio)
+{
+	struct kt0913_vtuner *vt, *best = NULL;
+	int total = 0, weight;
+
+	list_for_each_entry(vt, &radio->vtuners, list) {
+		/* set by the control without the mutex */
+		weight = READ_ONCE(vt->weight);
+		vt->current_weight += weight;
+		total += weight;
+		if (!best || vt->current_weight > best->current_weight)
+			best = vt;
+	}
+
+	if (best)
+		best->current_weight -= total;
+
+	return best;
+}
+
+/* tune the chip to a virtual tuner and sample its signal */
+static int __kt0913_vtuner_sample(struct kt0913_device *radio,
+	struct kt0913_vtuner *vt)
+{
+	struct v4l2_event ev = {
+		.type = V4L2_EVENT_KT0913_TUNER,
+	};
+	struct kt0913_tuner_event *data = (void *)ev.u.data;
+	unsigned int frequency;
+	int stereo = 0;
+	int ret;
+
+	ret = kt0913_core_get_frequency(&radio->core, &frequency);
+	if (ret)
+		return ret;
+
+	/* skip the retune if the previous slice was already there */
+	if (radio->core.band != vt->band || frequency != vt->frequency) {
+		ret = kt0913_core_tune(&radio->core, vt->band, vt->frequency);
+		if (ret)
+			return ret;
+	}
+	radio->vtuner_current = vt;
+
+	ret = kt0913_core_get_raw_rssi(&radio->core, &vt->rssi);
+	if (ret)
+		return ret;
+
+	if (vt->band != BAND_AM) {
+		ret = __kt0913_get_rx_stereo_or_mono(radio, &stereo);
+		if (ret)
+			return ret;
+	}
+
+	vt->stereo = stereo;
+	vt->valid = true;
+	vt->samples++;
+
+	data->changes = KT0913_TUNER_EVENT_CH_SIGNAL;
+	data->frequency = khz_to_v4l2_freq(vt->frequency);
+	data->band_index = kt0913_bands[vt->band].index;
+	data->signal = kt0913_raw_rssi_to_signal(vt->rssi);
+	data->rxsubchans = stereo ?
+		V4L2_TUNER_SUB_STEREO : V4L2_TUNER_SUB_MONO;
+	v4l2_event_queue_fh(&kt0913_vtuner_to_fh(vt)->fh, &ev);
+
+	return 0;
+}
+
+/*
+ * scheduler: gives the chip to the next virtual tuner for its dwell time.
+ * the slices start dwell_ms apart, the tune and the sample included.
+ */
+static void kt0913_vtuner_work(struct kthread_work *work)
+{
+	struct kt0913_device *radio = container_of(work,
+		struct kt0913_device, vtuner_work);
+	struct kt0913_vtuner *vt;
+	unsigned int dwell_ms;
+	ktime_t start, next;
+	int ret;
+
+	start = kt0913_rt_account(radio, KT0913_RT_VTUNER,
+		&radio->vtuner_timer);
+
+	mutex_lock(&radio->mutex);
+
+	vt = kt0913_vtuner_pick(radio);
+	if (!vt) {
+		/* the last virtual tuner was released */
+		radio->vtuner_current = NULL;
+		mutex_unlock(&radio->mutex);
+		return;
+	}
+
+	ret = __kt0913_vtuner_sample(radio, vt);
+	if (ret)
+		v4l2_err(radio->client,
+			"virtual tuner sample failed! %d", ret);
+	dwell_ms = READ_ONCE(vt->dwell_ms);
+
+	mutex_unlock(&radio->mutex);
+
+	/* a slice that overran its dwell time doesn't make the next one late */
+	next = ktime_add_ms(start, dwell_ms);
+	start = ktime_get();
+	if (ktime_before(next, start))
+		next = start;
+	kt0913_rt_arm(radio, &radio->vtuner_timer, next, 0);
+}
+
+static enum hrtimer_restart kt0913_vtuner_timer(struct hrtimer *timer)
+{
+	struct kt0913_device *radio = container_of(timer,
+		struct kt0913_device, vtuner_timer);
+
+	kthread_queue_work(radio->rt_worker, &radio->vtuner_work);
+
+	return HRTIMER_NORESTART;
+}
+
+/* set the target of a virtual tuner, claiming it on first use */
+static int __kt0913_vtuner_s_frequency(struct kt0913_device *radio,
+	struct kt0913_fh *kfh, const struct v4l2_frequency *f)
+{
+	struct kt0913_vtuner *vt = &kfh->vt;
+	unsigned int band, freq;
+	bool start;
+	int ret;
+
+	ret = kt0913_parse_frequency(radio, f, &band, &freq);
+	if (ret)
+		return ret;
+
+	vt->band = band;
+	vt->frequency = freq;
+	vt->valid = false;
+
+	if (list_empty(&vt->list)) {
+		start = list_empty(&radio->vtuners);
+		vt->current_weight = 0;
+		list_add_tail(&vt->list, &radio->vtuners);
+		/* the scheduler is idle, give it the chip right away */
+		if (start)
+			kt0913_rt_arm(radio, &radio->vtuner_timer,
+				ktime_get(), 0);
+	}
+
+	return 0;
+}
+
+static int __kt0913_vtuner_g_tuner(struct kt0913_device *radio,
+	struct kt0913_fh *kfh, struct v4l2_tuner *v)
+{
+	struct kt0913_vtuner *vt = &kfh->vt;
+
+	strscpy(v->name, "FM/AM (virtual)", sizeof(v->name));
+	v->type = V4L2_TUNER_RADIO;
+	v->capability = V4L2_TUNER_CAP_LOW | V4L2_TUNER_CAP_STEREO |
+		V4L2_TUNER_CAP_FREQ_BANDS;
+	v->rangelow = kt0913_bands[BAND_AM].rangelow;
+	v->rangehigh = kt0913_bands[BAND_FM].rangehigh;
+	v->afc = 1;
+
+	/* measurements of the last slice of this virtual tuner */
+	v->signal = vt->valid ? kt0913_raw_rssi_to_signal(vt->rssi) : 0;
+	v->rxsubchans = vt->valid && vt->stereo ?
+		V4L2_TUNER_SUB_STEREO : V4L2_TUNER_SUB_MONO;
+	v->audmode = v->rxsubchans == V4L2_TUNER_SUB_STEREO ?
+		V4L2_TUNER_MODE_STEREO : V4L2_TUNER_MODE_MONO;
+
+	return 0;
+}
+
+/* the virtual tuner of a file handle, NULL if not in use */
+static struct kt0913_fh *kt0913_file_to_vtuner_fh(struct kt0913_device *radio,
+	struct file *file)
+{
+	struct kt0913_fh *kfh;
+
+	if (!radio->vtuners_enabled)
+		return NULL;
+
+	kfh = container_of(file->private_data, struct kt0913_fh, fh);
+
+	return kfh;
+}
+
+/*
+ * get the chip behind a tuner index of the node owned by radio, locking it
+ * if it's not the node owner (whose mutex is already held by the v4l2 core).
+ * the other chips also get a PM reference, the owner has the one taken by
+ * kt0913_fops_open(). returns NULL if there's no such tuner.
+ */
+static struct kt0913_device *kt0913_tuner_get(struct kt0913_device *radio,
+	u32 index)
+{
+	struct kt0913_device *tuner;
+
+	if (index == 0)
+		return radio;
+
+	if (index >= radio->n_tuners)
+		return NULL;
+
+	tuner = radio->tuners[index];
+	if (tuner) {
+		/* the ops report it if the chip didn't leave standby */
+		pm_runtime_get_sync(&tuner->client->dev);
+		mutex_lock(&tuner->mutex);
+	}
+
+	return tuner;
+}
+
+static void kt0913_tuner_put(struct kt0913_device *radio,
+	struct kt0913_device *tuner)
+{
+	if (tuner != radio) {
+		mutex_unlock(&tuner->mutex);
+		pm_runtime_put(&tuner->client->dev);
+	}
+}
+
+static int kt0913_ioctl_vidioc_g_frequency(struct file *file, void *priv,
+	struct v4l2_frequency *f)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_fh *kfh = kt0913_file_to_vtuner_fh(radio, file);
+	struct kt0913_device *tuner;
+	int ret;
+
+	/* the target of a claimed virtual tuner */
+	if (kfh && !list_empty(&kfh->vt.list) && f->tuner == 0) {
+		f->type = V4L2_TUNER_RADIO;
+		f->frequency = khz_to_v4l2_freq(kfh->vt.frequency);
+		return 0;
+	}
+
+	tuner = kt0913_tuner_get(radio, f->tuner);
+	if (!tuner)
+		return -EINVAL;
+
+	ret = __kt0913_g_frequency(tuner, f);
+	kt0913_tuner_put(radio, tuner);
+
+	return ret;
+}
+
+static int kt0913_ioctl_vidioc_s_frequency(struct file *file, void *priv,
+	const struct v4l2_frequency *f)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_fh *kfh = kt0913_file_to_vtuner_fh(radio, file);
+	struct kt0913_device *tuner;
+	int ret;
+
+	if (kfh) {
+		if (f->tuner != 0)
+			return -EINVAL;
+		return __kt0913_vtuner_s_frequency(radio, kfh, f);
+	}
+
+	tuner = kt0913_tuner_get(radio, f->tuner);
+	if (!tuner)
+		return -EINVAL;
+
+	ret = __kt0913_s_frequency(tuner, f);
+	kt0913_tuner_put(radio, tuner);
+
+	return ret;
+}
+
+static int kt0913_ioctl_vidioc_enum_freq_bands(struct file *file, void *priv,
+	struct v4l2_frequency_band *band)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_device *tuner = kt0913_tuner_get(radio, band->tuner);
+	int ret;
+
+	if (!tuner)
+		return -EINVAL;
+
+	ret = __kt0913_enum_freq_bands(tuner, band);
+	kt0913_tuner_put(radio, tuner);
+
+	return ret;
+}
+
+/* ************************************************************************* */
+
+/* V4L2 vidioc */
+static int kt0913_ioctl_vidioc_querycap(struct file *file, void *priv,
+	struct v4l2_capability *capability)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct video_device *dev;
+
+	if (!radio)
+		return -ENODEV;
+
+	dev = &radio->vdev;
+
+	if (!dev)
+		return -ENODEV;
+
+	strscpy(capability->driver, KT0913_FM_AM_DRIVER_NAME,
+		sizeof(capability->driver));
+	strscpy(capability->card, dev->name, sizeof(capability->card));
+	snprintf(capability->bus_info, sizeof(capability->bus_info),
+		"I2C:%s", dev_name(&dev->dev));
+	return 0;
+}
+
+static int kt0913_ioctl_vidioc_g_tuner(struct file *file, void *priv,
+	struct v4l2_tuner *v)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_fh *kfh = kt0913_file_to_vtuner_fh(radio, file);
+	struct kt0913_device *tuner;
+	int ret;
+
+	if (kfh && !list_empty(&kfh->vt.list) && v->index == 0)
+		return __kt0913_vtuner_g_tuner(radio, kfh, v);
+
+	tuner = kt0913_tuner_get(radio, v->index);
+	if (!tuner)
+		return -EINVAL;
+
+	ret = __kt0913_g_tuner(tuner, v);
+	kt0913_tuner_put(radio, tuner);
+
+	return ret;
+}
+
+static int kt0913_ioctl_vidioc_s_tuner(struct file *file, void *priv,
+	const struct v4l2_tuner *v)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_device *tuner = kt0913_tuner_get(radio, v->index);
+	int ret;
+
+	if (!tuner)
+		return -EINVAL;
+
+	ret = __kt0913_s_tuner(tuner, v);
+	kt0913_tuner_put(radio, tuner);
+
+	return ret;
+}
+
+static int kt0913_ioctl_vidioc_s_hw_freq_seek(struct file *file, void *priv,
+	const struct v4l2_hw_freq_seek *seek)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_device *tuner;
+	int ret;
+
+	/* virtual tuners don't own the chip, so they can't seek */
+	if (radio->vtuners_enabled)
+		return -EBUSY;
+
+	tuner = kt0913_tuner_get(radio, seek->tuner);
+	if (!tuner)
+		return -EINVAL;
+
+	ret = __kt0913_seek(tuner, seek);
+	kt0913_tuner_put(radio, tuner);
+
+	return ret;
+}
+
+static int kt0913_ioctl_vidioc_subscribe_event(struct v4l2_fh *fh,
+	const struct v4l2_event_subscription *sub)
+{
+	switch (sub->type) {
+	case V4L2_EVENT_KT0913_TUNER:
+		/* sub->id selects the tuner index */
+		return v4l2_event_subscribe(fh, sub,
+			KT0913_TUNER_EVENT_QUEUE_LEN, NULL);
+	default:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+	}
+}
+
+static int __kt0913_s_tune_best(struct kt0913_device *radio)
+{
+	unsigned int freq;
+	int ret;
+
+	ret = __kt0913_tune_best(radio, radio->core.band, &freq);
+	if (ret)
+		return ret;
+
+	kt0913_queue_tuner_event(radio, KT0913_TUNER_EVENT_CH_FREQUENCY, freq);
+	kt0913_monitor_kick(radio);
+
+	return 0;
+}
+
+static int kt0913_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct kt0913_device *radio = v4l2_ctrl_to_device(ctrl);
+
+	switch (ctrl->id) {
+	case V4L2_CID_AUDIO_MUTE:
+		/* with DAPM, stay muted until the audio path is powered */
+		return __kt0913_update_mute(radio, ctrl->val);
+	case V4L2_CID_AUDIO_VOLUME:
+		return __kt0913_set_volume(radio, ctrl->val);
+	case V4L2_CID_GAIN:
+		return __kt0913_set_au_gain(radio, ctrl->val);
+	case V4L2_CID_TUNE_DEEMPHASIS:
+		return __kt0913_set_deemphasis(radio, ctrl->val);
+	case KT0913_CID_AUTO_FINE_TUNE:
+		radio->auto_fine_tune = ctrl->val;
+		return 0;
+	case KT0913_CID_BEST_ON_BAND_SWITCH:
+		radio->best_on_band_switch = ctrl->val;
+		return 0;
+	case KT0913_CID_FM_SPACING:
+		WRITE_ONCE(radio->fm_spacing,
+			div_u64(ctrl->qmenu_int[ctrl->val], 1000));
+		return __kt0913_field_write(radio, KT0913_F_FMSPACE,
+			kt0913_fmspace_to_reg(radio->fm_spacing));
+	case KT0913_CID_AM_SPACING:
+		WRITE_ONCE(radio->am_spacing,
+			div_u64(ctrl->qmenu_int[ctrl->val], 1000));
+		return __kt0913_field_write(radio, KT0913_F_AMSPACE,
+			kt0913_amspace_to_reg(radio->am_spacing));
+	case KT0913_CID_TUNE_BEST:
+		/* the handler lock is the mutex */
+		return __kt0913_s_tune_best(radio);
+	case KT0913_CID_SQUELCH:
+		radio->squelch = ctrl->val;
+		/* the handler lock is held, the mute is read directly */
+		return __kt0913_update_squelch(radio, radio->ctrl_mute->cur.val);
+	default:
+		return -EINVAL;
+	}
+}
+
+static int kt0913_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct kt0913_device *radio = v4l2_ctrl_to_device(ctrl);
+
+	switch (ctrl->id) {
+	case V4L2_CID_RF_TUNER_PLL_LOCK:
+		return __kt0913_get_pll_status(radio, &ctrl->val);
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct v4l2_ctrl_ops kt0913_ctrl_ops = {
+	.s_ctrl = kt0913_s_ctrl,
+	.g_volatile_ctrl = kt0913_g_volatile_ctrl,
+};
+
+static const struct v4l2_ctrl_config kt0913_ctrl_squelch = {
+	.ops = &kt0913_ctrl_ops,
+	.id = KT0913_CID_SQUELCH,
+	.name = "Squelch",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = 31,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config kt0913_ctrl_auto_fine_tune = {
+	.ops = &kt0913_ctrl_ops,
+	.id = KT0913_CID_AUTO_FINE_TUNE,
+	.name = "Auto Fine Tuning",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config kt0913_ctrl_tune_best = {
+	.ops = &kt0913_ctrl_ops,
+	.id = KT0913_CID_TUNE_BEST,
+	.name = "Tune Best Station",
+	.type = V4L2_CTRL_TYPE_BUTTON,
+};
+
+static const struct v4l2_ctrl_config kt0913_ctrl_best_on_band_switch = {
+	.ops = &kt0913_ctrl_ops,
+	.id = KT0913_CID_BEST_ON_BAND_SWITCH,
+	.name = "Best Station on Band Switch",
+	.type = V4L2_CTRL_TYPE_BOOLEAN,
+	.min = 0,
+	.max = 1,
+	.step = 1,
+	.def = 0,
+};
+
+static const s64 kt0913_fm_spacings[] = { 50000, 100000, 200000 };
+static const s64 kt0913_am_spacings[] = { 1000, 9000, 10000 };
+
+static const struct v4l2_ctrl_config kt0913_ctrl_fm_spacing = {
+	.ops = &kt0913_ctrl_ops,
+	.id = KT0913_CID_FM_SPACING,
+	.name = "FM Channel Spacing (Hz)",
+	.type = V4L2_CTRL_TYPE_INTEGER_MENU,
+	.max = ARRAY_SIZE(kt0913_fm_spacings) - 1,
+	.def = 0,
+	.qmenu_int = kt0913_fm_spacings,
+};
+
+static const struct v4l2_ctrl_config kt0913_ctrl_am_spacing = {
+	.ops = &kt0913_ctrl_ops,
+	.id = KT0913_CID_AM_SPACING,
+	.name = "AM Channel Spacing (Hz)",
+	.type = V4L2_CTRL_TYPE_INTEGER_MENU,
+	.max = ARRAY_SIZE(kt0913_am_spacings) - 1,
+	.def = 0,
+	.qmenu_int = kt0913_am_spacings,
+};
+
+/* controls of the tuners 1..N-1 of a merged node, priv is the chip */
+static int kt0913_tuner_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct kt0913_device *tuner = ctrl->priv;
+	int ret;
+
+	/* the chip was removed */
+	if (!tuner)
+		return -ENODEV;
+
+	mutex_lock(&tuner->mutex);
+
+	switch ((ctrl->id - KT0913_CID_TUNER_BASE) % KT0913_CID_TUNER_STRIDE) {
+	case KT0913_TUNER_CTRL_MUTE:
+		ret = __kt0913_set_mute(tuner, ctrl->val);
+		break;
+	case KT0913_TUNER_CTRL_VOLUME:
+		ret = __kt0913_set_volume(tuner, ctrl->val);
+		break;
+	case KT0913_TUNER_CTRL_GAIN:
+		ret = __kt0913_set_au_gain(tuner, ctrl->val);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
+	}
+
+	mutex_unlock(&tuner->mutex);
+
+	return ret;
+}
+
+static const struct v4l2_ctrl_ops kt0913_tuner_ctrl_ops = {
+	.s_ctrl = kt0913_tuner_s_ctrl,
+};
+
+/* ************************************************************************* */
+
+/*
+ * add a chip to the node of owner as the next tuner index, along with its
+ * own mute/volume/gain controls. the defaults match the state __kt0913_init
+ * leaves the chip in. called with kt0913_device_list_lock held, which also
+ * keeps n_tuners stable. the controls are added before taking the mutex of
+ * owner, it's the lock of their handler.
+ */
+static int kt0913_tuner_attach(struct kt0913_device *owner,
+	struct kt0913_device *tuner)
+{
+	struct v4l2_ctrl_config cfg = {
+		.ops = &kt0913_tuner_ctrl_ops,
+	};
+	struct device *dev = &owner->client->dev;
+	struct v4l2_ctrl_handler *hdl = &owner->ctrl_handler;
+	unsigned int index;
+	u32 base;
+	int i;
+
+	if (owner->n_tuners >= KT0913_MAX_TUNERS)
+		return -ENOSPC;
+
+	/* indexes aren't reused, the controls of removed ones are still there */
+	index = owner->n_tuners;
+	base = KT0913_CID_TUNER_BASE + index * KT0913_CID_TUNER_STRIDE;
+
+	cfg.id = base + KT0913_TUNER_CTRL_MUTE;
+	cfg.name = devm_kasprintf(dev, GFP_KERNEL, "Tuner %u Mute", index);
+	cfg.type = V4L2_CTRL_TYPE_BOOLEAN;
+	cfg.min = 0;
+	cfg.max = 1;
+	cfg.step = 1;
+	cfg.def = tuner->default_mute;
+	tuner->tuner_ctrls[KT0913_TUNER_CTRL_MUTE] =
+		v4l2_ctrl_new_custom(hdl, &cfg, tuner);
+
+	cfg.id = base + KT0913_TUNER_CTRL_VOLUME;
+	cfg.name = devm_kasprintf(dev, GFP_KERNEL, "Tuner %u Volume", index);
+	cfg.type = V4L2_CTRL_TYPE_INTEGER;
+	cfg.min = -60;
+	cfg.max = 0;
+	cfg.step = 2;
+	cfg.def = tuner->default_volume;
+	tuner->tuner_ctrls[KT0913_TUNER_CTRL_VOLUME] =
+		v4l2_ctrl_new_custom(hdl, &cfg, tuner);
+
+	cfg.id = base + KT0913_TUNER_CTRL_GAIN;
+	cfg.name = devm_kasprintf(dev, GFP_KERNEL, "Tuner %u Gain", index);
+	cfg.min = -3;
+	cfg.max = 6;
+	cfg.step = 3;
+	cfg.def = 3;
+	cfg.flags = V4L2_CTRL_FLAG_SLIDER;
+	tuner->tuner_ctrls[KT0913_TUNER_CTRL_GAIN] =
+		v4l2_ctrl_new_custom(hdl, &cfg, tuner);
+
+	if (hdl->error) {
+		v4l2_err(owner->client,
+			"Could not register the controls of tuner %u\n", index);
+		return hdl->error;
+	}
+
+	mutex_lock(&owner->mutex);
+
+	for (i = 0; i < KT0913_TUNER_CTRL_COUNT; i++)
+		tuner->tuner_ctrls[i]->priv = tuner;
+
+	owner->tuners[index] = tuner;
+	owner->n_tuners++;
+	tuner->primary = owner;
+	tuner->tuner_index = index;
+
+	mutex_unlock(&owner->mutex);
+
+	v4l2_info(tuner->client, "added as tuner %u of %s\n", index,
+		video_device_node_name(&owner->vdev));
+
+	return 0;
+}
+
+/*
+ * take a chip out of the merged node. called with kt0913_device_list_lock.
+ * the mutex of owner is the lock of the controls.
+ */
+static void kt0913_tuner_detach(struct kt0913_device *tuner)
+{
+	struct kt0913_device *owner = tuner->primary;
+	int i;
+
+	mutex_lock(&owner->mutex);
+	mutex_lock(&tuner->mutex);
+
+	for (i = 0; i < KT0913_TUNER_CTRL_COUNT; i++) {
+		tuner->tuner_ctrls[i]->priv = NULL;
+		tuner->tuner_ctrls[i] = NULL;
+	}
+
+	owner->tuners[tuner->tuner_index] = NULL;
+	tuner->primary = NULL;
+	tuner->tuner_index = 0;
+
+	mutex_unlock(&tuner->mutex);
+	mutex_unlock(&owner->mutex);
+}
+
+/* ************************************************************************* */
+
+/*
+ * controls of the virtual tuner of a file handle, priv is the kt0913_fh.
+ * they're under the lock of the file handle's handler, not the mutex the
+ * scheduler reads them with.
+ */
+static int kt0913_vtuner_s_ctrl(struct v4l2_ctrl *ctrl)
+{
+	struct kt0913_fh *kfh = ctrl->priv;
+
+	switch (ctrl->id) {
+	case KT0913_CID_VTUNER_DWELL:
+		WRITE_ONCE(kfh->vt.dwell_ms, ctrl->val);
+		return 0;
+	case KT0913_CID_VTUNER_WEIGHT:
+		WRITE_ONCE(kfh->vt.weight, ctrl->val);
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct v4l2_ctrl_ops kt0913_vtuner_ctrl_ops = {
+	.s_ctrl = kt0913_vtuner_s_ctrl,
+};
+
+static const struct v4l2_ctrl_config kt0913_vtuner_ctrl_dwell = {
+	.ops = &kt0913_vtuner_ctrl_ops,
+	.id = KT0913_CID_VTUNER_DWELL,
+	.name = "Virtual Tuner Dwell Time (ms)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = KT0913_VTUNER_DWELL_MIN_MS,
+	.max = KT0913_VTUNER_DWELL_MAX_MS,
+	.step = 1,
+	.def = KT0913_VTUNER_DWELL_DEF_MS,
+};
+
+static const struct v4l2_ctrl_config kt0913_vtuner_ctrl_weight = {
+	.ops = &kt0913_vtuner_ctrl_ops,
+	.id = KT0913_CID_VTUNER_WEIGHT,
+	.name = "Virtual Tuner Weight",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 1,
+	.max = KT0913_VTUNER_WEIGHT_MAX,
+	.step = 1,
+	.def = 1,
+};
+
+/*
+ * with virtual tuners, each file handle gets its own handler with the
+ * dwell/weight controls of its virtual tuner plus the device controls.
+ */
+static int kt0913_fh_open(struct file *file)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct v4l2_ctrl_handler *hdl;
+	struct kt0913_fh *kfh;
+	struct v4l2_ctrl *ctrl;
+	int ret;
+
+	if (!radio->vtuners_enabled)
+		return v4l2_fh_open(file);
+
+	kfh = kzalloc(sizeof(*kfh), GFP_KERNEL);
+	if (!kfh)
+		return -ENOMEM;
+
+	hdl = &kfh->ctrl_handler;
+	v4l2_ctrl_handler_init(hdl, 2);
+
+	ctrl = v4l2_ctrl_new_custom(hdl, &kt0913_vtuner_ctrl_dwell, NULL);
+	if (ctrl)
+		ctrl->priv = kfh;
+	ctrl = v4l2_ctrl_new_custom(hdl, &kt0913_vtuner_ctrl_weight, NULL);
+	if (ctrl)
+		ctrl->priv = kfh;
+	v4l2_ctrl_add_handler(hdl, &radio->ctrl_handler, NULL, false);
+	if (hdl->error) {
+		ret = hdl->error;
+		v4l2_ctrl_handler_free(hdl);
+		kfree(kfh);
+		return ret;
+	}
+
+	INIT_LIST_HEAD(&kfh->vt.list);
+	kfh->vt.dwell_ms = KT0913_VTUNER_DWELL_DEF_MS;
+	kfh->vt.weight = 1;
+
+	v4l2_fh_init(&kfh->fh, video_devdata(file));
+	kfh->fh.ctrl_handler = hdl;
+	file->private_data = &kfh->fh;
+	v4l2_fh_add(&kfh->fh);
+
+	return 0;
+}
+
+static int kt0913_fh_release(struct file *file)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_fh *kfh;
+
+	if (!radio->vtuners_enabled)
+		return v4l2_fh_release(file);
+
+	kfh = container_of(file->private_data, struct kt0913_fh, fh);
+
+	/* release the virtual tuner, the scheduler won't see it anymore */
+	mutex_lock(&radio->mutex);
+	if (!list_empty(&kfh->vt.list))
+		list_del(&kfh->vt.list);
+	if (radio->vtuner_current == &kfh->vt)
+		radio->vtuner_current = NULL;
+	mutex_unlock(&radio->mutex);
+
+	v4l2_fh_del(&kfh->fh);
+	v4l2_fh_exit(&kfh->fh);
+	v4l2_ctrl_handler_free(&kfh->ctrl_handler);
+	kfree(kfh);
+
+	return 0;
+}
+
+/*
+ * the chip stays out of standby while the node is open, even when a sound
+ * card would let it go: the ioctls, the virtual tuners and the monitor all
+ * need it running.
+ */
+static int kt0913_fops_open(struct file *file)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	int ret;
+
+	ret = pm_runtime_resume_and_get(&radio->client->dev);
+	if (ret)
+		return ret;
+
+	ret = kt0913_fh_open(file);
+	if (ret)
+		pm_runtime_put(&radio->client->dev);
+
+	return ret;
+}
+
+static int kt0913_fops_release(struct file *file)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	int ret;
+
+	ret = kt0913_fh_release(file);
+	pm_runtime_put(&radio->client->dev);
+
+	return ret;
+}
+
+/*
+ * compare the cached value of every field on a non-volatile register
+ * against the chip, and the band field against the driver state. the
+ * standby bit (owned by the PM callbacks) and the tune bits are skipped.
+ */
+static void kt0913_check_state(struct kt0913_device *radio)
+{
+	unsigned int field, reg, cached, chip;
+
+	mutex_lock(&radio->mutex);
+
+	for (field = 0; field < KT0913_F_MAX; field++) {
+		reg = kt0913_fields[field].reg;
+		if (regmap_volatile(radio->regmap, reg) ||
+			field == KT0913_F_STDBY || field == KT0913_F_FMTUNE ||
+			field == KT0913_F_AMTUNE)
+			continue;
+
+		if (regmap_read(radio->regmap, reg, &cached))
+			break;
+
+		if (__kt0913_read_uncached(radio, reg, &chip))
+			break;
+
+		if (kt0913_field_get(field, cached) ==
+			kt0913_field_get(field, chip))
+			continue;
+
+		radio->reg_mismatches++;
+		dev_warn_ratelimited(&radio->client->dev,
+			"reg 0x%02x mask 0x%04x: cached 0x%04x, chip 0x%04x\n",
+			reg, kt0913_field_mask(field), cached, chip);
+	}
+
+	if (!regmap_read(radio->regmap, KT0913_REG_AMSYSCFG, &cached) &&
+		kt0913_field_get(KT0913_F_AM_FM, cached) !=
+		(radio->core.band == BAND_AM ?
+		KT0913_AMSYSCFG_AM_FM_AM : KT0913_AMSYSCFG_AM_FM_FM)) {
+		radio->reg_mismatches++;
+		dev_warn_ratelimited(&radio->client->dev,
+			"AM/FM mode doesn't match band %u\n", radio->core.band);
+	}
+
+	mutex_unlock(&radio->mutex);
+}
+
+static unsigned int kt0913_ioctl_index(unsigned int cmd)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(kt0913_ioctl_descs); i++)
+		if (kt0913_ioctl_descs[i].cmd == cmd)
+			break;
+
+	/* the last slot counts every other ioctl */
+	return i;
+}
+
+/*
+ * the mutex is also the lock of the control handler, so the control and
+ * event ioctls get it from the control framework, and VIDIOC_DQEVENT must
+ * not sleep with it held. VIDIOC_LOG_STATUS takes it itself.
+ */
+static bool kt0913_ioctl_locked(unsigned int cmd)
+{
+	switch (cmd) {
+	case VIDIOC_QUERYCTRL:
+	case VIDIOC_QUERY_EXT_CTRL:
+	case VIDIOC_QUERYMENU:
+	case VIDIOC_G_CTRL:
+	case VIDIOC_S_CTRL:
+	case VIDIOC_G_EXT_CTRLS:
+	case VIDIOC_S_EXT_CTRLS:
+	case VIDIOC_TRY_EXT_CTRLS:
+	case VIDIOC_SUBSCRIBE_EVENT:
+	case VIDIOC_UNSUBSCRIBE_EVENT:
+	case VIDIOC_DQEVENT:
+	case VIDIOC_LOG_STATUS:
+		return false;
+	default:
+		return true;
+	}
+}
+
+/*
+ * video_ioctl2() under the mutex (the node has no lock of its own, see
+ * kt0913_ioctl_locked()) plus latency accounting. slow ioctls are reported,
+ * and the register state is checked after the setters if asked to.
+ */
+static long kt0913_fops_ioctl(struct file *file, unsigned int cmd,
+	unsigned long arg)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+	unsigned int index = kt0913_ioctl_index(cmd);
+	const struct kt0913_ioctl_desc *desc =
+		index < ARRAY_SIZE(kt0913_ioctl_descs) ?
+		&kt0913_ioctl_descs[index] : NULL;
+	struct kt0913_ioctl_stat *stat = &radio->ioctl_stats[index];
+	bool locked = kt0913_ioctl_locked(cmd);
+	bool slow;
+	u64 start;
+	long ret;
+	u64 ns;
+
+	start = ktime_get_ns();
+	if (locked && mutex_lock_interruptible(&radio->mutex))
+		return -ERESTARTSYS;
+	ret = video_ioctl2(file, cmd, arg);
+	if (locked)
+		mutex_unlock(&radio->mutex);
+	ns = ktime_get_ns() - start;
+
+	slow = kt0913_slow_ioctl_ms && !(desc && desc->unbounded) &&
+		ns > (u64)kt0913_slow_ioctl_ms * NSEC_PER_MSEC;
+
+	spin_lock(&radio->stats_lock);
+	stat->count++;
+	stat->total_ns += ns;
+	stat->max_ns = max(stat->max_ns, ns);
+	if (slow)
+		stat->slow++;
+	spin_unlock(&radio->stats_lock);
+
+	if (slow)
+		dev_warn_ratelimited(&radio->client->dev,
+			"%s took %llu us\n", desc ? desc->name : "ioctl",
+			div_u64(ns, NSEC_PER_USEC));
+
+	if (kt0913_check_regs && !ret && desc && desc->setter)
+		kt0913_check_state(radio);
+
+	return ret;
+}
+
+/*
+ * dump the chip state (status registers read back to back with the bus
+ * held, STATUSA..C in one bulk read) and the driver's performance counters.
+ * called with the mutex held.
+ */
+static int __kt0913_log_status(struct kt0913_device *radio, const char *name)
+{
+	struct i2c_client *client = radio->client;
+	unsigned int amstatusa, afc, rxcfg;
+	u16 status[3];
+	unsigned long tunes, ops, retries, errors, resumes;
+	u64 tune_total, tune_max, active, standby;
+	unsigned int band, frequency;
+	u8 rssi;
+	int ret;
+
+	band = radio->core.band;
+	__kt0913_bus_lock(radio);
+	ret = kt0913_core_get_frequency(&radio->core, &frequency);
+	if (!ret)
+		ret = regmap_bulk_read(radio->regmap, KT0913_REG_STATUSA,
+			status, ARRAY_SIZE(status));
+	if (!ret)
+		ret = regmap_read(radio->regmap, KT0913_REG_AMSTATUSA,
+			&amstatusa);
+	if (!ret)
+		ret = regmap_read(radio->regmap, KT0913_REG_AFC, &afc);
+	if (!ret)
+		ret = regmap_read(radio->regmap, KT0913_REG_RXCFG, &rxcfg);
+	__kt0913_bus_unlock(radio);
+	tunes = radio->tune_count;
+	tune_total = radio->tune_total_ns;
+	tune_max = radio->tune_max_ns;
+
+	/* written with the regmap lock held, a racy read is good enough */
+	ops = READ_ONCE(radio->i2c_ops);
+	retries = READ_ONCE(radio->i2c_retries);
+	errors = READ_ONCE(radio->i2c_errors);
+
+	spin_lock(&radio->stats_lock);
+	kt0913_pm_account(radio, ktime_get_ns());
+	active = radio->pm_active_ns;
+	standby = radio->pm_standby_ns;
+	resumes = radio->pm_resumes;
+	spin_unlock(&radio->stats_lock);
+
+	if (ret) {
+		v4l2_info(client, "%s: chip state unavailable (%d)\n",
+			name, ret);
+	} else {
+		rssi = kt0913_status_to_raw_rssi(band,
+			band == BAND_AM ? amstatusa : status[0]);
+		v4l2_info(client, "%s: %s %u kHz, standby %s\n", name,
+			band == BAND_AM ? "AM" : "FM", frequency,
+			kt0913_field_get(KT0913_F_STDBY, rxcfg) ? "yes" : "no");
+		v4l2_info(client, "%s: XTAL %s, PLL %s, LO %s, %s\n", name,
+			kt0913_field_get(KT0913_F_XTAL_OK, status[0]) ?
+			"ok" : "not ready",
+			kt0913_field_get(KT0913_F_PLL_LOCK, status[0]) ?
+			"locked" : "unlocked",
+			kt0913_field_get(KT0913_F_LO_LOCK, status[0]) ?
+			"locked" : "unlocked",
+			kt0913_field_get(KT0913_F_ST, status[0]) ==
+			KT0913_STATUSA_ST_STEREO ? "stereo" : "mono");
+		v4l2_info(client, "%s: RSSI %d dBm (%u/31), SNR %u, AFC %d\n",
+			name,
+			kt0913_raw_rssi_to_dbm(band, rssi), rssi,
+			kt0913_field_get(KT0913_F_FMSNR, status[2]),
+			kt0913_reg_to_afc(afc));
+	}
+
+	v4l2_info(client, "%s: I2C %lu ops, %lu retries, %lu errors\n",
+		name, ops, retries, errors);
+	v4l2_info(client,
+		"%s: %lu tunes, avg %llu us, max %llu us, %lu AFC retunes\n",
+		name, tunes,
+		tunes ? div_u64(div_u64(tune_total, tunes), NSEC_PER_USEC) : 0,
+		div_u64(tune_max, NSEC_PER_USEC), radio->afc_corrections);
+	v4l2_info(client, "%s: %lu band switches, avg %llu us, max %llu us\n",
+		name, radio->band_switch_count, radio->band_switch_count ?
+		div_u64(div_u64(radio->band_switch_total_ns,
+		radio->band_switch_count), NSEC_PER_USEC) : 0,
+		div_u64(radio->band_switch_max_ns, NSEC_PER_USEC));
+	v4l2_info(client, "%s: active %llu ms, standby %llu ms, %lu resumes\n",
+		name, div_u64(active, NSEC_PER_MSEC),
+		div_u64(standby, NSEC_PER_MSEC), resumes);
+	v4l2_info(client,
+		"%s: monitor every %u ms, %u.%03u wakeups/s, %lu resets\n",
+		name, READ_ONCE(radio->monitor_interval_ms),
+		radio->monitor_rate_mhz / 1000, radio->monitor_rate_mhz % 1000,
+		radio->resets);
+	v4l2_info(client, "%s: squelch %u, %s\n", name, radio->squelch,
+		radio->squelched ? "closed" : "open");
+
+	return ret;
+}
+
+static int kt0913_ioctl_vidioc_log_status(struct file *file, void *priv)
+{
+	struct kt0913_device *radio = video_drvdata(file);
+
+	/* unlocked, v4l2_ctrl_log_status() takes the mutex too */
+	mutex_lock(&radio->mutex);
+	__kt0913_log_status(radio, radio->v4l2_dev.name);
+	mutex_unlock(&radio->mutex);
+
+	return v4l2_ctrl_log_status(file, priv);
+}
+
+/* File system interface (use the ancillary fops for v4l2) */
+static const struct v4l2_file_operations kt0913_radio_fops = {
+	.owner = THIS_MODULE,
+	.open = kt0913_fops_open,
+	.release = kt0913_fops_release,
+	.poll = v4l2_ctrl_poll,
+	.unlocked_ioctl = kt0913_fops_ioctl,
+};
+
+/* ioctl ops */
+static const struct v4l2_ioctl_ops kt0913_ioctl_ops = {
+	.vidioc_querycap = kt0913_ioctl_vidioc_querycap,
+	.vidioc_g_tuner = kt0913_ioctl_vidioc_g_tuner,
+	.vidioc_s_tuner = kt0913_ioctl_vidioc_s_tuner,
+	.vidioc_g_frequency = kt0913_ioctl_vidioc_g_frequency,
+	.vidioc_s_frequency = kt0913_ioctl_vidioc_s_frequency,
+	.vidioc_enum_freq_bands = kt0913_ioctl_vidioc_enum_freq_bands,
+	.vidioc_s_hw_freq_seek = kt0913_ioctl_vidioc_s_hw_freq_seek,
+	/* use ancillary functions for these: */
+	.vidioc_log_status = kt0913_ioctl_vidioc_log_status,
+	.vidioc_subscribe_event = kt0913_ioctl_vidioc_subscribe_event,
+	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
+};
+
+/* V4L2 RADIO device structure */
+static struct video_device kt0913_radio_template = {
+	.name = KT0913_FM_AM_DRIVER_NAME,
+	.fops = &kt0913_radio_fops,
+	.ioctl_ops = &kt0913_ioctl_ops,
+	.release = video_device_release_empty,
+	.vfl_dir = VFL_DIR_RX,
+	.device_caps = V4L2_CAP_TUNER | V4L2_CAP_RADIO | V4L2_CAP_HW_FREQ_SEEK,
+};
+
+/* ************************************************************************* */
+
+/*
+ * v4l2_subdev personality, for capture bridges that pair the kt0913 with
+ * their own audio input. the ops take the chip mutex and a PM reference
+ * themselves, since they don't go through the radio node.
+ */
+static inline struct kt0913_device *v4l2_subdev_to_device(
+	struct v4l2_subdev *sd)
+{
+	return container_of(sd, struct kt0913_device, sd);
+}
+
+static int kt0913_subdev_log_status(struct v4l2_subdev *sd)
+{
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	int ret;
+
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_log_status(radio, sd->name);
+	mutex_unlock(&radio->mutex);
+
+	v4l2_ctrl_handler_log_status(&radio->ctrl_handler, sd->name);
+
+	return ret;
+}
+
+/* bridges can run a seek with VIDIOC_S_HW_FREQ_SEEK through core.ioctl */
+static long kt0913_subdev_ioctl(struct v4l2_subdev *sd, unsigned int cmd,
+	void *arg)
 {
-	unsigned int amstatusa_reg;
-	int ret = regmap_read(radio->regmap, KT0913_REG_AMSTATUSA, &amstatusa_reg);
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	struct v4l2_hw_freq_seek *seek = arg;
+	long ret;
+
+	switch (cmd) {
+	case VIDIOC_S_HW_FREQ_SEEK:
+		/* the subdev is a single chip, its only tuner is 0 */
+		if (seek->tuner)
+			return -EINVAL;
 
-	if (ret)
+		ret = pm_runtime_resume_and_get(&radio->client->dev);
+		if (ret)
+			return ret;
+
+		mutex_lock(&radio->mutex);
+		ret = __kt0913_seek(radio, seek);
+		mutex_unlock(&radio->mutex);
+
+		pm_runtime_put(&radio->client->dev);
 		return ret;
+	default:
+		return -ENOIOCTLCMD;
+	}
+}
 
-	/* AMRSSI(dBm) = -90 + AMRSSI<4:0> * 3dBm
-	 * even tho we can get the value in dBm, we want a %
-	 */
-	*rssi = (amstatusa_reg & KT0913_AMSTATUSA_AMRSSI_MASK) >>
-		KT0913_AMSTATUSA_AMRSSI_SHIFT;
-	/* map range 0-31 to 0-65535 */
-	*rssi *= 65535;
-	*rssi /= KT0913_AMSTATUSA_AMRSSI_MASK >> KT0913_AMSTATUSA_AMRSSI_SHIFT;
+static int kt0913_subdev_standby(struct v4l2_subdev *sd)
+{
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	int ret;
 
-	return 0;
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_set_standby(radio, true);
+	mutex_unlock(&radio->mutex);
+
+	return ret;
 }
 
-/* ************************************************************************* */
+/* the bridge switched to radio mode, leave standby */
+static int kt0913_subdev_s_radio(struct v4l2_subdev *sd)
+{
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	int ret;
 
-static int __kt0913_init(struct kt0913_device *radio)
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_wake(radio);
+	if (!ret)
+		kt0913_monitor_kick(radio);
+	mutex_unlock(&radio->mutex);
+
+	return ret;
+}
+
+static int kt0913_subdev_s_frequency(struct v4l2_subdev *sd,
+	const struct v4l2_frequency *f)
 {
-	int ret = 0;
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	int ret;
 
-	/* write the defaults */
-	ret = regmap_multi_reg_write(radio->regmap,
-		kt0913_init_regs_to_defaults,
-		ARRAY_SIZE(kt0913_init_regs_to_defaults));
-	if (ret) {
-		v4l2_err(radio->client,
-			"regmap_multi_reg_write() failed! %d", ret);
+	ret = pm_runtime_resume_and_get(&radio->client->dev);
+	if (ret)
 		return ret;
-	}
 
-	/* set the audio dac anti-pop config */
-	ret = regmap_update_bits(radio->regmap,
-		KT0913_REG_VOLUME, KT0913_VOLUME_POP_MASK,
-		radio->audio_anti_pop << KT0913_VOLUME_POP_SHIFT);
-	if (ret) {
-		v4l2_err(radio->client,
-			"regmap_update_bits() failed for anti-pop cfg! %d", ret);
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_s_frequency(radio, f);
+	mutex_unlock(&radio->mutex);
+
+	pm_runtime_put(&radio->client->dev);
+
+	return ret;
+}
+
+static int kt0913_subdev_g_frequency(struct v4l2_subdev *sd,
+	struct v4l2_frequency *f)
+{
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	int ret;
+
+	ret = pm_runtime_resume_and_get(&radio->client->dev);
+	if (ret)
 		return ret;
-	}
 
-	/* set the reference clock config */
-	ret = regmap_update_bits(radio->regmap,
-		KT0913_REG_AMSYSCFG, KT0913_AMSYSCFG_REFCLK_MASK,
-		radio->refclock_val << KT0913_AMSYSCFG_REFCLK_SHIFT);
-	if (ret) {
-		v4l2_err(radio->client,
-			"regmap_update_bits() failed for refclk cfg! %d", ret);
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_g_frequency(radio, f);
+	mutex_unlock(&radio->mutex);
+
+	pm_runtime_put(&radio->client->dev);
+
+	return ret;
+}
+
+static int kt0913_subdev_enum_freq_bands(struct v4l2_subdev *sd,
+	struct v4l2_frequency_band *band)
+{
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+
+	return __kt0913_enum_freq_bands(radio, band);
+}
+
+static int kt0913_subdev_g_tuner(struct v4l2_subdev *sd, struct v4l2_tuner *v)
+{
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	int ret;
+
+	ret = pm_runtime_resume_and_get(&radio->client->dev);
+	if (ret)
 		return ret;
-	}
 
-	if (kt0913_use_campus_band) {
-		v4l2_info(radio->client,
-			"campus band is enabled!");
-		/* set the campus band bit */
-		ret = regmap_update_bits(radio->regmap,
-			KT0913_REG_LOCFGC, KT0913_LOCFG_CAMPUSBAND_EN_MASK,
-			KT0913_LOCFG_CAMPUSBAND_EN_ON);
-		if (ret) {
-			v4l2_err(radio->client,
-				"regmap_update_bits() failed for campus band! %d",
-				ret);
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_g_tuner(radio, v);
+	mutex_unlock(&radio->mutex);
+
+	pm_runtime_put(&radio->client->dev);
+
+	return ret;
+}
+
+static int kt0913_subdev_s_tuner(struct v4l2_subdev *sd,
+	const struct v4l2_tuner *v)
+{
+	struct kt0913_device *radio = v4l2_subdev_to_device(sd);
+	int ret;
+
+	ret = pm_runtime_resume_and_get(&radio->client->dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_s_tuner(radio, v);
+	mutex_unlock(&radio->mutex);
+
+	pm_runtime_put(&radio->client->dev);
+
+	return ret;
+}
+
+static const struct v4l2_subdev_core_ops kt0913_subdev_core_ops = {
+	.log_status = kt0913_subdev_log_status,
+	.ioctl = kt0913_subdev_ioctl,
+};
+
+static const struct v4l2_subdev_tuner_ops kt0913_subdev_tuner_ops = {
+	.standby = kt0913_subdev_standby,
+	.s_radio = kt0913_subdev_s_radio,
+	.s_frequency = kt0913_subdev_s_frequency,
+	.g_frequency = kt0913_subdev_g_frequency,
+	.enum_freq_bands = kt0913_subdev_enum_freq_bands,
+	.g_tuner = kt0913_subdev_g_tuner,
+	.s_tuner = kt0913_subdev_s_tuner,
+};
+
+static const struct v4l2_subdev_ops kt0913_subdev_ops = {
+	.core = &kt0913_subdev_core_ops,
+	.tuner = &kt0913_subdev_tuner_ops,
+};
+
+/* ************************************************************************* */
+
+#if IS_ENABLED(CONFIG_SND_SOC)
+/*
+ * ASoC component for the analog output, meant to be added to the sound card
+ * as an auxiliary device routed into the ADC input that captures it. once
+ * it's part of a card, the chip stays muted and in standby unless DAPM
+ * powers the "Tuner" widget, i.e. a capture stream using it is running.
+ */
+
+static int kt0913_audio_path_enable(struct kt0913_device *radio, bool on)
+{
+	struct device *dev = &radio->client->dev;
+	int ret;
+
+	if (on) {
+		/* leaves standby through the runtime resume callback */
+		ret = pm_runtime_get_sync(dev);
+		if (ret < 0) {
+			pm_runtime_put_noidle(dev);
 			return ret;
 		}
 	}
 
-	return __kt0913_set_mute(radio, true);
+	mutex_lock(&radio->mutex);
+
+	radio->audio_path_on = on;
+	if (on) {
+		ret = __kt0913_wait_pll_lock(radio);
+		if (ret)
+			v4l2_warn(radio->client, "PLL didn't lock (%d)", ret);
+		/* honor the mute control and the squelch */
+		ret = __kt0913_update_mute(radio,
+			radio->ctrl_mute->cur.val);
+	} else {
+		/* mute before going into standby */
+		ret = __kt0913_set_mute(radio, true);
+	}
+
+	mutex_unlock(&radio->mutex);
+
+	if (!on)
+		pm_runtime_put(dev);
+
+	return ret;
 }
 
-/* ************************************************************************* */
+static int kt0913_dapm_tuner_event(struct snd_soc_dapm_widget *w,
+	struct snd_kcontrol *kcontrol, int event)
+{
+	struct snd_soc_component *component =
+		snd_soc_dapm_to_component(w->dapm);
+	struct kt0913_device *radio =
+		i2c_client_to_device(to_i2c_client(component->dev));
+
+	switch (event) {
+	case SND_SOC_DAPM_POST_PMU:
+		return kt0913_audio_path_enable(radio, true);
+	case SND_SOC_DAPM_PRE_PMD:
+		return kt0913_audio_path_enable(radio, false);
+	default:
+		return 0;
+	}
+}
 
-static int kt0913_ioctl_vidioc_g_frequency(struct file *file, void *priv,
-	struct v4l2_frequency *f)
+static const struct snd_soc_dapm_widget kt0913_dapm_widgets[] = {
+	/* the broadcast signal, always there */
+	SND_SOC_DAPM_SIGGEN("RF"),
+	SND_SOC_DAPM_PGA_E("Tuner", SND_SOC_NOPM, 0, 0, NULL, 0,
+		kt0913_dapm_tuner_event,
+		SND_SOC_DAPM_POST_PMU | SND_SOC_DAPM_PRE_PMD),
+	SND_SOC_DAPM_OUTPUT("LOUT"),
+	SND_SOC_DAPM_OUTPUT("ROUT"),
+};
+
+static const struct snd_soc_dapm_route kt0913_dapm_routes[] = {
+	{ "Tuner", NULL, "RF" },
+	{ "LOUT", NULL, "Tuner" },
+	{ "ROUT", NULL, "Tuner" },
+};
+
+/* the card took over: mute and let the chip go into standby */
+static int kt0913_component_probe(struct snd_soc_component *component)
 {
-	struct kt0913_device *radio = video_drvdata(file);
+	struct kt0913_device *radio =
+		i2c_client_to_device(to_i2c_client(component->dev));
 	int ret;
 
-	if (f->tuner != 0)
-		return -EINVAL;
+	mutex_lock(&radio->mutex);
+	radio->dapm_managed = true;
+	radio->audio_path_on = false;
+	ret = __kt0913_set_mute(radio, true);
+	mutex_unlock(&radio->mutex);
 
-	f->type = V4L2_TUNER_RADIO;
+	/* drop the reference held since probe */
+	radio->pm_held = false;
+	pm_runtime_put(component->dev);
+
+	return ret;
+}
+
+/* back to an always active chip, as without a card */
+static void kt0913_component_remove(struct snd_soc_component *component)
+{
+	struct kt0913_device *radio =
+		i2c_client_to_device(to_i2c_client(component->dev));
 
-	if (radio->band == BAND_AM)
-		ret = __kt0913_get_am_frequency(radio, &f->frequency);
+	/* take back the reference dropped by kt0913_component_probe() */
+	if (pm_runtime_resume_and_get(component->dev))
+		v4l2_warn(radio->client, "Could not leave standby");
 	else
-		ret = __kt0913_get_fm_frequency(radio, &f->frequency);
+		radio->pm_held = true;
 
-	if (ret)
-		return ret;
+	mutex_lock(&radio->mutex);
+	radio->dapm_managed = false;
+	__kt0913_update_mute(radio, radio->ctrl_mute->cur.val);
+	mutex_unlock(&radio->mutex);
+}
 
-	/* convert kHz freq into v4l2 freq */
-	f->frequency = khz_to_v4l2_freq(f->frequency);
+static const struct snd_soc_component_driver kt0913_component_driver = {
+	.probe = kt0913_component_probe,
+	.remove = kt0913_component_remove,
+	.dapm_widgets = kt0913_dapm_widgets,
+	.num_dapm_widgets = ARRAY_SIZE(kt0913_dapm_widgets),
+	.dapm_routes = kt0913_dapm_routes,
+	.num_dapm_routes = ARRAY_SIZE(kt0913_dapm_routes),
+};
+
+static int kt0913_register_component(struct kt0913_device *radio)
+{
+	/* no DAIs, the audio is analog */
+	return snd_soc_register_component(&radio->client->dev,
+		&kt0913_component_driver, NULL, 0);
+}
 
+/* before anything the component callbacks use is torn down */
+static void kt0913_unregister_component(struct kt0913_device *radio)
+{
+	if (radio->component)
+		snd_soc_unregister_component(&radio->client->dev);
+}
+#else
+static inline int kt0913_register_component(struct kt0913_device *radio)
+{
 	return 0;
 }
 
-static int kt0913_ioctl_vidioc_s_frequency(struct file *file, void *priv,
-	const struct v4l2_frequency *f)
+static inline void kt0913_unregister_component(struct kt0913_device *radio)
 {
-	struct kt0913_device *radio = video_drvdata(file);
-	unsigned int freq = f->frequency;
-	unsigned int new_band = BAND_FM;
+}
+#endif /* IS_ENABLED(CONFIG_SND_SOC) */
+
+/* ************************************************************************* */
+
+/*
+ * "survey" sysfs attribute. writing "fm" or "am" surveys that band using
+ * every bound kt0913 and blocks until it's done. reading it shows the last
+ * survey as a "<band> <first kHz> <step kHz>" line followed by the RSSI in
+ * dBm of each channel. it's a binary attribute since the finer grids don't
+ * fit in a page, e.g. 1kHz AM or 50kHz on the campus band.
+ */
+static ssize_t survey_read(struct file *filp, struct kobject *kobj,
+	struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct kt0913_survey *survey;
+	ssize_t len = 0;
+
+	mutex_lock(&kt0913_device_list_lock);
+
+	survey = kt0913_last_survey;
+	if (survey)
+		len = memory_read_from_buffer(buf, count, &off, survey->text,
+			survey->text_len);
+
+	mutex_unlock(&kt0913_device_list_lock);
+	return len;
+}
+
+static ssize_t survey_write(struct file *filp, struct kobject *kobj,
+	struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	unsigned int band;
 	int ret;
 
-	if (f->tuner != 0 || f->type != V4L2_TUNER_RADIO)
+	/* the whole command comes in one write */
+	if (off)
 		return -EINVAL;
 
-	if (freq == 0)
+	if (sysfs_streq(buf, "fm"))
+		band = BAND_FM;
+	else if (sysfs_streq(buf, "am"))
+		band = BAND_AM;
+	else
 		return -EINVAL;
 
-	/* check if the requested frequency is contained on the AM band */
-	if (freq <= kt0913_bands[BAND_AM].rangehigh)
-		new_band = BAND_AM;
-	else {
-		/* check if the requested frequency is contained on the FM band */
-		if (freq >= kt0913_bands[BAND_FM].rangelow)
-			new_band = BAND_FM;
-		/* check if the requested frequency is contained on the campus
-		 * FM band only if that feature was enabled
-		 */
-		else if (kt0913_use_campus_band &&
-			(freq >= kt0913_bands[BAND_FM_CAMUS].rangelow))
-			new_band = BAND_FM_CAMUS;
-		else {
-			v4l2_warn(radio->client,
-				"frequency out of allowed RF bands (%u kHz)",
-				v4l2_freq_to_khz(freq));
-			return -EINVAL;
-		}
+	ret = kt0913_survey_run(band);
+
+	if (kt0913_check_regs) {
+		struct kt0913_device *radio;
+
+		mutex_lock(&kt0913_device_list_lock);
+		list_for_each_entry(radio, &kt0913_device_list, list)
+			kt0913_check_state(radio);
+		mutex_unlock(&kt0913_device_list_lock);
 	}
 
-	/* is the requested band different than the one currently set? */
-	if (radio->band != new_band) {
-		ret = __kt0913_set_am_fm_band(radio, new_band);
-		if (ret)
-			return ret;
-		radio->band = new_band;
+	return ret ? ret : count;
+}
+/* the size isn't known until a survey runs */
+static BIN_ATTR_RW(survey, 0);
+
+/*
+ * "calibration" sysfs attribute. reading it shows the last measured timings
+ * and the polling in use, writing "1" runs the calibration again.
+ */
+static ssize_t calibration_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
+	struct kt0913_calibration calib;
+	ssize_t len = 0;
+
+	mutex_lock(&radio->mutex);
+	calib = radio->calib;
+	mutex_unlock(&radio->mutex);
+
+	if (calib.valid)
+		len = scnprintf(buf, PAGE_SIZE,
+			"bus_us %u\nxtal_us %u\npll_us %u\nfm_tune_us %u\nam_tune_us %u\n",
+			calib.bus_us, calib.xtal_us, calib.pll_us,
+			calib.stc_us[0], calib.stc_us[1]);
+
+	len += scnprintf(buf + len, PAGE_SIZE - len,
+		"poll_us %u\ntimeout_ms %u\n", READ_ONCE(radio->stc_poll_us),
+		READ_ONCE(radio->stc_timeout_ms));
+
+	return len;
+}
+
+static ssize_t calibration_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
+	bool run;
+	int ret;
+
+	ret = kstrtobool(buf, &run);
+	if (ret)
+		return ret;
+	if (!run)
+		return count;
+
+	/* the chip must be out of standby, and it stays muted meanwhile */
+	ret = pm_runtime_get_sync(dev);
+	if (ret < 0) {
+		pm_runtime_put_noidle(dev);
+		return ret;
 	}
 
-	/* clamp the frequency to the band boundaries */
-	freq = clamp(freq, kt0913_bands[new_band].rangelow,
-		kt0913_bands[new_band].rangehigh);
+	mutex_lock(&radio->mutex);
+	ret = __kt0913_update_mute(radio, true);
+	if (!ret)
+		ret = __kt0913_calibrate(radio);
+	__kt0913_update_mute(radio, radio->ctrl_mute->cur.val);
+	mutex_unlock(&radio->mutex);
 
-	/* convert v4l2 freq to kHz */
-	freq = v4l2_freq_to_khz(freq);
+	pm_runtime_put(dev);
 
-	if (radio->band == BAND_AM)
-		return __kt0913_set_am_frequency(radio, freq);
-	else
-		return __kt0913_set_fm_frequency(radio, freq);
+	return ret ? ret : count;
 }
+static DEVICE_ATTR_RW(calibration);
 
-static int kt0913_ioctl_vidioc_enum_freq_bands(struct file *file, void *priv,
-	struct v4l2_frequency_band *band)
+/* "i2c_budget" sysfs attribute: transfers per second for the background work */
+static ssize_t i2c_budget_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
+
+	return scnprintf(buf, PAGE_SIZE, "%u\n", READ_ONCE(radio->i2c_budget));
+}
+
+static ssize_t i2c_budget_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
+	unsigned int budget;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &budget);
+	if (ret)
+		return ret;
+
+	/* starts with a full second worth */
+	spin_lock(&radio->stats_lock);
+	radio->i2c_budget = budget;
+	radio->budget_tokens = (s64)budget * 1000;
+	radio->budget_ns = ktime_get_ns();
+	spin_unlock(&radio->stats_lock);
+
+	return count;
+}
+static DEVICE_ATTR_RW(i2c_budget);
+
+/* "rt_sched" sysfs attribute: policy and priority of the timed operations */
+static ssize_t rt_sched_show(struct device *dev,
+	struct device_attribute *attr, char *buf)
+{
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
+
+	return scnprintf(buf, PAGE_SIZE, "%s %u\n",
+		kt0913_rt_policy_name(READ_ONCE(radio->rt_policy)),
+		READ_ONCE(radio->rt_priority));
+}
+
+static ssize_t rt_sched_store(struct device *dev,
+	struct device_attribute *attr, const char *buf, size_t count)
 {
-	if (band->tuner != 0)
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
+	unsigned int priority = 0;
+	char name[8];
+	int policy, ret;
+
+	/* "<policy> [priority]", e.g. "fifo 10" or "normal" */
+	if (sscanf(buf, "%7s %u", name, &priority) < 1)
 		return -EINVAL;
 
-	switch (band->index) {
-	case 0:
-		if (kt0913_use_campus_band)
-			*band = kt0913_bands[BAND_FM_CAMUS];
-		else
-			*band = kt0913_bands[BAND_FM];
-		return 0;
-	case 1:
-		*band = kt0913_bands[BAND_AM];
+	policy = kt0913_rt_policy_parse(name);
+	if (policy < 0)
+		return policy;
+
+	mutex_lock(&radio->mutex);
+	ret = kt0913_rt_set_sched(radio, policy, priority);
+	mutex_unlock(&radio->mutex);
+
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(rt_sched);
+
+static struct attribute *kt0913_attrs[] = {
+	&dev_attr_calibration.attr,
+	&dev_attr_i2c_budget.attr,
+	&dev_attr_rt_sched.attr,
+	NULL
+};
+
+static struct bin_attribute *kt0913_bin_attrs[] = {
+	&bin_attr_survey,
+	NULL
+};
+
+static const struct attribute_group kt0913_group = {
+	.attrs = kt0913_attrs,
+	.bin_attrs = kt0913_bin_attrs,
+};
+
+/*
+ * "stats" group: one value per file, served from the counters and the last
+ * samples of the monitor, so reading them never reaches the bus or waits
+ * for the mutex.
+ */
+
+static int kt0913_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a;
+	u32 y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* percentile of the last tunes, in us */
+static u32 kt0913_tune_percentile_us(struct kt0913_device *radio,
+	unsigned int pct)
+{
+	u32 hist[KT0913_TUNE_HIST_LEN];
+	unsigned int n;
+
+	spin_lock(&radio->stats_lock);
+	n = min_t(unsigned long, radio->tune_count, KT0913_TUNE_HIST_LEN);
+	memcpy(hist, radio->tune_hist_us, n * sizeof(*hist));
+	spin_unlock(&radio->stats_lock);
+
+	if (!n)
 		return 0;
-	default:
-		return -EINVAL;
-	}
+
+	sort(hist, n, sizeof(*hist), kt0913_cmp_u32, NULL);
+
+	return hist[DIV_ROUND_UP(n * pct, 100) - 1];
+}
+
+static u64 kt0913_tune_avg_us(struct kt0913_device *radio)
+{
+	unsigned long count;
+	u64 total;
+
+	spin_lock(&radio->stats_lock);
+	count = radio->tune_count;
+	total = radio->tune_total_ns;
+	spin_unlock(&radio->stats_lock);
+
+	return count ? div_u64(div_u64(total, count), NSEC_PER_USEC) : 0;
+}
+
+/* whole transfers left in the budget, negative if it's in debt */
+static s64 kt0913_budget_left(struct kt0913_device *radio)
+{
+	s64 tokens;
+
+	spin_lock(&radio->stats_lock);
+	if (radio->i2c_budget)
+		kt0913_budget_refill(radio, ktime_get_ns());
+	tokens = radio->budget_tokens;
+	spin_unlock(&radio->stats_lock);
+
+	return div_s64(tokens, 1000);
+}
+
+static u64 kt0913_pm_ms(struct kt0913_device *radio, bool standby)
+{
+	u64 ns;
+
+	spin_lock(&radio->stats_lock);
+	kt0913_pm_account(radio, ktime_get_ns());
+	ns = standby ? radio->pm_standby_ns : radio->pm_active_ns;
+	spin_unlock(&radio->stats_lock);
+
+	return div_u64(ns, NSEC_PER_MSEC);
 }
 
-/* ************************************************************************* */
+#define KT0913_STAT_ATTR(_name, _fmt, _val)				\
+static ssize_t _name##_show(struct device *dev,				\
+	struct device_attribute *attr, char *buf)			\
+{									\
+	struct kt0913_device *radio =					\
+		i2c_client_to_device(to_i2c_client(dev));		\
+									\
+	return scnprintf(buf, PAGE_SIZE, _fmt "\n", _val);		\
+}									\
+static DEVICE_ATTR_RO(_name)
+
+KT0913_STAT_ATTR(band, "%s",
+	READ_ONCE(radio->core.band) == BAND_AM ? "am" : "fm");
+KT0913_STAT_ATTR(frequency_khz, "%u", READ_ONCE(radio->core.frequency));
+KT0913_STAT_ATTR(rssi_dbm, "%d", kt0913_raw_rssi_to_dbm(
+	READ_ONCE(radio->core.band), READ_ONCE(radio->monitor_rssi)));
+KT0913_STAT_ATTR(snr, "%u", READ_ONCE(radio->monitor_snr));
+KT0913_STAT_ATTR(tune_count, "%lu", READ_ONCE(radio->tune_count));
+KT0913_STAT_ATTR(seek_count, "%lu", READ_ONCE(radio->seek_count));
+KT0913_STAT_ATTR(tune_avg_us, "%llu", kt0913_tune_avg_us(radio));
+KT0913_STAT_ATTR(tune_p99_us, "%u", kt0913_tune_percentile_us(radio, 99));
+KT0913_STAT_ATTR(i2c_errors, "%lu", READ_ONCE(radio->i2c_errors));
+KT0913_STAT_ATTR(i2c_retries, "%lu", READ_ONCE(radio->i2c_retries));
+KT0913_STAT_ATTR(resets, "%lu", READ_ONCE(radio->resets));
+KT0913_STAT_ATTR(i2c_ops, "%lu", READ_ONCE(radio->i2c_ops));
+KT0913_STAT_ATTR(i2c_background_ops, "%lu",
+	READ_ONCE(radio->i2c_background_ops));
+KT0913_STAT_ATTR(i2c_throttled, "%lu", READ_ONCE(radio->i2c_throttled));
+KT0913_STAT_ATTR(i2c_budget_left, "%lld", kt0913_budget_left(radio));
+KT0913_STAT_ATTR(active_ms, "%llu", kt0913_pm_ms(radio, false));
+KT0913_STAT_ATTR(standby_ms, "%llu", kt0913_pm_ms(radio, true));
+
+static struct attribute *kt0913_stats_attrs[] = {
+	&dev_attr_band.attr,
+	&dev_attr_frequency_khz.attr,
+	&dev_attr_rssi_dbm.attr,
+	&dev_attr_snr.attr,
+	&dev_attr_tune_count.attr,
+	&dev_attr_seek_count.attr,
+	&dev_attr_tune_avg_us.attr,
+	&dev_attr_tune_p99_us.attr,
+	&dev_attr_i2c_errors.attr,
+	&dev_attr_i2c_retries.attr,
+	&dev_attr_resets.attr,
+	&dev_attr_i2c_ops.attr,
+	&dev_attr_i2c_background_ops.attr,
+	&dev_attr_i2c_throttled.attr,
+	&dev_attr_i2c_budget_left.attr,
+	&dev_attr_active_ms.attr,
+	&dev_attr_standby_ms.attr,
+	NULL
+};
 
-/* V4L2 vidioc */
-static int kt0913_ioctl_vidioc_querycap(struct file *file, void *priv,
-	struct v4l2_capability *capability)
-{
-	struct kt0913_device *radio = video_drvdata(file);
-	struct video_device *dev;
+static const struct attribute_group kt0913_stats_group = {
+	.name = "stats",
+	.attrs = kt0913_stats_attrs,
+};
 
-	if (!radio)
-		return -ENODEV;
+static const struct attribute_group *kt0913_groups[] = {
+	&kt0913_group,
+	&kt0913_stats_group,
+	NULL
+};
 
-	dev = &radio->vdev;
+/* ************************************************************************* */
 
-	if (!dev)
-		return -ENODEV;
+static int kt0913_ioctl_stats_show(struct seq_file *s, void *unused)
+{
+	struct kt0913_device *radio = s->private;
+	struct kt0913_ioctl_stat stat;
+	unsigned int i;
+
+	seq_puts(s, "ioctl count avg_us max_us slow\n");
+
+	for (i = 0; i < KT0913_IOCTL_STAT_COUNT; i++) {
+		spin_lock(&radio->stats_lock);
+		stat = radio->ioctl_stats[i];
+		spin_unlock(&radio->stats_lock);
+
+		if (!stat.count)
+			continue;
+
+		seq_printf(s, "%s %llu %llu %llu %llu\n",
+			i < ARRAY_SIZE(kt0913_ioctl_descs) ?
+			kt0913_ioctl_descs[i].name : "other",
+			stat.count,
+			div64_u64(stat.total_ns, stat.count) / NSEC_PER_USEC,
+			div_u64(stat.max_ns, NSEC_PER_USEC), stat.slow);
+	}
 
-	strscpy(capability->driver, KT0913_FM_AM_DRIVER_NAME,
-		sizeof(capability->driver));
-	strscpy(capability->card, dev->name, sizeof(capability->card));
-	snprintf(capability->bus_info, sizeof(capability->bus_info),
-		"I2C:%s", dev_name(&dev->dev));
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(kt0913_ioctl_stats);
+
+static const char * const kt0913_op_names[KT0913_OP_COUNT] = {
+	[KT0913_OP_INIT] = "init",
+	[KT0913_OP_S_FREQUENCY] = "s_frequency",
+	[KT0913_OP_G_TUNER] = "g_tuner",
+	[KT0913_OP_BAND_SWITCH] = "band_switch",
+	[KT0913_OP_TUNE] = "tune",
+	[KT0913_OP_SEEK] = "seek",
+	[KT0913_OP_SCAN] = "scan",
+};
 
-static int kt0913_ioctl_vidioc_g_tuner(struct file *file, void *priv,
-	struct v4l2_tuner *v)
+/* the ioctl running an operation, to tell the time spent on the mutex */
+static const unsigned int kt0913_op_ioctls[KT0913_OP_COUNT] = {
+	[KT0913_OP_S_FREQUENCY] = VIDIOC_S_FREQUENCY,
+	[KT0913_OP_G_TUNER] = VIDIOC_G_TUNER,
+	[KT0913_OP_SEEK] = VIDIOC_S_HW_FREQ_SEEK,
+};
+
+/*
+ * per operation averages. other is the wall time left once the bus and chip
+ * waits are taken out: CPU, but also preemption and the other sleeps. lock
+ * is the ioctl latency not spent in the operation. the largest of them is
+ * what bounds the operation.
+ */
+static int kt0913_op_stats_show(struct seq_file *s, void *unused)
 {
-	struct kt0913_device *radio = video_drvdata(file);
-	int ret;
-	int stereo_enabled;
-	int is_stereo;
+	static const char * const bounds[] = { "bus", "chip", "other", "lock" };
+	struct kt0913_device *radio = s->private;
+	struct kt0913_ioctl_stat ioctl;
+	struct kt0913_op_stat stat;
+	u64 avg[ARRAY_SIZE(bounds)];
+	u64 total, ioctl_avg;
+	unsigned int i, j, bound;
+
+	seq_puts(s, "op count xfers avg_us bus_us chip_us other_us lock_us bound\n");
+
+	for (i = 0; i < KT0913_OP_COUNT; i++) {
+		memset(&ioctl, 0, sizeof(ioctl));
+		spin_lock(&radio->stats_lock);
+		stat = radio->op_stats[i];
+		if (kt0913_op_ioctls[i])
+			ioctl = radio->ioctl_stats[
+				kt0913_ioctl_index(kt0913_op_ioctls[i])];
+		spin_unlock(&radio->stats_lock);
+
+		if (!stat.count)
+			continue;
+
+		total = div64_u64(stat.total_ns, stat.count);
+		avg[0] = div64_u64(stat.bus_ns, stat.count);
+		avg[1] = div64_u64(stat.chip_ns, stat.count);
+		avg[2] = total - min(total, avg[0] + avg[1]);
+		ioctl_avg = ioctl.count ?
+			div64_u64(ioctl.total_ns, ioctl.count) : 0;
+		avg[3] = ioctl_avg - min(ioctl_avg, total);
+
+		bound = 0;
+		for (j = 1; j < ARRAY_SIZE(bounds); j++)
+			if (avg[j] > avg[bound])
+				bound = j;
+
+		seq_printf(s, "%s %llu %llu %llu %llu %llu %llu %llu %s\n",
+			kt0913_op_names[i], stat.count,
+			div64_u64(stat.xfers, stat.count),
+			div_u64(total, NSEC_PER_USEC),
+			div_u64(avg[0], NSEC_PER_USEC),
+			div_u64(avg[1], NSEC_PER_USEC),
+			div_u64(avg[2], NSEC_PER_USEC),
+			div_u64(avg[3], NSEC_PER_USEC), bounds[bound]);
+	}
 
-	if (v->index != 0)
-		return -EINVAL;
+	return 0;
+}
 
-	strscpy(v->name, "FM/AM", sizeof(v->name));
-	v->type = V4L2_TUNER_RADIO;
+static int kt0913_op_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, kt0913_op_stats_show, inode->i_private);
+}
 
-	v->capability = V4L2_TUNER_CAP_LOW | V4L2_TUNER_CAP_STEREO |
-		V4L2_TUNER_CAP_FREQ_BANDS;
+/* any write starts a new run, ioctl_stats keeps counting */
+static ssize_t kt0913_op_stats_write(struct file *file,
+	const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct kt0913_device *radio =
+		((struct seq_file *)file->private_data)->private;
 
-	v->rangelow = kt0913_bands[BAND_AM].rangelow;
-	v->rangehigh = kt0913_bands[BAND_FM].rangehigh;
+	spin_lock(&radio->stats_lock);
+	memset(radio->op_stats, 0, sizeof(radio->op_stats));
+	spin_unlock(&radio->stats_lock);
 
-	if (radio->band == BAND_AM) {
-		v->rxsubchans = V4L2_TUNER_SUB_MONO;
-		v->audmode = V4L2_TUNER_MODE_MONO;
+	return count;
+}
 
-		ret = __kt0913_get_am_rssi(radio, &v->signal);
-		if (ret)
-			return ret;
-	} else {
-		ret = __kt0913_get_cfg_stereo_enabled(radio, &stereo_enabled);
-		if (ret)
-			return ret;
+static const struct file_operations kt0913_op_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = kt0913_op_stats_open,
+	.read = seq_read,
+	.write = kt0913_op_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
 
-		v->rxsubchans = stereo_enabled ?
-			V4L2_TUNER_SUB_STEREO : V4L2_TUNER_SUB_MONO;
+static int kt0913_pm_stats_show(struct seq_file *s, void *unused)
+{
+	struct kt0913_device *radio = s->private;
+	u32 hist[KT0913_PM_HIST_BUCKETS];
+	unsigned long suspends, resumes;
+	u64 active, standby, total, max;
+	unsigned int i;
+
+	spin_lock(&radio->stats_lock);
+	kt0913_pm_account(radio, ktime_get_ns());
+	active = radio->pm_active_ns;
+	standby = radio->pm_standby_ns;
+	suspends = radio->pm_suspends;
+	resumes = radio->pm_resumes;
+	total = radio->pm_resume_total_ns;
+	max = radio->pm_resume_max_ns;
+	memcpy(hist, radio->pm_resume_hist, sizeof(hist));
+	spin_unlock(&radio->stats_lock);
+
+	seq_printf(s, "state %s\n", radio->pm_standby ? "standby" : "active");
+	seq_printf(s, "active_ms %llu\n", div_u64(active, NSEC_PER_MSEC));
+	seq_printf(s, "standby_ms %llu\n", div_u64(standby, NSEC_PER_MSEC));
+	seq_printf(s, "suspends %lu\n", suspends);
+	seq_printf(s, "resumes %lu\n", resumes);
+	seq_printf(s, "resume_avg_us %llu\n", resumes ?
+		div_u64(div_u64(total, resumes), NSEC_PER_USEC) : 0);
+	seq_printf(s, "resume_max_us %llu\n", div_u64(max, NSEC_PER_USEC));
+
+	/* bucket N counts resumes of [2^(N-1), 2^N) ms */
+	seq_printf(s, "resume_hist_ms <1:%u", hist[0]);
+	for (i = 1; i < KT0913_PM_HIST_BUCKETS - 1; i++)
+		seq_printf(s, " <%u:%u", 1U << i, hist[i]);
+	seq_printf(s, " >=%u:%u\n", 1U << (KT0913_PM_HIST_BUCKETS - 2),
+		hist[KT0913_PM_HIST_BUCKETS - 1]);
 
-		ret = __kt0913_get_rx_stereo_or_mono(radio, &is_stereo);
-		if (ret)
-			return ret;
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kt0913_pm_stats);
 
-		v->audmode = is_stereo ?
-			V4L2_TUNER_MODE_STEREO : V4L2_TUNER_MODE_MONO;
+static const char * const kt0913_rt_op_names[KT0913_RT_OP_COUNT] = {
+	[KT0913_RT_VTUNER] = "vtuner",
+};
 
-		ret = __kt0913_get_fm_rssi(radio, &v->signal);
-		if (ret)
-			return ret;
+static int kt0913_rt_jitter_show(struct seq_file *s, void *unused)
+{
+	struct kt0913_device *radio = s->private;
+	struct kt0913_rt_stat stats[KT0913_RT_OP_COUNT];
+	struct kt0913_rt_stat *stat;
+	unsigned int i, j;
+
+	spin_lock(&radio->stats_lock);
+	memcpy(stats, radio->rt_stats, sizeof(stats));
+	spin_unlock(&radio->stats_lock);
+
+	seq_printf(s, "sched %s %u\n",
+		kt0913_rt_policy_name(READ_ONCE(radio->rt_policy)),
+		READ_ONCE(radio->rt_priority));
+
+	for (i = 0; i < KT0913_RT_OP_COUNT; i++) {
+		stat = &stats[i];
+		seq_printf(s, "%s_wakeups %lu\n", kt0913_rt_op_names[i],
+			stat->wakeups);
+		seq_printf(s, "%s_late_avg_us %llu\n", kt0913_rt_op_names[i],
+			stat->wakeups ? div_u64(div_u64(stat->late_total_ns,
+			stat->wakeups), NSEC_PER_USEC) : 0);
+		seq_printf(s, "%s_late_max_us %llu\n", kt0913_rt_op_names[i],
+			div_u64(stat->late_max_ns, NSEC_PER_USEC));
+
+		/* bucket N counts wakeups [2^(N-1), 2^N) us late */
+		seq_printf(s, "%s_late_hist_us <1:%u", kt0913_rt_op_names[i],
+			stat->hist[0]);
+		for (j = 1; j < KT0913_RT_HIST_BUCKETS - 1; j++)
+			seq_printf(s, " <%u:%u", 1U << j, stat->hist[j]);
+		seq_printf(s, " >=%u:%u\n", 1U << (KT0913_RT_HIST_BUCKETS - 2),
+			stat->hist[KT0913_RT_HIST_BUCKETS - 1]);
 	}
 
-	/* AFC is enabled and active by default */
-	v->afc = 1;
-
 	return 0;
 }
 
-static int kt0913_ioctl_vidioc_s_tuner(struct file *file, void *priv,
-	const struct v4l2_tuner *v)
+static int kt0913_rt_jitter_open(struct inode *inode, struct file *file)
 {
-	struct kt0913_device *radio = video_drvdata(file);
-
-	if (v->index != 0)
-		return -EINVAL;
+	return single_open(file, kt0913_rt_jitter_show, inode->i_private);
+}
 
-	/* only mono and stereo are supported */
-	if (v->audmode != V4L2_TUNER_MODE_MONO &&
-		v->audmode != V4L2_TUNER_MODE_STEREO)
-		return 0;
+/* any write clears it, e.g. before loading the system */
+static ssize_t kt0913_rt_jitter_write(struct file *file,
+	const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct kt0913_device *radio =
+		((struct seq_file *)file->private_data)->private;
 
-	/* AM is mono only, so don't try to set it to stereo */
-	if (radio->band == BAND_AM && v->audmode != V4L2_TUNER_MODE_MONO)
-		return 0;
+	spin_lock(&radio->stats_lock);
+	memset(radio->rt_stats, 0, sizeof(radio->rt_stats));
+	spin_unlock(&radio->stats_lock);
 
-	/* set to stereo if specified, otherwise set to mono */
-	return __kt0913_set_cfg_stereo_enabled(radio,
-		v->audmode == V4L2_TUNER_MODE_STEREO);
+	return count;
 }
 
-static int kt0913_s_ctrl(struct v4l2_ctrl *ctrl)
+static const struct file_operations kt0913_rt_jitter_fops = {
+	.owner = THIS_MODULE,
+	.open = kt0913_rt_jitter_open,
+	.read = seq_read,
+	.write = kt0913_rt_jitter_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int kt0913_monitor_show(struct seq_file *s, void *unused)
 {
-	struct kt0913_device *radio = v4l2_ctrl_to_device(ctrl);
+	struct kt0913_device *radio = s->private;
+	unsigned int interval;
+
+	mutex_lock(&radio->mutex);
+
+	interval = READ_ONCE(radio->monitor_interval_ms);
+	seq_printf(s, "interval_ms %u\n", interval);
+	/* nominal rate, the deferrable timer may run it less often */
+	seq_printf(s, "rate_hz %u.%03u\n", 1000 / interval,
+		1000000 / interval % 1000);
+	seq_printf(s, "wakeups_per_sec %u.%03u\n",
+		radio->monitor_rate_mhz / 1000, radio->monitor_rate_mhz % 1000);
+	seq_printf(s, "samples %lu\n", radio->monitor_samples);
+	seq_printf(s, "rssi %u\n", radio->monitor_rssi);
+	seq_printf(s, "squelch %u %s\n", radio->squelch,
+		radio->squelched ? "closed" : "open");
+	seq_printf(s, "resets %lu\n", radio->resets);
+
+	mutex_unlock(&radio->mutex);
 
-	switch (ctrl->id) {
-	case V4L2_CID_AUDIO_MUTE:
-		return __kt0913_set_mute(radio, ctrl->val);
-	case V4L2_CID_AUDIO_VOLUME:
-		return __kt0913_set_volume(radio, ctrl->val);
-	case V4L2_CID_GAIN:
-		return __kt0913_set_au_gain(radio, ctrl->val);
-	case V4L2_CID_TUNE_DEEMPHASIS:
-		return __kt0913_set_deemphasis(radio, ctrl->val);
-	default:
-		return -EINVAL;
-	}
+	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(kt0913_monitor);
 
-static int kt0913_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
+static int kt0913_amcali_show(struct seq_file *s, void *unused)
 {
-	struct kt0913_device *radio = v4l2_ctrl_to_device(ctrl);
+	struct kt0913_device *radio = s->private;
+	unsigned int i;
+
+	mutex_lock(&radio->mutex);
+
+	seq_puts(s, "from_khz cap_index\n");
+	for (i = 0; i < KT0913_AMCALI_BINS; i++)
+		if (radio->core.amcali_valid & BIT(i))
+			seq_printf(s, "%u %u\n",
+				KT0913_AM_RANGE_LOW + i * KT0913_AMCALI_BIN_KHZ,
+				radio->core.amcali[i]);
+
+	seq_printf(s, "hits %lu\n", radio->core.amcali_hits);
+	seq_printf(s, "misses %lu\n", radio->core.amcali_misses);
+	/* AM seek/scan tunes, which wait for the tune to complete */
+	for (i = 0; i < 2; i++)
+		seq_printf(s, "tune_%s %lu avg_us %llu\n",
+			i ? "preloaded" : "uncalibrated",
+			radio->amtune_count[i], radio->amtune_count[i] ?
+			div_u64(div_u64(radio->amtune_total_ns[i],
+			radio->amtune_count[i]), NSEC_PER_USEC) : 0);
+
+	mutex_unlock(&radio->mutex);
 
-	switch (ctrl->id) {
-	case V4L2_CID_RF_TUNER_PLL_LOCK:
-		return __kt0913_get_pll_status(radio, &ctrl->val);
-	default:
-		return -EINVAL;
-	}
+	return 0;
 }
 
-static const struct v4l2_ctrl_ops kt0913_ctrl_ops = {
-	.s_ctrl = kt0913_s_ctrl,
-	.g_volatile_ctrl = kt0913_g_volatile_ctrl,
-};
+static int kt0913_amcali_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, kt0913_amcali_show, inode->i_private);
+}
 
-/* ************************************************************************* */
+/* any write drops the calibrations kept, e.g. after moving the antenna */
+static ssize_t kt0913_amcali_write(struct file *file,
+	const char __user *buf, size_t count, loff_t *ppos)
+{
+	struct kt0913_device *radio =
+		((struct seq_file *)file->private_data)->private;
 
-/* File system interface (use the ancillary fops for v4l2) */
-static const struct v4l2_file_operations kt0913_radio_fops = {
+	mutex_lock(&radio->mutex);
+	kt0913_core_amcali_drop(&radio->core);
+	mutex_unlock(&radio->mutex);
+
+	return count;
+}
+
+static const struct file_operations kt0913_amcali_fops = {
 	.owner = THIS_MODULE,
-	.open = v4l2_fh_open,
-	.release = v4l2_fh_release,
-	.poll = v4l2_ctrl_poll,
-	.unlocked_ioctl = video_ioctl2,
+	.open = kt0913_amcali_open,
+	.read = seq_read,
+	.write = kt0913_amcali_write,
+	.llseek = seq_lseek,
+	.release = single_release,
 };
 
-/* ioctl ops */
-static const struct v4l2_ioctl_ops kt0913_ioctl_ops = {
-	.vidioc_querycap = kt0913_ioctl_vidioc_querycap,
-	.vidioc_g_tuner = kt0913_ioctl_vidioc_g_tuner,
-	.vidioc_s_tuner = kt0913_ioctl_vidioc_s_tuner,
-	.vidioc_g_frequency = kt0913_ioctl_vidioc_g_frequency,
-	.vidioc_s_frequency = kt0913_ioctl_vidioc_s_frequency,
-	.vidioc_enum_freq_bands = kt0913_ioctl_vidioc_enum_freq_bands,
-	/* use ancillary functions for these: */
-	.vidioc_log_status = v4l2_ctrl_log_status,
-	.vidioc_subscribe_event = v4l2_ctrl_subscribe_event,
-	.vidioc_unsubscribe_event = v4l2_event_unsubscribe,
-};
+/*
+ * how long the tune sequences kept the bus from the other devices, and the
+ * spread of the tune latency it buys (p99 - p50 of the last tunes)
+ */
+static int kt0913_bus_hold_show(struct seq_file *s, void *unused)
+{
+	struct kt0913_device *radio = s->private;
+	unsigned long holds, yields;
+	u64 total, max;
+	u32 p50, p99;
+
+	spin_lock(&radio->stats_lock);
+	holds = radio->bus_holds;
+	yields = radio->bus_yields;
+	total = radio->bus_hold_total_ns;
+	max = radio->bus_hold_max_ns;
+	spin_unlock(&radio->stats_lock);
+
+	p50 = kt0913_tune_percentile_us(radio, 50);
+	p99 = kt0913_tune_percentile_us(radio, 99);
+
+	seq_printf(s, "hold_limit_us %u\n", READ_ONCE(kt0913_bus_hold_us));
+	seq_printf(s, "holds %lu\n", holds);
+	seq_printf(s, "yields %lu\n", yields);
+	seq_printf(s, "hold_avg_us %llu\n", holds ?
+		div_u64(div_u64(total, holds), NSEC_PER_USEC) : 0);
+	seq_printf(s, "hold_max_us %llu\n", div_u64(max, NSEC_PER_USEC));
+	seq_printf(s, "tune_p50_us %u\n", p50);
+	seq_printf(s, "tune_p99_us %u\n", p99);
+	seq_printf(s, "tune_jitter_us %u\n", p99 - p50);
 
-/* V4L2 RADIO device structure */
-static struct video_device kt0913_radio_template = {
-	.name = KT0913_FM_AM_DRIVER_NAME,
-	.fops = &kt0913_radio_fops,
-	.ioctl_ops = &kt0913_ioctl_ops,
-	.release = video_device_release_empty,
-	.vfl_dir = VFL_DIR_RX,
-	.device_caps = V4L2_CAP_TUNER | V4L2_CAP_RADIO,
-};
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kt0913_bus_hold);
+
+/* one directory per instance, under the driver's one */
+static void kt0913_debugfs_init(struct kt0913_device *radio)
+{
+	radio->debugfs = debugfs_create_dir(dev_name(&radio->client->dev),
+		kt0913_debugfs_root);
+
+	debugfs_create_file("ioctl_stats", 0444, radio->debugfs, radio,
+		&kt0913_ioctl_stats_fops);
+	debugfs_create_u32("reg_mismatches", 0444, radio->debugfs,
+		&radio->reg_mismatches);
+	debugfs_create_file("pm_stats", 0444, radio->debugfs, radio,
+		&kt0913_pm_stats_fops);
+	debugfs_create_file("monitor", 0444, radio->debugfs, radio,
+		&kt0913_monitor_fops);
+	debugfs_create_file("amcali", 0644, radio->debugfs, radio,
+		&kt0913_amcali_fops);
+	debugfs_create_file("op_stats", 0644, radio->debugfs, radio,
+		&kt0913_op_stats_fops);
+	debugfs_create_file("bus_hold", 0444, radio->debugfs, radio,
+		&kt0913_bus_hold_fops);
+	debugfs_create_u32("bus_delay_us", 0644, radio->debugfs,
+		&radio->bus_delay_us);
+	debugfs_create_file("rt_jitter", 0644, radio->debugfs, radio,
+		&kt0913_rt_jitter_fops);
+}
 
 /* ************************************************************************* */
 
@@ -907,6 +4881,62 @@ static const struct of_device_id kt0913_of_match[] = {
 MODULE_DEVICE_TABLE(of, kt0913_of_match);
 #endif /* IS_ENABLED(CONFIG_OF) */
 
+/*
+ * boot band, frequency, volume and mute. the frequency picks the band and
+ * must agree with ktm,default-band if both are there. anything invalid
+ * falls back to 86MHz FM, 0dB and muted.
+ */
+static void __kt0913_parse_dt_defaults(struct kt0913_device *radio)
+{
+	struct device_node *np = radio->client->dev.of_node;
+	const char *name;
+	bool am = false;
+	u32 khz, mute;
+	s32 volume;
+
+	if (!of_property_read_string(np, "ktm,default-band", &name)) {
+		if (!strcmp(name, "am"))
+			am = true;
+		else if (strcmp(name, "fm"))
+			v4l2_warn(radio->client,
+				"Invalid ktm,default-band %s, using fm", name);
+	}
+
+	radio->default_band = am ? BAND_AM : BAND_FM;
+	radio->default_khz = am ? KT0913_AM_DEFAULT : KT0913_FM_DEFAULT;
+
+	if (!of_property_read_u32(np, "ktm,default-frequency-khz", &khz)) {
+		unsigned int band;
+
+		if (!kt0913_find_band(khz_to_v4l2_freq(khz),
+			radio->use_campus_band, &band) ||
+			khz < kt0913_band_limits[band].low ||
+			khz > kt0913_band_limits[band].high ||
+			(band == BAND_AM) != am) {
+			v4l2_warn(radio->client,
+				"Invalid ktm,default-frequency-khz %u, using %u",
+				khz, radio->default_khz);
+		} else {
+			radio->default_band = band;
+			radio->default_khz = khz;
+		}
+	}
+
+	radio->default_volume = 0;
+	if (!of_property_read_s32(np, "ktm,default-volume", &volume)) {
+		if (volume < -60 || volume > 0)
+			v4l2_warn(radio->client,
+				"Invalid ktm,default-volume %d, using 0", volume);
+		else
+			radio->default_volume = rounddown(volume + 60, 2) - 60;
+	}
+
+	/* muted unless told otherwise, as it always was */
+	radio->default_mute = true;
+	if (!of_property_read_u32(np, "ktm,default-mute", &mute))
+		radio->default_mute = mute;
+}
+
 static void __kt0913_parse_dt(struct kt0913_device *radio)
 {
 	const void *ptr_anti_pop = of_get_property(radio->client->dev.of_node,
@@ -914,6 +4944,11 @@ static void __kt0913_parse_dt(struct kt0913_device *radio)
 	const void *ptr_refclk = of_get_property(radio->client->dev.of_node,
 		"ktm,refclk", NULL);
 
+	/* the module parameter is the default for every instance */
+	radio->use_campus_band = kt0913_use_campus_band ||
+		of_property_read_bool(radio->client->dev.of_node,
+			"ktm,campus-band");
+
 	if (ptr_anti_pop) {
 		radio->audio_anti_pop =
 			clamp(be32_to_cpup(ptr_anti_pop), 0U, 3U);
@@ -931,6 +4966,8 @@ static void __kt0913_parse_dt(struct kt0913_device *radio)
 		v4l2_warn(radio->client,
 			"No ktm,refclk on dt node, using default");
 	}
+
+	__kt0913_parse_dt_defaults(radio);
 }
 
 /* ************************************************************************* */
@@ -941,8 +4978,10 @@ static int kt0913_probe(struct i2c_client *client,
 	struct kt0913_device *radio;
 	struct v4l2_device *v4l2_dev;
 	struct v4l2_ctrl_handler *hdl;
+	const struct regmap_bus *bus;
+	struct regmap_config regmap_config;
 	struct regmap *regmap;
-	int ret;
+	int policy, ret;
 
 	pr_debug("%s\n", __func__);
 
@@ -964,7 +5003,7 @@ static int kt0913_probe(struct i2c_client *client,
 
 	/* check if the CHIP ID register value matches the expected value */
 	if (ret != KT0913_CHIP_ID) {
-		v4l2_err(radio->client,
+		v4l2_err(client,
 			"Invalid CHIP ID: 0x%x, expected 0x%x", ret, KT0913_CHIP_ID);
 		return -ENODEV;
 	}
@@ -983,18 +5022,35 @@ static int kt0913_probe(struct i2c_client *client,
 	if (ret < 0) {
 		v4l2_err(client,
 			"could not register v4l2_dev\n");
-		goto errfr;
+		return ret;
 	}
 
 	mutex_init(&radio->mutex);
+	mutex_init(&radio->io_lock);
+	spin_lock_init(&radio->stats_lock);
+	INIT_LIST_HEAD(&radio->list);
+	INIT_WORK(&radio->survey_work, kt0913_survey_work);
+	INIT_LIST_HEAD(&radio->vtuners);
+	kthread_init_work(&radio->vtuner_work, kt0913_vtuner_work);
+	hrtimer_init(&radio->vtuner_timer, CLOCK_MONOTONIC,
+		HRTIMER_MODE_ABS_HARD);
+	radio->vtuner_timer.function = kt0913_vtuner_timer;
+	INIT_DEFERRABLE_WORK(&radio->monitor_work, kt0913_monitor_work);
+	INIT_DELAYED_WORK(&radio->tune_done_work, kt0913_tune_done_work);
+	radio->core.ops = &kt0913_regmap_core_ops;
+	radio->core.amcali_cache = &kt0913_am_cali_cache;
+
+	/* the DT gives the defaults of some controls */
+	radio->client = client;
+	__kt0913_parse_dt(radio);
 
 	/* register the control handler from the context struct */
 	hdl = &radio->ctrl_handler;
-	v4l2_ctrl_handler_init(hdl, 5);
+	v4l2_ctrl_handler_init(hdl, 11);
 
 	/* add the control: Mute */
 	radio->ctrl_mute = v4l2_ctrl_new_std(hdl, &kt0913_ctrl_ops,
-		V4L2_CID_AUDIO_MUTE, 0, 1, 1, 0);
+		V4L2_CID_AUDIO_MUTE, 0, 1, 1, radio->default_mute);
 	if (hdl->error) {
 		ret = hdl->error;
 		v4l2_err(v4l2_dev, "Could not register control: mute\n");
@@ -1003,7 +5059,7 @@ static int kt0913_probe(struct i2c_client *client,
 
 	/* add the control: Volume */
 	radio->ctrl_volume = v4l2_ctrl_new_std(hdl, &kt0913_ctrl_ops,
-		V4L2_CID_AUDIO_VOLUME, -60, 0, 2, 0);
+		V4L2_CID_AUDIO_VOLUME, -60, 0, 2, radio->default_volume);
 	if (hdl->error) {
 		ret = hdl->error;
 		v4l2_err(v4l2_dev, "Could not register control: Volume\n");
@@ -1040,29 +5096,88 @@ static int kt0913_probe(struct i2c_client *client,
 		v4l2_err(v4l2_dev, "Could not register control: deemphasis\n");
 		goto errunreg;
 	}
-	/* the control handler is ready to be used */
+
+	/* add the control: squelch */
+	v4l2_ctrl_new_custom(hdl, &kt0913_ctrl_squelch, NULL);
+	if (hdl->error) {
+		ret = hdl->error;
+		v4l2_err(v4l2_dev, "Could not register control: squelch\n");
+		goto errunreg;
+	}
+
+	/* add the control: auto fine tuning, the handler isn't set up */
+	v4l2_ctrl_new_custom(hdl, &kt0913_ctrl_auto_fine_tune, NULL);
+	if (hdl->error) {
+		ret = hdl->error;
+		v4l2_err(v4l2_dev, "Could not register control: fine tuning\n");
+		goto errunreg;
+	}
+	radio->auto_fine_tune = kt0913_ctrl_auto_fine_tune.def;
+
+	/* add the controls: best station */
+	v4l2_ctrl_new_custom(hdl, &kt0913_ctrl_tune_best, NULL);
+	v4l2_ctrl_new_custom(hdl, &kt0913_ctrl_best_on_band_switch, NULL);
+	if (hdl->error) {
+		ret = hdl->error;
+		v4l2_err(v4l2_dev, "Could not register control: best station\n");
+		goto errunreg;
+	}
+
+	/* add the controls: channel spacing, applied by __kt0913_init() */
+	v4l2_ctrl_new_custom(hdl, &kt0913_ctrl_fm_spacing, NULL);
+	v4l2_ctrl_new_custom(hdl, &kt0913_ctrl_am_spacing, NULL);
+	if (hdl->error) {
+		ret = hdl->error;
+		v4l2_err(v4l2_dev, "Could not register control: spacing\n");
+		goto errunreg;
+	}
+	radio->fm_spacing = div_u64(
+		kt0913_fm_spacings[kt0913_ctrl_fm_spacing.def], 1000);
+	radio->am_spacing = div_u64(
+		kt0913_am_spacings[kt0913_ctrl_am_spacing.def], 1000);
+	/*
+	 * the control handler is ready to be used. it shares the mutex, so
+	 * controls set by a bridge through the subdev are serialized with the
+	 * monitor, the virtual tuners and the survey too. kt0913_fops_ioctl()
+	 * locks the node instead of the v4l2 core, which would take it twice.
+	 */
+	hdl->lock = &radio->mutex;
 	v4l2_dev->ctrl_handler = hdl;
 
 	radio->vdev = kt0913_radio_template;
-	radio->vdev.lock = &radio->mutex;
 	radio->vdev.v4l2_dev = v4l2_dev;
 	video_set_drvdata(&radio->vdev, radio);
 
-	radio->client = client;
-	i2c_set_clientdata(client, radio);
+	/* this also sets the client data to the subdev */
+	v4l2_i2c_subdev_init(&radio->sd, client, &kt0913_subdev_ops);
+	radio->sd.ctrl_handler = hdl;
 
 	/* init the regmap of the kt0913 */
-	regmap = devm_regmap_init_i2c(client, &kt0913_regmap_config);
+	radio->pm_changed_ns = ktime_get_ns();
+	radio->monitor_window_ns = radio->pm_changed_ns;
+	radio->stc_poll_us = KT0913_STC_POLL_US;
+	radio->stc_timeout_ms = KT0913_STC_TIMEOUT_MS;
+	radio->i2c_budget = kt0913_i2c_budget;
+	radio->budget_tokens = (s64)radio->i2c_budget * 1000;
+	radio->budget_ns = radio->pm_changed_ns;
+	radio->survey_cost = KT0913_BUDGET_CHANNEL_COST;
+
+	/* SMBus word transfers, one per register, if there's nothing better */
+	radio->i2c_bulk = i2c_check_functionality(client->adapter,
+		I2C_FUNC_I2C);
+	bus = radio->i2c_bulk ? &kt0913_regmap_bus : NULL;
+	regmap_config = kt0913_regmap_config;
+	regmap_config.lock_arg = radio;
+
+	regmap = devm_regmap_init(&client->dev, bus, radio, &regmap_config);
 	if (IS_ERR(regmap)) {
 		ret = PTR_ERR(regmap);
 		v4l2_err(client,
-			"devm_regmap_init_i2c() failed! %d", ret);
+			"devm_regmap_init() failed! %d", ret);
 		goto errunreg;
 	}
 	radio->regmap = regmap;
 
-	__kt0913_parse_dt(radio);
-
 	/* init the kt0913 into a known state */
 	ret = __kt0913_init(radio);
 	if (ret) {
@@ -1070,50 +5185,174 @@ static int kt0913_probe(struct i2c_client *client,
 			"__kt0913_init() failed! %d", ret);
 		goto errunreg;
 	}
+	/* the init tuned the boot channel, which is in the snapshot already */
+
+	/* a failed calibration keeps the default polling */
+	if (kt0913_calibrate)
+		__kt0913_calibrate(radio);
+
+	/* each chip scans its survey slices on its own queue */
+	radio->wq = alloc_ordered_workqueue("kt0913-%s", 0,
+		dev_name(&client->dev));
+	if (!radio->wq) {
+		ret = -ENOMEM;
+		goto errstdby;
+	}
+
+	/* and runs its timed operations on a worker of its own */
+	radio->rt_worker = kthread_create_worker(0, "kt0913-rt-%s",
+		dev_name(&client->dev));
+	if (IS_ERR(radio->rt_worker)) {
+		ret = PTR_ERR(radio->rt_worker);
+		goto errwq;
+	}
+
+	/* the worker starts with the normal policy, keep it if this fails */
+	policy = kt0913_rt_policy_parse(kt0913_rt_policy);
+	ret = policy < 0 ? policy :
+		kt0913_rt_set_sched(radio, policy, kt0913_rt_priority);
+	if (ret)
+		v4l2_warn(client,
+			"Could not set the %s %u scheduling (%d)",
+			kt0913_rt_policy, kt0913_rt_priority, ret);
 
 	pm_runtime_get_noresume(&client->dev);
+	radio->pm_held = true;
 	pm_runtime_set_active(&client->dev);
 	pm_runtime_enable(&client->dev);
 	pm_runtime_dont_use_autosuspend(&client->dev);
 
+	mutex_lock(&kt0913_device_list_lock);
+
+	/* join the merged node as another tuner, if there's one */
+	if (kt0913_single_node && kt0913_single_node_owner) {
+		ret = kt0913_tuner_attach(kt0913_single_node_owner, radio);
+		if (!ret)
+			goto listed;
+		v4l2_warn(client,
+			"Could not join the merged node (%d), using a new one", ret);
+	}
+
+	radio->tuners[0] = radio;
+	radio->n_tuners = 1;
+
+	/* virtual tuners only make sense on a node with a single chip */
+	radio->vtuners_enabled = kt0913_virtual_tuners && !kt0913_single_node;
+
 	ret = video_register_device(&radio->vdev,
 		VFL_TYPE_RADIO, kt0913_v4l2_radio_nr);
 	if (ret < 0) {
+		mutex_unlock(&kt0913_device_list_lock);
 		v4l2_err(client,
 			"Could not register video device!");
 		goto error_pm_disable;
 	}
 
+	if (kt0913_single_node && !kt0913_single_node_owner)
+		kt0913_single_node_owner = radio;
+
+listed:
+	list_add_tail(&radio->list, &kt0913_device_list);
+	mutex_unlock(&kt0913_device_list_lock);
+
+	kt0913_debugfs_init(radio);
+	kt0913_monitor_kick(radio);
+
+	ret = kt0913_register_component(radio);
+	if (ret)
+		v4l2_warn(client,
+			"Could not register the ASoC component (%d)", ret);
+	else
+		radio->component = true;
+
+	/* let bridges described on the firmware find the subdev */
+	if (dev_fwnode(&client->dev)) {
+		ret = v4l2_async_register_subdev(&radio->sd);
+		if (ret)
+			v4l2_warn(client,
+				"Could not register the async subdev (%d)", ret);
+		else
+			radio->sd_async = true;
+	}
+
 	v4l2_info(client, "registered.");
 	return 0;
 error_pm_disable:
 	pm_runtime_disable(&client->dev);
 	pm_runtime_set_suspended(&client->dev);
+	pm_runtime_put_noidle(&client->dev);
+	kthread_destroy_worker(radio->rt_worker);
+errwq:
+	destroy_workqueue(radio->wq);
+errstdby:
+	__kt0913_set_standby(radio, true);
 errunreg:
 	v4l2_ctrl_handler_free(hdl);
 	v4l2_device_unregister(v4l2_dev);
-errfr:
-	__kt0913_set_standby(radio, true);
-	kfree(radio);
 	return ret;
 }
 
 static int kt0913_remove(struct i2c_client *client)
 {
-	struct kt0913_device *radio = i2c_get_clientdata(client);
+	struct kt0913_device *radio = i2c_client_to_device(client);
+	unsigned int i;
 
 	pr_debug("%s\n", __func__);
 	if (!radio)
 		return -EINVAL;
 
-	__kt0913_set_standby(radio, true);
+	kt0913_unregister_component(radio);
+
+	if (radio->sd_async)
+		v4l2_async_unregister_subdev(&radio->sd);
+	else
+		v4l2_device_unregister_subdev(&radio->sd);
+
+	/* no new survey slices, the one in progress is drained with the wq */
+	mutex_lock(&kt0913_device_list_lock);
+	list_del(&radio->list);
+
+	if (radio->primary) {
+		kt0913_tuner_detach(radio);
+	} else if (radio == kt0913_single_node_owner) {
+		/* the other tuners are left without a node */
+		for (i = 1; i < radio->n_tuners; i++) {
+			if (!radio->tuners[i])
+				continue;
+			v4l2_warn(radio->tuners[i]->client,
+				"merged node is going away");
+			kt0913_tuner_detach(radio->tuners[i]);
+		}
+		kt0913_single_node_owner = NULL;
+	}
+	if (list_empty(&kt0913_device_list)) {
+		kt0913_survey_free(kt0913_last_survey);
+		kt0913_last_survey = NULL;
+	}
+	mutex_unlock(&kt0913_device_list_lock);
+
+	debugfs_remove_recursive(radio->debugfs);
 
+	/* no ioctls or resumes left that could queue work */
+	video_unregister_device(&radio->vdev);
 	pm_runtime_get_sync(&client->dev);
 	pm_runtime_disable(&client->dev);
 	pm_runtime_set_suspended(&client->dev);
 	pm_runtime_put_noidle(&client->dev);
+	if (radio->pm_held)
+		pm_runtime_put_noidle(&client->dev);
+
+	/* the survey may kick the monitor, cancel it after the survey */
+	flush_work(&radio->survey_work);
+	cancel_delayed_work_sync(&radio->monitor_work);
+	cancel_delayed_work_sync(&radio->tune_done_work);
+	destroy_workqueue(radio->wq);
+	WRITE_ONCE(radio->rt_stopped, true);
+	kt0913_rt_stop(&radio->vtuner_timer, &radio->vtuner_work);
+	kthread_destroy_worker(radio->rt_worker);
+
+	__kt0913_set_standby(radio, true);
 
-	video_unregister_device(&radio->vdev);
 	v4l2_ctrl_handler_free(&radio->ctrl_handler);
 	v4l2_device_unregister(&radio->v4l2_dev);
 
@@ -1126,7 +5365,7 @@ static int kt0913_remove(struct i2c_client *client)
 #ifdef CONFIG_PM
 static int kt0913_i2c_pm_runtime_suspend(struct device *dev)
 {
-	struct kt0913_device *radio = i2c_get_clientdata(to_i2c_client(dev));
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
 
 	pr_debug("%s\n", __func__);
 	if (!radio)
@@ -1137,13 +5376,19 @@ static int kt0913_i2c_pm_runtime_suspend(struct device *dev)
 
 static int kt0913_i2c_pm_runtime_resume(struct device *dev)
 {
-	struct kt0913_device *radio = i2c_get_clientdata(to_i2c_client(dev));
+	struct kt0913_device *radio = i2c_client_to_device(to_i2c_client(dev));
+
+	int ret;
 
 	pr_debug("%s\n", __func__);
 	if (!radio)
 		return 0;
 
-	return __kt0913_set_standby(radio, false);
+	ret = __kt0913_wake(radio);
+	if (!ret)
+		kt0913_monitor_kick(radio);
+
+	return ret;
 }
 #endif /* CONFIG_PM */
 
@@ -1163,12 +5408,33 @@ static struct i2c_driver kt0913_driver = {
 		.name = "kt0913",
 		.of_match_table = of_match_ptr(kt0913_of_match),
 		.pm = &kt0913_i2c_pm_ops,
+		.dev_groups = kt0913_groups,
 	},
 	.probe = kt0913_probe,
 	.remove = kt0913_remove,
 	.id_table = kt0913_idtable,
 };
-module_i2c_driver(kt0913_driver);
+
+static int __init kt0913_module_init(void)
+{
+	int ret;
+
+	kt0913_debugfs_root = debugfs_create_dir("radio-kt0913", NULL);
+
+	ret = i2c_add_driver(&kt0913_driver);
+	if (ret)
+		debugfs_remove_recursive(kt0913_debugfs_root);
+
+	return ret;
+}
+module_init(kt0913_module_init);
+
+static void __exit kt0913_module_exit(void)
+{
+	i2c_del_driver(&kt0913_driver);
+	debugfs_remove_recursive(kt0913_debugfs_root);
+}
+module_exit(kt0913_module_exit);
 
 MODULE_AUTHOR("Santiago Hormazabal <santiagohssl@gmail.com>");
 MODULE_DESCRIPTION("KTMicro KT0913 AM/FM receiver");
@@ -1176,6 +5442,26 @@ MODULE_LICENSE("GPL");
 MODULE_VERSION("0.0.1");
 
 module_param(kt0913_use_campus_band, int, 0);
-MODULE_PARM_DESC(kt0913_use_campus_band, "Use the Campus Band feature (FM range 32MHz-110MHz)");
+MODULE_PARM_DESC(kt0913_use_campus_band, "Use the Campus Band feature (FM range 32MHz-110MHz) on every instance");
+module_param(kt0913_single_node, int, 0);
+MODULE_PARM_DESC(kt0913_single_node, "Present every kt0913 as a tuner index of a single radio node");
+module_param(kt0913_virtual_tuners, int, 0);
+MODULE_PARM_DESC(kt0913_virtual_tuners, "Give each open file handle its own time-sliced virtual tuner");
 module_param(kt0913_v4l2_radio_nr, int, 0);
-MODULE_PARM_DESC(kt0913_v4l2_radio_nr, "v4l2 device number to use (i.e. /dev/radioX)");
\ No newline at end of file
+MODULE_PARM_DESC(kt0913_v4l2_radio_nr, "v4l2 device number to use (i.e. /dev/radioX)");
+module_param(kt0913_slow_ioctl_ms, uint, 0644);
+MODULE_PARM_DESC(kt0913_slow_ioctl_ms, "Report ioctls that take longer than this, in ms (0 = off)");
+module_param(kt0913_check_regs, bool, 0644);
+MODULE_PARM_DESC(kt0913_check_regs, "Compare the register cache against the chip after every setter ioctl");
+module_param(kt0913_am_cali_cache, bool, 0644);
+MODULE_PARM_DESC(kt0913_am_cali_cache, "Preload the AM antenna calibration found before on the same sub-range");
+module_param(kt0913_calibrate, bool, 0644);
+MODULE_PARM_DESC(kt0913_calibrate, "Measure the chip at probe and derive the tune polling and timeouts from it");
+module_param(kt0913_bus_hold_us, uint, 0644);
+MODULE_PARM_DESC(kt0913_bus_hold_us, "Longest time a tune sequence keeps the I2C bus, in us (0 = don't keep it)");
+module_param(kt0913_i2c_budget, uint, 0644);
+MODULE_PARM_DESC(kt0913_i2c_budget, "Default I2C transfers per second of the background work (0 = no limit)");
+module_param(kt0913_rt_policy, charp, 0644);
+MODULE_PARM_DESC(kt0913_rt_policy, "Default scheduling policy of the virtual tuner slices: normal (default), fifo or rr");
+module_param(kt0913_rt_priority, uint, 0644);
+MODULE_PARM_DESC(kt0913_rt_priority, "Default priority of the timed operations with the fifo and rr policies");
\ No newline at end of file
@@ -0,0 +1,1246 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/*
+ * kt0913-harness.c
+ *
+ * Userspace tests and benchmarks of radio-kt0913-core.h. The init, tune,
+ * seek, scan and band switch sequences of the driver are the ones of the
+ * core, run here through its I/O ops against a fake register file that
+ * emulates the chip: STC, RSSI and stereo of a few stations, the AM antenna
+ * calibration, and the time spent on the bus and waiting for the chip. The
+ * time is only accounted, nothing sleeps, so a whole band scan takes
+ * microseconds.
+ *
+ *   kt0913-harness test [seed] [iterations]
+ *	unit tests of the core and its sequences on the fake, then random
+ *	ioctl and control sequences checked against the register file after
+ *	every step
+ *   kt0913-harness bench
+ *	core throughput
+ *
+ *  Copyright (c) 2020 Santiago Hormazabal <santiagohssl@gmail.com>
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "radio-kt0913-core.h"
+
+typedef uint64_t u64;
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define NSEC_PER_USEC ((u64)1000)
+#define NSEC_PER_MSEC ((u64)1000000)
+
+/* ************************************************************************* */
+
+/* emulated chip timings, nominal values rather than measured ones */
+#define FAKE_FM_TUNE_NS (20 * NSEC_PER_MSEC)	/* FM tune until STC */
+#define FAKE_AM_TUNE_NS (60 * NSEC_PER_MSEC)	/* AM, full calibration */
+#define FAKE_AM_CALI_NS (15 * NSEC_PER_MSEC)	/* AM, preloaded capacitor */
+#define FAKE_NOISE_RSSI 3U			/* RSSI away from stations */
+#define FAKE_REGS (KT0913_REG_AFC + 1)
+
+struct fake_station {
+	unsigned int band;
+	unsigned int khz;
+	u8 rssi;
+};
+
+static const struct fake_station fake_stations[] = {
+	{ BAND_FM, 88100, 24 },
+	{ BAND_FM, 91500, 18 },
+	{ BAND_FM, 97900, 28 },
+	{ BAND_FM, 104300, 14 },
+	{ BAND_AM, 540, 20 },
+	{ BAND_AM, 711, 16 },
+	{ BAND_AM, 1089, 25 },
+};
+
+struct fake_chip {
+	u16 regs[FAKE_REGS];
+	unsigned int byte_ns;		/* one byte plus ACK on the bus */
+	unsigned int busy_every;	/* another device is on the bus every N transfers */
+	bool stuck;			/* never sets STC */
+
+	u64 now_ns;			/* emulated clock */
+	u64 stc_at_ns;			/* when the tune in progress completes */
+	bool tuning;
+
+	/* totals, the ops take their deltas */
+	u64 xfers;
+	u64 bus_ns;
+	u64 lock_ns;
+	u64 chip_ns;
+};
+
+static bool fake_is_am(const struct fake_chip *chip)
+{
+	return kt0913_field_get(KT0913_F_AM_FM,
+		chip->regs[KT0913_REG_AMSYSCFG]) == KT0913_AMSYSCFG_AM_FM_AM;
+}
+
+/* antenna capacitor the AM calibration settles on */
+static u16 fake_cap_index(unsigned int khz)
+{
+	return 0x100 + (khz - KT0913_AM_RANGE_LOW) * 5;
+}
+
+/* the calibration is short if it starts on the capacitor of the sub-range */
+static bool fake_cap_near(u16 cap, unsigned int khz)
+{
+	unsigned int want = fake_cap_index(khz);
+
+	return (cap > want ? cap - want : want - cap) <
+		5 * KT0913_AMCALI_BIN_KHZ;
+}
+
+static u8 fake_rssi(unsigned int band, unsigned int khz)
+{
+	unsigned int i, d;
+	u8 best = FAKE_NOISE_RSSI;
+	int rssi;
+
+	for (i = 0; i < ARRAY_SIZE(fake_stations); i++) {
+		if ((fake_stations[i].band == BAND_AM) != (band == BAND_AM))
+			continue;
+		d = khz > fake_stations[i].khz ?
+			khz - fake_stations[i].khz : fake_stations[i].khz - khz;
+		/* FM drops 12 per 50kHz away, AM 2 per kHz */
+		rssi = fake_stations[i].rssi -
+			(band == BAND_AM ? d * 2 : d / 50 * 12);
+		if (rssi > best)
+			best = rssi;
+	}
+
+	return best;
+}
+
+/* the bus is also used by the other devices, wait for them */
+static void fake_transfer(struct fake_chip *chip, unsigned int bytes)
+{
+	u64 ns = (u64)bytes * chip->byte_ns;
+
+	chip->xfers++;
+	if (chip->busy_every && chip->xfers % chip->busy_every == 0) {
+		/* one word read of another device */
+		chip->lock_ns += 5ULL * chip->byte_ns;
+		chip->now_ns += 5ULL * chip->byte_ns;
+	}
+	chip->bus_ns += ns;
+	chip->now_ns += ns;
+}
+
+static void fake_complete(struct fake_chip *chip)
+{
+	unsigned int band, khz;
+	u8 rssi;
+
+	if (!chip->tuning || chip->stuck || chip->now_ns < chip->stc_at_ns)
+		return;
+
+	chip->tuning = false;
+	chip->regs[KT0913_REG_STATUSA] |= kt0913_field_prep(KT0913_F_STC, 1);
+
+	if (fake_is_am(chip)) {
+		band = BAND_AM;
+		khz = kt0913_reg_to_chan(BAND_AM, chip->regs[KT0913_REG_AMCHAN]);
+		rssi = fake_rssi(band, khz);
+		chip->regs[KT0913_REG_AMSTATUSA] = kt0913_field_prep(
+			KT0913_F_AMRSSI, rssi);
+		chip->regs[KT0913_REG_AMCALI] = kt0913_field_prep(
+			KT0913_F_CAP_INDEX, fake_cap_index(khz));
+	} else {
+		band = BAND_FM;
+		khz = kt0913_reg_to_chan(BAND_FM, chip->regs[KT0913_REG_TUNE]);
+		rssi = fake_rssi(band, khz);
+		chip->regs[KT0913_REG_STATUSA] &=
+			~(kt0913_field_mask(KT0913_F_FMRSSI) |
+			kt0913_field_mask(KT0913_F_ST));
+		chip->regs[KT0913_REG_STATUSA] |=
+			kt0913_field_prep(KT0913_F_FMRSSI, rssi) |
+			kt0913_field_prep(KT0913_F_ST, rssi >= 20 ?
+				KT0913_STATUSA_ST_STEREO : 0);
+	}
+}
+
+static void fake_start_tune(struct fake_chip *chip, u64 ns)
+{
+	chip->regs[KT0913_REG_STATUSA] &= ~kt0913_field_mask(KT0913_F_STC);
+	chip->tuning = true;
+	chip->stc_at_ns = chip->now_ns + ns;
+}
+
+/* the side effects of a register write, once it's on the chip */
+static void fake_store(struct fake_chip *chip, u8 reg, u16 val)
+{
+	unsigned int khz;
+
+	chip->regs[reg] = val;
+
+	if (reg == KT0913_REG_TUNE && !fake_is_am(chip) &&
+		kt0913_field_get(KT0913_F_FMTUNE, val))
+		fake_start_tune(chip, FAKE_FM_TUNE_NS);
+
+	if (reg == KT0913_REG_AMCHAN && fake_is_am(chip) &&
+		kt0913_field_get(KT0913_F_AMTUNE, val)) {
+		khz = kt0913_reg_to_chan(BAND_AM, val);
+		fake_start_tune(chip, fake_cap_near(kt0913_field_get(
+			KT0913_F_CAP_INDEX, chip->regs[KT0913_REG_AMCALI]), khz) ?
+			FAKE_AM_CALI_NS : FAKE_AM_TUNE_NS);
+	}
+}
+
+/* device address, register, two bytes */
+static void fake_write(struct fake_chip *chip, u8 reg, u16 val)
+{
+	fake_transfer(chip, 4);
+	fake_store(chip, reg, val);
+}
+
+/* device address and register, then address again and two bytes */
+static u16 fake_read(struct fake_chip *chip, u8 reg)
+{
+	fake_transfer(chip, 5);
+	fake_complete(chip);
+
+	return chip->regs[reg];
+}
+
+/* consecutive registers in one message */
+static void fake_burst_write(struct fake_chip *chip, u8 reg, const u16 *val,
+	unsigned int count)
+{
+	unsigned int i;
+
+	fake_transfer(chip, 2 + 2 * count);
+	for (i = 0; i < count; i++)
+		fake_store(chip, reg + i, val[i]);
+}
+
+static void fake_sleep(struct fake_chip *chip, u64 ns)
+{
+	chip->chip_ns += ns;
+	chip->now_ns += ns;
+}
+
+/* power-on state, with the values the init doesn't write */
+static void fake_reset(struct fake_chip *chip)
+{
+	memset(chip->regs, 0, sizeof(chip->regs));
+	chip->regs[KT0913_REG_CHIP_ID] = KT0913_CHIP_ID;
+	chip->regs[KT0913_REG_STATUSA] = kt0913_field_prep(KT0913_F_XTAL_OK, 1) |
+		kt0913_field_prep(KT0913_F_STC, 1) |
+		kt0913_field_prep(KT0913_F_PLL_LOCK, 1);
+	chip->regs[KT0913_REG_STATUSC] = kt0913_field_prep(KT0913_F_CHIPRDY, 1);
+	chip->tuning = false;
+}
+
+/* ************************************************************************* */
+
+/*
+ * the driver side: the I/O ops of the core on the fake, with the register
+ * cache kept on the fake itself. like the driver's regmap, the registers
+ * the chip doesn't change are never read back and unchanged field updates
+ * don't reach the bus.
+ */
+
+/* the kt0913_op of the core, and the ioctls only the harness accounts */
+enum {
+	H_OP_S_CTRL = KT0913_OP_COUNT,
+	H_OP_COUNT,
+};
+
+static const char * const h_op_names[H_OP_COUNT] = {
+	[KT0913_OP_INIT] = "init",
+	[KT0913_OP_S_FREQUENCY] = "s_frequency",
+	[KT0913_OP_G_TUNER] = "g_tuner",
+	[KT0913_OP_BAND_SWITCH] = "band_switch",
+	[KT0913_OP_TUNE] = "tune",
+	[KT0913_OP_SEEK] = "seek",
+	[KT0913_OP_SCAN] = "scan",
+	[H_OP_S_CTRL] = "s_ctrl",
+};
+
+struct h_stat {
+	u64 count;
+	u64 xfers;
+	u64 total_ns;
+	u64 max_ns;
+	u64 bus_ns;
+	u64 lock_ns;
+	u64 chip_ns;
+	u64 cpu_ns;
+};
+
+struct h_mark {
+	u64 now_ns;
+	u64 xfers;
+	u64 bus_ns;
+	u64 lock_ns;
+	u64 chip_ns;
+	u64 cpu_ns;
+};
+
+/* how the I/O ops reach the chip */
+enum h_io {
+	H_IO_BURST,		/* register runs in one message, cached reads */
+	H_IO_SMBUS,		/* runs one word at a time, as without I2C_FUNC_I2C */
+	H_IO_UNCACHED,		/* every register read back from the chip */
+};
+
+struct h_radio {
+	struct kt0913_core core;
+	struct fake_chip chip;
+	enum h_io io;
+
+	unsigned int fm_spacing;	/* kHz */
+	unsigned int am_spacing;	/* kHz */
+	bool campus;
+	bool auto_fine_tune;
+	bool amcali_cache;
+	unsigned long amtune_count[2];	/* by amcali_preloaded */
+	u64 amtune_ns[2];
+
+	unsigned int poll_us;
+	unsigned int timeout_ms;
+
+	s32 volume;
+	bool mute;
+	bool mono;
+	unsigned int deemphasis;
+
+	struct h_mark marks[KT0913_OP_COUNT];
+	struct h_stat stats[H_OP_COUNT];
+};
+
+static u64 h_cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void h_op_begin(struct h_radio *radio, struct h_mark *mark)
+{
+	mark->now_ns = radio->chip.now_ns;
+	mark->xfers = radio->chip.xfers;
+	mark->bus_ns = radio->chip.bus_ns;
+	mark->lock_ns = radio->chip.lock_ns;
+	mark->chip_ns = radio->chip.chip_ns;
+	mark->cpu_ns = h_cpu_ns();
+}
+
+/* emulated duration of the op */
+static u64 h_op_end(struct h_radio *radio, unsigned int op,
+	const struct h_mark *mark)
+{
+	struct h_stat *stat = &radio->stats[op];
+	u64 ns = radio->chip.now_ns - mark->now_ns;
+
+	stat->count++;
+	stat->xfers += radio->chip.xfers - mark->xfers;
+	stat->total_ns += ns;
+	if (ns > stat->max_ns)
+		stat->max_ns = ns;
+	stat->bus_ns += radio->chip.bus_ns - mark->bus_ns;
+	stat->lock_ns += radio->chip.lock_ns - mark->lock_ns;
+	stat->chip_ns += radio->chip.chip_ns - mark->chip_ns;
+	stat->cpu_ns += h_cpu_ns() - mark->cpu_ns;
+
+	return ns;
+}
+
+static unsigned int h_spacing(const struct h_radio *radio, unsigned int band)
+{
+	return band == BAND_AM ? radio->am_spacing : radio->fm_spacing;
+}
+
+static struct h_radio *h_core_to_radio(struct kt0913_core *core)
+{
+	return (struct h_radio *)((char *)core -
+		offsetof(struct h_radio, core));
+}
+
+/* the volatile registers of the driver's regmap */
+static bool h_volatile(u8 reg)
+{
+	return (reg >= KT0913_REG_STATUSA && reg <= KT0913_REG_STATUSC) ||
+		reg == KT0913_REG_AMCALI ||
+		(reg >= KT0913_REG_AMSTATUSA && reg <= KT0913_REG_AMSTATUSB) ||
+		(reg >= 0x2F && reg <= 0x32) || reg == 0x3A ||
+		reg == KT0913_REG_AFC;
+}
+
+static int h_io_read(struct kt0913_core *core, u8 reg, u16 *val)
+{
+	struct h_radio *radio = h_core_to_radio(core);
+	struct fake_chip *chip = &radio->chip;
+
+	*val = h_volatile(reg) || radio->io == H_IO_UNCACHED ?
+		fake_read(chip, reg) : chip->regs[reg];
+
+	return 0;
+}
+
+static int h_io_write(struct kt0913_core *core, u8 reg, u16 val)
+{
+	fake_write(&h_core_to_radio(core)->chip, reg, val);
+
+	return 0;
+}
+
+static int h_io_update_bits(struct kt0913_core *core, u8 reg, u16 mask,
+	u16 val)
+{
+	u16 old, new;
+
+	h_io_read(core, reg, &old);
+	new = (old & ~mask) | (val & mask);
+
+	if (new != old)
+		h_io_write(core, reg, new);
+
+	return 0;
+}
+
+static int h_io_bulk_write(struct kt0913_core *core, u8 reg, const u16 *val,
+	unsigned int count)
+{
+	struct h_radio *radio = h_core_to_radio(core);
+	unsigned int i;
+
+	if (radio->io != H_IO_SMBUS) {
+		fake_burst_write(&radio->chip, reg, val, count);
+		return 0;
+	}
+
+	for (i = 0; i < count; i++)
+		fake_write(&radio->chip, reg + i, val[i]);
+
+	return 0;
+}
+
+/* as __kt0913_wait_stc() */
+static int h_io_wait_stc(struct kt0913_core *core)
+{
+	struct h_radio *radio = h_core_to_radio(core);
+	u64 timeout = radio->chip.now_ns +
+		radio->timeout_ms * NSEC_PER_MSEC;
+
+	do {
+		fake_sleep(&radio->chip, radio->poll_us * NSEC_PER_USEC);
+		if (kt0913_field_get(KT0913_F_STC,
+			fake_read(&radio->chip, KT0913_REG_STATUSA)))
+			return 0;
+	} while (radio->chip.now_ns < timeout);
+
+	return -ETIMEDOUT;
+}
+
+static void h_io_op_begin(struct kt0913_core *core, enum kt0913_op op)
+{
+	struct h_radio *radio = h_core_to_radio(core);
+
+	h_op_begin(radio, &radio->marks[op]);
+}
+
+static void h_io_op_end(struct kt0913_core *core, enum kt0913_op op, int ret)
+{
+	struct h_radio *radio = h_core_to_radio(core);
+	bool preloaded = core->amcali_preloaded;
+	u64 ns;
+
+	ns = h_op_end(radio, op, &radio->marks[op]);
+
+	/* as kt0913_io_op_end(), for the amcali debugfs file */
+	if (op == KT0913_OP_TUNE && !ret && core->band == BAND_AM &&
+		radio->amcali_cache) {
+		radio->amtune_count[preloaded]++;
+		radio->amtune_ns[preloaded] += ns;
+	}
+}
+
+static const struct kt0913_core_ops h_core_ops = {
+	.read = h_io_read,
+	.write = h_io_write,
+	.update_bits = h_io_update_bits,
+	.bulk_write = h_io_bulk_write,
+	.wait_stc = h_io_wait_stc,
+	.op_begin = h_io_op_begin,
+	.op_end = h_io_op_end,
+};
+
+static void h_radio_setup(struct h_radio *radio, unsigned int bus_khz)
+{
+	memset(radio, 0, sizeof(*radio));
+	radio->chip.byte_ns = 9 * 1000000 / bus_khz;
+	fake_reset(&radio->chip);
+	radio->core.ops = &h_core_ops;
+	radio->core.amcali_cache = &radio->amcali_cache;
+
+	/* the driver defaults */
+	radio->fm_spacing = 50;
+	radio->am_spacing = 1;
+	radio->poll_us = 5000;
+	radio->timeout_ms = 250;
+	radio->amcali_cache = true;
+	radio->mute = true;
+}
+
+/* as __kt0913_init(), at probe */
+static int h_init(struct h_radio *radio)
+{
+	const struct kt0913_core_cfg cfg = {
+		.campus = radio->campus,
+		.mute = radio->mute,
+		.volume = radio->volume,
+		.fm_spacing = radio->fm_spacing,
+		.am_spacing = radio->am_spacing,
+		.band = BAND_FM,
+		.khz = KT0913_FM_DEFAULT,
+	};
+
+	return kt0913_core_init(&radio->core, &cfg);
+}
+
+/* the chip lost its registers, as __kt0913_check_reset() finds it */
+static void h_chip_reset(struct h_radio *radio)
+{
+	fake_reset(&radio->chip);
+	kt0913_core_amcali_drop(&radio->core);
+}
+
+/*
+ * VIDIOC_S_FREQUENCY, as kt0913_parse_frequency() and the plain path of
+ * __kt0913_do_s_frequency()
+ */
+static int h_s_frequency(struct h_radio *radio, u32 freq)
+{
+	struct h_mark mark;
+	unsigned int band, khz;
+	int ret;
+
+	if (!kt0913_parse_freq(freq, radio->campus, radio->fm_spacing,
+		radio->am_spacing, &band, &khz))
+		return -EINVAL;
+
+	h_op_begin(radio, &mark);
+	ret = kt0913_core_s_frequency(&radio->core, band, &khz,
+		radio->auto_fine_tune ? h_spacing(radio, band) : 0);
+	h_op_end(radio, KT0913_OP_S_FREQUENCY, &mark);
+
+	return ret < 0 ? ret : 0;
+}
+
+/* VIDIOC_G_TUNER: one status read, the rest comes from the cache */
+static int h_g_tuner(struct h_radio *radio, s32 *signal)
+{
+	struct h_mark mark;
+	u8 rssi;
+	int ret;
+
+	h_op_begin(radio, &mark);
+	ret = kt0913_core_get_raw_rssi(&radio->core, &rssi);
+	if (!ret)
+		*signal = kt0913_raw_rssi_to_signal(rssi);
+	h_op_end(radio, KT0913_OP_G_TUNER, &mark);
+
+	return ret;
+}
+
+/* VIDIOC_S_HW_FREQ_SEEK on the whole band, as __kt0913_seek() */
+static int h_seek(struct h_radio *radio, bool upward, bool wrap,
+	u32 spacing)
+{
+	unsigned int band = radio->core.band;
+	unsigned int low = kt0913_band_limits[band].low;
+	unsigned int high = kt0913_band_limits[band].high;
+
+	return kt0913_core_seek(&radio->core, low, high,
+		kt0913_seek_step(band, spacing ?: h_spacing(radio, band) * 1000,
+			low, high), upward, wrap);
+}
+
+enum h_ctrl { H_CTRL_VOLUME, H_CTRL_MUTE, H_CTRL_MONO, H_CTRL_DEEMPHASIS };
+
+/* the control paths of kt0913_s_ctrl() that reach a register */
+static int h_s_ctrl(struct h_radio *radio, enum h_ctrl id, s32 val)
+{
+	struct h_mark mark;
+	int ret = 0;
+
+	/* what the control framework rejects before s_ctrl */
+	if ((id == H_CTRL_VOLUME && (val < -60 || val > 0)) ||
+		(id == H_CTRL_DEEMPHASIS && (val < 1 || val > 2)))
+		return -ERANGE;
+
+	h_op_begin(radio, &mark);
+
+	switch (id) {
+	case H_CTRL_VOLUME:
+		radio->volume = val / 2 * 2;
+		ret = kt0913_core_field_write(&radio->core, KT0913_F_VOLUME,
+			kt0913_volume_to_reg(radio->volume));
+		break;
+	case H_CTRL_MUTE:
+		radio->mute = val;
+		ret = kt0913_core_set_mute(&radio->core, radio->mute);
+		break;
+	case H_CTRL_MONO:
+		radio->mono = val;
+		ret = kt0913_core_field_write(&radio->core, KT0913_F_MONO,
+			radio->mono ? KT0913_DSPCFGA_MONO_ON :
+			KT0913_DSPCFGA_MONO_OFF);
+		break;
+	case H_CTRL_DEEMPHASIS:
+		/* V4L2_DEEMPHASIS_50_uS is 1, 75_uS is 2 */
+		radio->deemphasis = val == 1 ?
+			KT0913_VOLUME_DE_50US : KT0913_VOLUME_DE_75US;
+		ret = kt0913_core_field_write(&radio->core, KT0913_F_DE,
+			radio->deemphasis);
+		break;
+	}
+
+	h_op_end(radio, H_OP_S_CTRL, &mark);
+
+	return ret;
+}
+
+/* ************************************************************************* */
+
+static unsigned int failures;
+
+#define CHECK(cond, ...) do {						\
+	if (!(cond)) {							\
+		failures++;						\
+		printf("FAIL %s:%d: %s: ", __func__, __LINE__, #cond);	\
+		printf(__VA_ARGS__);					\
+		printf("\n");						\
+	}								\
+} while (0)
+
+static void test_find_band(void)
+{
+	unsigned int band;
+
+	CHECK(kt0913_find_band(khz_to_v4l2_freq(500), false, &band) &&
+		band == BAND_AM, "500kHz");
+	CHECK(kt0913_find_band(khz_to_v4l2_freq(1710), false, &band) &&
+		band == BAND_AM, "1710kHz");
+	CHECK(kt0913_find_band(khz_to_v4l2_freq(64000), false, &band) &&
+		band == BAND_FM, "64MHz");
+	CHECK(!kt0913_find_band(khz_to_v4l2_freq(40000), false, &band),
+		"40MHz without campus");
+	CHECK(kt0913_find_band(khz_to_v4l2_freq(40000), true, &band) &&
+		band == BAND_FM_CAMUS, "40MHz with campus");
+	CHECK(!kt0913_find_band(khz_to_v4l2_freq(20000), true, &band),
+		"20MHz");
+}
+
+/* every channel is on the grid and inside its band */
+static void test_freq_to_chan(void)
+{
+	static const unsigned int fm_steps[] = { 50, 100, 200 };
+	static const unsigned int am_steps[] = { 1, 9, 10 };
+	unsigned int band, i, khz, chan, offset;
+
+	for (band = BAND_FM; band <= BAND_AM; band++) {
+		const unsigned int *steps = band == BAND_AM ? am_steps : fm_steps;
+
+		for (i = 0; i < 3; i++) {
+			offset = steps[i] == 200 ? 100 : 0;
+			for (khz = kt0913_band_limits[band].low;
+				khz <= kt0913_band_limits[band].high;
+				khz += band == BAND_AM ? 1 : 7) {
+				chan = kt0913_freq_to_chan(band,
+					khz_to_v4l2_freq(khz), steps[i]);
+				CHECK(chan >= kt0913_band_limits[band].low &&
+					chan <= kt0913_band_limits[band].high,
+					"band %u step %u: %u -> %u", band,
+					steps[i], khz, chan);
+				CHECK((chan - offset) % steps[i] == 0,
+					"band %u step %u: %u -> %u off grid",
+					band, steps[i], khz, chan);
+			}
+		}
+	}
+
+	CHECK(kt0913_freq_to_chan(BAND_FM, khz_to_v4l2_freq(88000), 200) ==
+		88100, "88MHz on the 200kHz grid");
+}
+
+static void test_chan_regs(void)
+{
+	unsigned int khz;
+
+	for (khz = KT0913_FM_RANGE_LOW_CAMPUS; khz <= KT0913_FM_RANGE_HIGH;
+		khz += KT0913_FMCHAN_MUL)
+		CHECK(kt0913_reg_to_chan(BAND_FM,
+			kt0913_chan_to_reg(BAND_FM, khz)) == khz, "FM %u", khz);
+	for (khz = KT0913_AM_RANGE_LOW; khz <= KT0913_AM_RANGE_HIGH; khz++)
+		CHECK(kt0913_reg_to_chan(BAND_AM,
+			kt0913_chan_to_reg(BAND_AM, khz)) == khz, "AM %u", khz);
+
+	CHECK(kt0913_volume_to_reg(-60) == 1 && kt0913_volume_to_reg(0) == 31,
+		"volume limits");
+	CHECK(kt0913_reg_to_afc(0x00FF) == -1, "negative AFC");
+	CHECK(kt0913_afc_chan(BAND_AM, 999, 20, 9) == 999, "AM has no AFC");
+	CHECK(kt0913_afc_chan(BAND_FM, 97800, 80, 100) == 97900, "AFC");
+}
+
+/*
+ * a wrapping seek visits each channel of the range at most once and ends,
+ * wherever it starts (e.g. 504kHz with 9kHz steps from 500kHz)
+ */
+static void test_seek_ends(void)
+{
+	static const unsigned int steps[] = { 1, 9, 10, 50, 100, 200 };
+	unsigned int band, i, start, freq, n, max, low, high;
+	int upward;
+
+	for (band = BAND_FM; band <= BAND_AM; band += 2) {
+		low = kt0913_band_limits[band].low;
+		high = kt0913_band_limits[band].high;
+		for (i = 0; i < ARRAY_SIZE(steps); i++) {
+			if ((band == BAND_AM) != (steps[i] < 50))
+				continue;
+			max = (high - low) / steps[i] + 1;
+			for (start = low; start <= high;
+				start += band == BAND_AM ? 1 : 13) {
+				for (upward = 0; upward < 2; upward++) {
+					freq = start;
+					n = 0;
+					while (n <= max && kt0913_seek_next(
+						&freq, start, low, high,
+						steps[i], upward, true))
+						n++;
+					CHECK(n <= max, "step %u from %u %s",
+						steps[i], start,
+						upward ? "up" : "down");
+				}
+			}
+		}
+	}
+
+	/* without wrap around it stops at the edge */
+	freq = 1705;
+	CHECK(kt0913_seek_next(&freq, 1705, 500, 1710, 9, true, false) == false,
+		"edge without wrap");
+}
+
+static void test_scan_best(void)
+{
+	const u8 quiet[] = { 1, 2, 3, 4 };
+	const u8 tie[] = { 5, 20, 9, 20 };
+
+	CHECK(kt0913_scan_best(BAND_FM, quiet, 4) == -1, "nothing above");
+	CHECK(kt0913_scan_best(BAND_FM, tie, 4) == 1, "lowest on a tie");
+}
+
+/* the seek of the driver on the fake, including the ones starting off grid */
+static void test_seek_fake(void)
+{
+	struct h_radio radio;
+	unsigned int start;
+
+	h_radio_setup(&radio, 400);
+	CHECK(!h_init(&radio), "init");
+
+	radio.fm_spacing = 100;
+	CHECK(!h_s_frequency(&radio, khz_to_v4l2_freq(96000)), "tune");
+	CHECK(!h_seek(&radio, true, true, 0) && radio.core.frequency == 97900,
+		"seek up found %u", radio.core.frequency);
+	CHECK(kt0913_field_get(KT0913_F_DMUTE,
+		radio.chip.regs[KT0913_REG_VOLUME]) == !radio.mute,
+		"mute restored");
+
+	radio.am_spacing = 9;
+	CHECK(!h_s_frequency(&radio, khz_to_v4l2_freq(504)), "tune AM");
+	CHECK(!h_seek(&radio, true, true, 0) && radio.core.frequency == 540,
+		"AM seek found %u", radio.core.frequency);
+
+	/* off the grid of the range and nothing strong enough: it must end */
+	CHECK(!h_s_frequency(&radio, khz_to_v4l2_freq(1700)), "tune AM");
+	start = radio.core.frequency;
+	CHECK(h_seek(&radio, true, true, 200000) == -ENODATA &&
+		radio.core.frequency == start && kt0913_reg_to_chan(BAND_AM,
+		radio.chip.regs[KT0913_REG_AMCHAN]) == start,
+		"AM seek 200kHz found %u", radio.core.frequency);
+}
+
+/* the boot state, and a band switch going out as a single burst to AM */
+static void test_init_switch(void)
+{
+	struct h_radio radio;
+	u64 xfers;
+
+	h_radio_setup(&radio, 400);
+	CHECK(!h_init(&radio), "init");
+	CHECK(radio.chip.regs[KT0913_REG_AMCFG2] == 0x4050 &&
+		kt0913_reg_to_chan(BAND_FM, radio.chip.regs[KT0913_REG_TUNE]) ==
+		KT0913_FM_DEFAULT && !kt0913_field_get(KT0913_F_DMUTE,
+		radio.chip.regs[KT0913_REG_VOLUME]), "boot registers");
+
+	radio.amcali_cache = false;
+	xfers = radio.chip.xfers;
+	CHECK(!h_s_frequency(&radio, khz_to_v4l2_freq(1089)), "to AM");
+	CHECK(radio.chip.xfers - xfers == 1 && fake_is_am(&radio.chip) &&
+		radio.core.band == BAND_AM, "AM in %" PRIu64 " transfers",
+		radio.chip.xfers - xfers);
+
+	xfers = radio.chip.xfers;
+	CHECK(!h_s_frequency(&radio, khz_to_v4l2_freq(97900)), "to FM");
+	CHECK(radio.chip.xfers - xfers == 2 && !fake_is_am(&radio.chip),
+		"FM in %" PRIu64 " transfers", radio.chip.xfers - xfers);
+	CHECK(radio.stats[KT0913_OP_BAND_SWITCH].count == 2 &&
+		radio.stats[KT0913_OP_INIT].count == 1, "ops reported");
+}
+
+/* the calibration is only kept from completed tunes, and dropped on reset */
+static void test_amcali(void)
+{
+	struct h_radio radio;
+	unsigned int bin = kt0913_amcali_bin(711);
+
+	h_radio_setup(&radio, 400);
+	CHECK(!h_init(&radio), "init");
+
+	radio.chip.stuck = true;
+	CHECK(kt0913_core_tune(&radio.core, BAND_AM, 711) == -ETIMEDOUT,
+		"stuck tune");
+	CHECK(!(radio.core.amcali_valid & (1U << bin)), "kept without STC");
+
+	radio.chip.stuck = false;
+	CHECK(!kt0913_core_tune(&radio.core, BAND_AM, 711), "tune");
+	CHECK((radio.core.amcali_valid & (1U << bin)) &&
+		radio.core.amcali[bin] == fake_cap_index(711), "captured");
+
+	CHECK(!kt0913_core_tune(&radio.core, BAND_AM, 712), "tune");
+	CHECK(radio.core.amcali_preloaded && radio.amtune_count[1] == 1,
+		"preloaded on the same sub-range");
+
+	h_chip_reset(&radio);
+	CHECK(!radio.core.amcali_valid, "dropped on reset");
+}
+
+/* ************************************************************************* */
+
+static u64 rng_state;
+
+static u32 rng(void)
+{
+	/* xorshift64* */
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return (rng_state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+/* the register file must always say what the driver state says */
+static bool fuzz_check(struct h_radio *radio, const char *what)
+{
+	const u16 *regs = radio->chip.regs;
+	unsigned int band = radio->core.band;
+	unsigned int khz = radio->core.frequency;
+	const struct kt0913_band_limits *limits = &kt0913_band_limits[band];
+	unsigned int before = failures;
+	unsigned int chan;
+
+	CHECK((band == BAND_AM) == fake_is_am(&radio->chip),
+		"%s: band %u", what, band);
+	CHECK(khz >= limits->low && khz <= limits->high,
+		"%s: %u kHz out of band %u", what, khz, band);
+	chan = kt0913_reg_to_chan(band, regs[band == BAND_AM ?
+		KT0913_REG_AMCHAN : KT0913_REG_TUNE]);
+	CHECK(chan == khz, "%s: chip on %u, driver on %u", what, chan, khz);
+	CHECK(kt0913_field_get(KT0913_F_VOLUME, regs[KT0913_REG_RXCFG]) ==
+		kt0913_volume_to_reg(radio->volume), "%s: volume", what);
+	CHECK(kt0913_field_get(KT0913_F_DMUTE, regs[KT0913_REG_VOLUME]) ==
+		!radio->mute, "%s: mute", what);
+	CHECK(kt0913_field_get(KT0913_F_MONO, regs[KT0913_REG_DSPCFGA]) ==
+		radio->mono, "%s: mono", what);
+	CHECK(kt0913_field_get(KT0913_F_DE, regs[KT0913_REG_VOLUME]) ==
+		radio->deemphasis, "%s: de-emphasis", what);
+	CHECK(!kt0913_field_get(KT0913_F_STDBY, regs[KT0913_REG_RXCFG]),
+		"%s: standby", what);
+
+	return failures == before;
+}
+
+/*
+ * random S_FREQUENCY, S_TUNER (mono), S_EXT_CTRLS, seek and scan calls,
+ * through the sequences of the core. each one must leave the registers
+ * consistent and finish within its bound: one STC timeout per tune plus
+ * the transfers around it.
+ */
+static void test_fuzz(u64 seed, unsigned int iterations)
+{
+	static const unsigned int fm_spacings[] = { 50, 100, 200 };
+	static const unsigned int am_spacings[] = { 1, 9, 10 };
+	struct h_radio radio;
+	struct h_mark mark;
+	u64 ns, bound, tune_ns;
+	unsigned int i, op, count, step, first, band;
+	const char *what;
+	u8 rssi[64];
+	s32 signal;
+
+	rng_state = seed ?: 1;
+	h_radio_setup(&radio, 400);
+	radio.campus = rng() & 1;
+	CHECK(!h_init(&radio), "init");
+	fuzz_check(&radio, "init");
+
+	/* a tune can take up to the timeout, plus a poll and some transfers */
+	tune_ns = radio.timeout_ms * NSEC_PER_MSEC +
+		radio.poll_us * NSEC_PER_USEC + 20ULL * 5 * radio.chip.byte_ns;
+
+	for (i = 0; i < iterations; i++) {
+		radio.fm_spacing = fm_spacings[rng() % 3];
+		radio.am_spacing = am_spacings[rng() % 3];
+		radio.auto_fine_tune = rng() & 1;
+		radio.chip.stuck = rng() % 64 == 0;
+		band = radio.core.band;
+
+		h_op_begin(&radio, &mark);
+		op = rng() % 6;
+		switch (op) {
+		case 0:
+			what = "s_frequency";
+			/* anything up to 120MHz, out of band ones included */
+			h_s_frequency(&radio, rng() % khz_to_v4l2_freq(120000));
+			/* the fine tune waits for it and may tune again */
+			bound = 2 * tune_ns;
+			break;
+		case 1:
+			what = "s_tuner";
+			h_s_ctrl(&radio, H_CTRL_MONO, rng() & 1);
+			bound = tune_ns;
+			break;
+		case 2:
+			what = "s_ext_ctrls";
+			h_s_ctrl(&radio, rng() % 4, (s32)(rng() % 80) - 70);
+			bound = tune_ns;
+			break;
+		case 3:
+			what = "seek";
+			/* FM channels are on 50kHz multiples */
+			step = rng() % 4 ? 0 : band == BAND_AM ?
+				(1 + rng() % 200) * 1000 :
+				(1 + rng() % 8) * 50000;
+			h_seek(&radio, rng() & 1, rng() & 1, step);
+			/* each channel once, with a 1kHz step at worst */
+			count = (kt0913_band_limits[band].high -
+				kt0913_band_limits[band].low) /
+				kt0913_seek_step(band, step ?:
+				h_spacing(&radio, band) * 1000,
+				kt0913_band_limits[band].low,
+				kt0913_band_limits[band].high) + 1;
+			bound = (count + 1) * tune_ns;
+			break;
+		case 4:
+			what = "scan";
+			step = h_spacing(&radio, band);
+			count = 1 + rng() % ARRAY_SIZE(rssi);
+			first = kt0913_freq_to_chan(band,
+				khz_to_v4l2_freq(kt0913_band_limits[band].low +
+				rng() % (kt0913_band_limits[band].high -
+				kt0913_band_limits[band].low)), step);
+			while (count > 1 && first + (count - 1) * step >
+				kt0913_band_limits[band].high)
+				count--;
+			kt0913_core_scan(&radio.core, band, first, step, count,
+				rssi);
+			bound = count * tune_ns;
+			break;
+		default:
+			what = "g_tuner";
+			if (!h_g_tuner(&radio, &signal))
+				CHECK(signal >= 0 && signal <= 65535,
+					"signal %d", signal);
+			bound = tune_ns;
+			break;
+		}
+		ns = radio.chip.now_ns - mark.now_ns;
+
+		if (!fuzz_check(&radio, what)) {
+			printf("  at iteration %u, seed %" PRIu64 "\n", i, seed);
+			break;
+		}
+		if (ns > bound) {
+			CHECK(ns <= bound, "%s took %" PRIu64 " us, bound %"
+				PRIu64 " us", what, ns / NSEC_PER_USEC,
+				bound / NSEC_PER_USEC);
+			break;
+		}
+	}
+
+	printf("fuzz: %u iterations, seed %" PRIu64 "\n", i, seed);
+	printf("op count avg_us max_us xfers\n");
+	for (op = 0; op < H_OP_COUNT; op++) {
+		struct h_stat *stat = &radio.stats[op];
+
+		if (!stat->count)
+			continue;
+		printf("%s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+			h_op_names[op], stat->count,
+			stat->total_ns / stat->count / NSEC_PER_USEC,
+			stat->max_ns / NSEC_PER_USEC, stat->xfers / stat->count);
+	}
+}
+
+static int run_tests(u64 seed, unsigned int iterations)
+{
+	test_find_band();
+	test_freq_to_chan();
+	test_chan_regs();
+	test_seek_ends();
+	test_scan_best();
+	test_seek_fake();
+	test_init_switch();
+	test_amcali();
+	test_fuzz(seed, iterations);
+
+	printf("%s: %u failures\n", failures ? "FAILED" : "PASSED", failures);
+
+	return failures ? 1 : 0;
+}
+
+/* ************************************************************************* */
+
+static volatile unsigned int bench_sink;
+
+/* millions of calls per second of the hot core functions */
+static void bench_core(void)
+{
+	const unsigned int n = 10000000;
+	u8 rssi[256];
+	unsigned int i, band = 0;
+	u64 start;
+
+	for (i = 0; i < ARRAY_SIZE(rssi); i++)
+		rssi[i] = i * 7 % 32;
+
+	printf("core Mcalls/s\n");
+
+	start = h_cpu_ns();
+	for (i = 0; i < n; i++)
+		bench_sink += kt0913_freq_to_chan(BAND_FM,
+			khz_to_v4l2_freq(64000 + i % 46000), 50);
+	printf("freq_to_chan %" PRIu64 "\n", (u64)n * 1000 /
+		(h_cpu_ns() - start + 1));
+
+	start = h_cpu_ns();
+	for (i = 0; i < n; i++) {
+		kt0913_find_band(i * 37 % khz_to_v4l2_freq(110000), true, &band);
+		bench_sink += band;
+	}
+	printf("find_band %" PRIu64 "\n", (u64)n * 1000 /
+		(h_cpu_ns() - start + 1));
+
+	start = h_cpu_ns();
+	for (i = 0; i < n; i++)
+		bench_sink += kt0913_raw_rssi_to_dbm(i & 2,
+			kt0913_status_to_raw_rssi(i & 2, i));
+	printf("status_to_dbm %" PRIu64 "\n", (u64)n * 1000 /
+		(h_cpu_ns() - start + 1));
+
+	start = h_cpu_ns();
+	for (i = 0; i < n / 256; i++)
+		bench_sink += kt0913_scan_best(BAND_FM, rssi, 256);
+	printf("scan_best_256 %" PRIu64 "\n", (u64)n / 256 * 1000 /
+		(h_cpu_ns() - start + 1));
+}
+
+/* the largest of bus, chip, cpu and lock bounds the op, as in op_stats */
+static void bench_print_stats(const struct h_radio *radio,
+	unsigned int bus_khz, unsigned int busy_every)
+{
+	static const char * const bounds[] = { "bus", "chip", "cpu", "lock" };
+	unsigned int op, j, bound;
+	u64 avg[4];
+
+	for (op = 0; op < H_OP_COUNT; op++) {
+		const struct h_stat *stat = &radio->stats[op];
+
+		if (!stat->count)
+			continue;
+
+		avg[0] = stat->bus_ns / stat->count;
+		avg[1] = stat->chip_ns / stat->count;
+		avg[2] = stat->cpu_ns / stat->count;
+		avg[3] = stat->lock_ns / stat->count;
+		bound = 0;
+		for (j = 1; j < 4; j++)
+			if (avg[j] > avg[bound])
+				bound = j;
+
+		printf("%u %u %s %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+			" %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n",
+			bus_khz, busy_every, h_op_names[op], stat->count,
+			stat->xfers / stat->count,
+			stat->total_ns / stat->count / NSEC_PER_USEC,
+			avg[0] / NSEC_PER_USEC, avg[1] / NSEC_PER_USEC,
+			avg[2], avg[3] / NSEC_PER_USEC, bounds[bound]);
+	}
+}
+
+/*
+ * the ops of the core at 100kHz, 400kHz and 1MHz, alone on the bus and
+ * sharing it with another device that gets in every other transfer
+ */
+static void bench_ops(void)
+{
+	static const unsigned int speeds[] = { 100, 400, 1000 };
+	static const unsigned int sharing[] = { 0, 2 };
+	struct h_radio radio;
+	unsigned int i, j, k;
+	u8 rssi[512];
+	s32 signal;
+
+	printf("bus_khz shared op count xfers avg_us bus_us chip_us cpu_ns lock_us bound\n");
+
+	for (i = 0; i < ARRAY_SIZE(speeds); i++) {
+		for (j = 0; j < ARRAY_SIZE(sharing); j++) {
+			h_radio_setup(&radio, speeds[i]);
+			radio.chip.busy_every = sharing[j];
+			radio.fm_spacing = 100;
+			radio.am_spacing = 9;
+
+			h_init(&radio);
+			for (k = 0; k < 32; k++) {
+				h_s_frequency(&radio, khz_to_v4l2_freq(
+					88000 + k * 500));
+				h_g_tuner(&radio, &signal);
+			}
+			for (k = 0; k < 8; k++) {
+				h_s_frequency(&radio, khz_to_v4l2_freq(
+					k & 1 ? 96000 : 603));
+				h_seek(&radio, true, true, 0);
+			}
+			h_s_frequency(&radio, khz_to_v4l2_freq(87500));
+			kt0913_core_scan(&radio.core, BAND_FM, 87500, 100,
+				(108000 - 87500) / 100 + 1, rssi);
+
+			bench_print_stats(&radio, speeds[i], sharing[j]);
+		}
+	}
+}
+
+/*
+ * AM tunes to STC, each sub-range cold and then warm, and with no cache.
+ * the tunes jump across the band, so the chip rarely starts the
+ * calibration from a capacitor close to the right one on its own.
+ */
+static void bench_amcali(void)
+{
+	struct h_radio radio;
+	const struct h_stat *tune;
+	unsigned int pass, i, khz;
+	int cache;
+
+	printf("amcali tunes avg_us\n");
+
+	for (cache = 1; cache >= 0; cache--) {
+		h_radio_setup(&radio, 400);
+		radio.amcali_cache = cache;
+		h_init(&radio);
+		memset(radio.stats, 0, sizeof(radio.stats));
+		for (pass = 0; pass < 2; pass++) {
+			for (i = 0; i < 120; i++) {
+				khz = i & 1 ? 1602 - 9 * (i / 2) :
+					531 + 9 * (i / 2);
+				kt0913_core_tune(&radio.core, BAND_AM, khz);
+			}
+		}
+
+		if (cache) {
+			printf("uncalibrated %lu %" PRIu64 "\n",
+				radio.amtune_count[0], radio.amtune_ns[0] /
+				(radio.amtune_count[0] ?: 1) / NSEC_PER_USEC);
+			printf("preloaded %lu %" PRIu64 "\n",
+				radio.amtune_count[1], radio.amtune_ns[1] /
+				(radio.amtune_count[1] ?: 1) / NSEC_PER_USEC);
+		} else {
+			/* the first one switches band too */
+			tune = &radio.stats[KT0913_OP_TUNE];
+			printf("no_cache %" PRIu64 " %" PRIu64 "\n",
+				tune->count, tune->total_ns / tune->count /
+				NSEC_PER_USEC);
+		}
+	}
+}
+
+/* FM <-> AM, the band switch alone and up to STC, by how it's written */
+static void bench_band_switch(void)
+{
+	static const char * const modes[] = { "burst", "smbus", "uncached" };
+	static const unsigned int speeds[] = { 100, 400 };
+	struct h_radio radio;
+	unsigned int i, m, k;
+	const struct h_stat *sw, *tune;
+
+	printf("band_switch bus_khz switches xfers switch_us tune_us\n");
+
+	for (i = 0; i < ARRAY_SIZE(speeds); i++) {
+		for (m = 0; m < ARRAY_SIZE(modes); m++) {
+			h_radio_setup(&radio, speeds[i]);
+			radio.io = m;
+			h_init(&radio);
+			memset(radio.stats, 0, sizeof(radio.stats));
+
+			for (k = 0; k < 64; k++) {
+				if (k & 1)
+					kt0913_core_tune(&radio.core, BAND_FM,
+						97900);
+				else
+					kt0913_core_tune(&radio.core, BAND_AM,
+						1089);
+			}
+
+			sw = &radio.stats[KT0913_OP_BAND_SWITCH];
+			tune = &radio.stats[KT0913_OP_TUNE];
+			printf("%s %u %" PRIu64 " %" PRIu64 " %" PRIu64 " %"
+				PRIu64 "\n", modes[m], speeds[i], sw->count,
+				sw->xfers / sw->count,
+				sw->total_ns / sw->count / NSEC_PER_USEC,
+				tune->total_ns / tune->count / NSEC_PER_USEC);
+		}
+	}
+}
+
+static int run_bench(void)
+{
+	bench_core();
+	printf("\n");
+	bench_ops();
+	printf("\n");
+	bench_amcali();
+	printf("\n");
+	bench_band_switch();
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && !strcmp(argv[1], "test"))
+		return run_tests(argc >= 3 ? strtoull(argv[2], NULL, 0) :
+			(u64)time(NULL), argc >= 4 ?
+			strtoul(argv[3], NULL, 0) : 100000);
+	if (argc >= 2 && !strcmp(argv[1], "bench"))
+		return run_bench();
+
+	fprintf(stderr, "usage: %s test [seed] [iterations] | bench\n",
+		argv[0]);
+
+	return 2;
+}